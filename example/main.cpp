@@ -17,11 +17,12 @@
 
 #include <iostream>
 
-#include "diamond/bg_page_writer.h"
 #include "diamond/db.h"
 #include "diamond/lru_eviction_policy.h"
 #include "diamond/file_storage.h"
 #include "diamond/partitioned_page_manager.h"
+#include "diamond/sync_page_writer.h"
+#include "diamond/write_ahead_log.h"
 
 class Person {
 public:
@@ -56,21 +57,25 @@ std::vector<Person> people = {
 
 int main() {
 
+    // Pages go through the write-ahead log, so a crash never leaves the database half written
     diamond::FileStorage storage("diamond");
-    diamond::BgPageWriterQueue page_writer_queue(storage);
-    diamond::BgPageWriterFactory page_writer_factory(page_writer_queue);
+    diamond::FileStorage log_storage("diamond.log");
+    diamond::WriteAheadLog wal(log_storage, storage);
+    diamond::SyncPageWriterFactory page_writer_factory(wal);
     diamond::LRUEvictionPolicyFactory eviction_policy_factory;
     diamond::PartitionedPageManager manager(
-        storage,
+        wal,
         page_writer_factory,
         eviction_policy_factory);
-    diamond::StorageEngine engine(manager);
+    diamond::StorageEngine engine(manager, nullptr, &wal);
     diamond::Db db(engine);
 
     for (Person& person : people) {
         std::string key = person.first_name + " " + person.last_name;
         db.put<Person>(key, person);
     }
+    // Waits for the puts to be committed to the log
+    db.sync();
 
     std::cout << "people count: " << db.count<Person>() << std::endl;
 
@@ -35,6 +35,8 @@ namespace diamond {
         BgPageWriter(BgPageWriterQueue& queue);
 
         virtual void write(const Page* page) override;
+        virtual void flush() override;
+        virtual bool is_synchronous() const override;
 
     private:
         BgPageWriterQueue& _queue;
@@ -49,6 +51,8 @@ namespace diamond {
         ~BgPageWriterQueue();
 
         void enqueue_write(const Page* page);
+        // Writes every queued page now
+        void flush();
 
     private:
         Storage& _storage;
@@ -57,6 +61,8 @@ namespace diamond {
 
         boost::thread _thread;
         boost::mutex _mutex;
+        // Held while writing, so a flush returns only once a batch taken before it is written
+        boost::mutex _write_mutex;
 
         struct BatchItem {
             BatchItem(Buffer _buffer, uint64_t _pos);
@@ -71,6 +77,7 @@ namespace diamond {
         std::list<Batch>::iterator _current_batch;
 
         void bg_task();
+        void write_batch(const Batch& batch);
     };
 
     class BgPageWriterFactory : public PageWriterFactory {
@@ -0,0 +1,56 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_BG_VALUE_LOG_COLLECTOR_H
+#define _DIAMOND_BG_VALUE_LOG_COLLECTOR_H
+
+#include <atomic>
+
+#include <boost/thread.hpp>
+
+#include "diamond/storage_engine.h"
+
+namespace diamond {
+
+    // Collects the garbage of a StorageEngine's value log in a background thread.
+    class BgValueLogCollector final : boost::noncopyable {
+    public:
+        static const uint64_t DELAY = 1000;
+        // Share of a segment's size that has to be garbage for it to be collected
+        static const double DEFAULT_MIN_GARBAGE_RATIO;
+
+        BgValueLogCollector(
+            StorageEngine& storage_engine,
+            double min_garbage_ratio = DEFAULT_MIN_GARBAGE_RATIO,
+            StorageEngine::Compare compare_func = &StorageEngine::default_compare);
+        ~BgValueLogCollector();
+
+    private:
+        StorageEngine& _storage_engine;
+        double _min_garbage_ratio;
+        StorageEngine::Compare _compare_func;
+
+        std::atomic_bool _stop;
+
+        boost::thread _thread;
+
+        void bg_task();
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_BG_VALUE_LOG_COLLECTOR_H
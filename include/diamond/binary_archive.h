@@ -18,6 +18,8 @@
 #ifndef _DIAMOND_BINARY_ARCHIVE_H
 #define _DIAMOND_BINARY_ARCHIVE_H
 
+#include <memory>
+
 #include "diamond/buffer.h"
 #include "diamond/base_archive.h"
 
@@ -26,9 +28,11 @@ namespace diamond {
     class BinaryIArchive final : public BaseIArchive<BinaryIArchive> {
     public:
         BinaryIArchive(const Buffer& buffer);
+        BinaryIArchive(Reader& reader);
 
     private:
-        BufferReader _reader;
+        std::unique_ptr<BufferReader> _buffer_reader;
+        Reader& _reader;
 
         friend class BaseIArchive<BinaryIArchive>;
 
@@ -20,6 +20,7 @@
 
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <type_traits>
 
 #include "diamond/endian.h"
@@ -30,6 +31,9 @@ namespace diamond {
 
     class Buffer {
     public:
+        // Buffers of a whole number of ALIGNMENT bytes are aligned to it, so pages copied into them can be written with O_DIRECT
+        static constexpr size_t ALIGNMENT = 4096;
+
         Buffer();
         Buffer(size_t size);
         Buffer(const char* buffer);
@@ -51,6 +55,8 @@ namespace diamond {
         void write_to_storage(Storage& storage, uint64_t offset) const;
 
         std::string to_str() const;
+        // Views the bytes without copying them, only valid while the buffer is.
+        operator std::string_view() const;
 
         char operator[](size_t i) const;
 
@@ -68,30 +74,28 @@ namespace diamond {
             }
         };
 
+        // Hashes the bytes a word at a time, the same way std::string is hashed
         struct Hash {
             size_t operator()(const Buffer& buffer) const {
-                size_t res = 0;
-                const size_t prime = 31;
-                for (size_t i = 0; i < buffer.size(); i++) {
-                    res = buffer[i] + (res * prime);
-                }
-                return res;
+                return std::hash<std::string_view>()(std::string_view(buffer.buffer(), buffer.size()));
             }
         };
 
     private:
         size_t _size;
         char* _buffer;
+
+        static char* allocate(size_t size);
+        static void deallocate(char* buffer, size_t size);
     };
 
-    class BufferReader {
+    // Reads values from a sequential source of bytes.
+    class Reader {
     public:
-        BufferReader(
-            const Buffer& buffer,
-            endian::Endianness endianness = endian::Endianness::BIG);
+        Reader(endian::Endianness endianness = endian::Endianness::BIG);
+        virtual ~Reader() = default;
 
-        size_t bytes_read() const;
-        size_t bytes_remaining() const;
+        virtual void read(void* val, size_t size) = 0;
 
         template <class T>
         typename std::enable_if<
@@ -110,16 +114,29 @@ namespace diamond {
         typename std::enable_if<std::is_arithmetic<T>::value, T>::type
         read();
 
-        void read(Buffer& buffer);
-        void read(void* val, size_t size);
-
         template <class T>
-        BufferReader& operator>>(T& val);
+        Reader& operator>>(T& val);
+
+    protected:
+        endian::Endianness _endianness;
+    };
+
+    class BufferReader : public Reader {
+    public:
+        BufferReader(
+            const Buffer& buffer,
+            endian::Endianness endianness = endian::Endianness::BIG);
+
+        size_t bytes_read() const;
+        size_t bytes_remaining() const;
+
+        using Reader::read;
+        void read(Buffer& buffer);
+        void read(void* val, size_t size) override;
 
     private:
         size_t _ptr;
         const Buffer& _buffer;
-        endian::Endianness _endianness;
     };
 
     class BufferWriter {
@@ -168,7 +185,7 @@ namespace diamond {
         std::is_trivially_copyable<T>::value,
         T
     >::type
-    BufferReader::read() {
+    Reader::read() {
         T val;
         read(&val, sizeof(T));
         return val;
@@ -176,13 +193,13 @@ namespace diamond {
 
     template<class T>
     typename std::enable_if<std::is_enum<T>::value, T>::type
-    BufferReader::read() {
+    Reader::read() {
         return static_cast<T>(read<typename std::underlying_type<T>::type>());
     }
 
     template<class T>
     typename std::enable_if<std::is_arithmetic<T>::value, T>::type
-    BufferReader::read() {
+    Reader::read() {
         T val;
         read(&val, sizeof(T));
         if (_endianness != endian::HOST_ORDER) {
@@ -192,7 +209,7 @@ namespace diamond {
     }
 
     template <class T>
-    BufferReader& BufferReader::operator>>(T& val) {
+    Reader& Reader::operator>>(T& val) {
         val = read<T>();
         return *this;
     }
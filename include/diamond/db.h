@@ -18,6 +18,8 @@
 #ifndef _DIAMOND_DB_H
 #define _DIAMOND_DB_H
 
+#include <atomic>
+
 #include "diamond/binary_archive.h"
 #include "diamond/storage_engine.h"
 
@@ -36,6 +38,16 @@ namespace diamond {
 
             Query& where(Condition condition);
             Query& top(uint64_t n);
+            // Only reads the records with keys from start up to, but not including, end
+            Query& range(Buffer start, Buffer end);
+            // Reads the records from the last key to the first
+            Query& reverse();
+            /*
+                Reads a snapshot, so the records are those of one point in time and
+                writers aren't held up by the ones being checked. Without it, the leaf
+                being read stays locked while its records are checked.
+            */
+            Query& snapshot();
 
             std::vector<T> execute();
 
@@ -43,15 +55,49 @@ namespace diamond {
             friend class Db;
 
             StorageEngine& _storage_engine;
+            StorageEngine::CollectionHandle _handle;
 
             Condition _condition;
             uint64_t _top;
+            std::optional<Buffer> _range_start;
+            std::optional<Buffer> _range_end;
+            bool _reverse;
+            bool _snapshot;
+
+            Query(StorageEngine& storage_engine, StorageEngine::CollectionHandle handle);
+
+            std::vector<T> read(StorageEngine::Iterator& iter);
+        };
+
+        /*
+            The collection of the records of type T, looked up once so its operations
+            skip working out the collection's name and finding it.
+        */
+        template <class T>
+        class Collection {
+        public:
+            bool exists(const Buffer& key);
+            uint64_t count();
+            T get(const Buffer& key);
+            std::vector<std::optional<T>> multi_get(const std::vector<Buffer>& keys);
+            void put(Buffer key, T& record);
+            bool remove(const Buffer& key);
+            Query<T> query();
+
+        private:
+            friend class Db;
+
+            StorageEngine& _storage_engine;
+            StorageEngine::CollectionHandle _handle;
 
-            Query(StorageEngine& storage_engine);
+            Collection(StorageEngine& storage_engine, StorageEngine::CollectionHandle handle);
         };
 
         Db(StorageEngine& storage_engine);
 
+        template <class T>
+        Collection<T> collection();
+
         template <class T>
         bool exists(const Buffer& key);
 
@@ -61,71 +107,219 @@ namespace diamond {
         template <class T>
         T get(const Buffer& key);
 
+        // Gets the records of keys in their order, with no record for keys that don't exist
+        template <class T>
+        std::vector<std::optional<T>> multi_get(const std::vector<Buffer>& keys);
+
         template <class T>
         void put(Buffer key, T& record);
 
+        template <class T>
+        bool remove(const Buffer& key);
+
+        // Adds the put or remove to batch, it takes effect once the batch is written
+        template <class T>
+        void put(WriteBatch& batch, Buffer key, T& record);
+
+        template <class T>
+        void remove(WriteBatch& batch, Buffer key);
+
+        void write(const WriteBatch& batch);
+
+        /*
+            Returns once every write made so far is durable. Given a WriteAheadLog,
+            the storage engine waits for the batch holding them to be committed.
+        */
+        void sync();
+
         template <class T>
         Query<T> query();
 
     private:
         StorageEngine& _storage_engine;
+        // Tells Dbs apart in the handles cached by collection, unlike their addresses it's never reused
+        const uint64_t _id;
+
+        static uint64_t next_id();
 
         template <class T>
-        static std::string collection_name();
+        static const Buffer& collection_name();
     };
 
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    Db<TIArchive, TOArchive>::Collection<T>::Collection(
+            StorageEngine& storage_engine,
+            StorageEngine::CollectionHandle handle)
+        : _storage_engine(storage_engine),
+        _handle(handle) {}
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    bool Db<TIArchive, TOArchive>::Collection<T>::exists(const Buffer& key) {
+        return _storage_engine.exists(_handle, key);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    uint64_t Db<TIArchive, TOArchive>::Collection<T>::count() {
+        return _storage_engine.count(_handle);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    T Db<TIArchive, TOArchive>::Collection<T>::get(const Buffer& key) {
+        StorageEngine::ValueReader reader = _storage_engine.get_reader(_handle, key);
+        T obj;
+        TIArchive i_archive(reader);
+        i_archive >> obj;
+        return obj;
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    std::vector<std::optional<T>> Db<TIArchive, TOArchive>::Collection<T>::multi_get(const std::vector<Buffer>& keys) {
+        std::vector<std::optional<Buffer>> vals = _storage_engine.multi_get(_handle, keys);
+        std::vector<std::optional<T>> objs(vals.size());
+        for (size_t i = 0; i < vals.size(); i++) {
+            if (!vals[i]) continue;
+            TIArchive i_archive(*vals[i]);
+            i_archive >> objs[i].emplace();
+        }
+        return objs;
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    void Db<TIArchive, TOArchive>::Collection<T>::put(Buffer key, T& record) {
+        Buffer value;
+        TOArchive o_archive(value);
+        o_archive << record;
+        _storage_engine.put(_handle, std::move(key), std::move(value));
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    bool Db<TIArchive, TOArchive>::Collection<T>::remove(const Buffer& key) {
+        return _storage_engine.erase(_handle, key);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    Db<TIArchive, TOArchive>::Query<T> Db<TIArchive, TOArchive>::Collection<T>::query() {
+        return Query<T>(_storage_engine, _handle);
+    }
+
     template <class TIArchive, class TOArchive>
     Db<TIArchive, TOArchive>::Db(StorageEngine& storage_engine)
-        : _storage_engine(storage_engine) {}
+        : _storage_engine(storage_engine),
+        _id(next_id()) {}
+
+    /*
+        Each thread keeps the handle of T's collection from the last Db it was looked
+        up in, so the operations of a Db on T only look the collection up once.
+    */
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    Db<TIArchive, TOArchive>::Collection<T> Db<TIArchive, TOArchive>::collection() {
+        thread_local uint64_t db_id = 0;
+        thread_local std::optional<StorageEngine::CollectionHandle> handle;
+        if (db_id != _id) {
+            handle = _storage_engine.get_collection(collection_name<T>());
+            db_id = _id;
+        }
+        return Collection<T>(_storage_engine, *handle);
+    }
 
     template <class TIArchive, class TOArchive>
     template <class T>
     uint64_t Db<TIArchive, TOArchive>::count() {
-        return _storage_engine.count(collection_name<T>());
+        return collection<T>().count();
     }
 
     template <class TIArchive, class TOArchive>
     template <class T>
     bool Db<TIArchive, TOArchive>::exists(const Buffer& key) {
-        return _storage_engine.exists(collection_name<T>(), key);
+        return collection<T>().exists(key);
     }
 
     template <class TIArchive, class TOArchive>
     template <class T>
     T Db<TIArchive, TOArchive>::get(const Buffer& key) {
-        Buffer value = _storage_engine.get(collection_name<T>(), key);
-        T obj;
-        TIArchive i_archive(value);
-        i_archive >> obj;
-        return obj;
+        return collection<T>().get(key);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    std::vector<std::optional<T>> Db<TIArchive, TOArchive>::multi_get(const std::vector<Buffer>& keys) {
+        return collection<T>().multi_get(keys);
     }
 
     template <class TIArchive, class TOArchive>
     template <class T>
-    void Db<TIArchive, TOArchive>::put(Buffer key, T& record) {;
+    void Db<TIArchive, TOArchive>::put(Buffer key, T& record) {
+        collection<T>().put(std::move(key), record);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    bool Db<TIArchive, TOArchive>::remove(const Buffer& key) {
+        return collection<T>().remove(key);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    void Db<TIArchive, TOArchive>::put(WriteBatch& batch, Buffer key, T& record) {
         Buffer value;
         TOArchive o_archive(value);
         o_archive << record;
-        _storage_engine.put(collection_name<T>(), std::move(key), std::move(value));
+        batch.put(collection_name<T>(), std::move(key), std::move(value));
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    void Db<TIArchive, TOArchive>::remove(WriteBatch& batch, Buffer key) {
+        batch.erase(collection_name<T>(), std::move(key));
+    }
+
+    template <class TIArchive, class TOArchive>
+    void Db<TIArchive, TOArchive>::write(const WriteBatch& batch) {
+        _storage_engine.write(batch);
+    }
+
+    template <class TIArchive, class TOArchive>
+    void Db<TIArchive, TOArchive>::sync() {
+        _storage_engine.sync();
     }
 
     template <class TIArchive, class TOArchive>
     template <class T>
     Db<TIArchive, TOArchive>::Query<T> Db<TIArchive, TOArchive>::query() {
-        return Query<T>(_storage_engine);
+        return collection<T>().query();
+    }
+
+    template <class TIArchive, class TOArchive>
+    uint64_t Db<TIArchive, TOArchive>::next_id() {
+        static std::atomic<uint64_t> id(1);
+        return id++;
     }
 
+    // The name is worked out once per type
     template <class TIArchive, class TOArchive>
     template <class T>
-    std::string Db<TIArchive, TOArchive>::collection_name() {
-        return boost::typeindex::type_id<T>().pretty_name();
+    const Buffer& Db<TIArchive, TOArchive>::collection_name() {
+        static const Buffer name(boost::typeindex::type_id<T>().pretty_name());
+        return name;
     }
 
     template <class TIArchive, class TOArchive>
     template <class T>
-    Db<TIArchive, TOArchive>::Query<T>::Query(StorageEngine& storage_engine)
+    Db<TIArchive, TOArchive>::Query<T>::Query(StorageEngine& storage_engine, StorageEngine::CollectionHandle handle)
         : _storage_engine(storage_engine),
-        _top(0) {}
+        _handle(handle),
+        _top(0),
+        _reverse(false),
+        _snapshot(false) {}
 
     template <class TIArchive, class TOArchive>
     template <class T>
@@ -144,23 +338,69 @@ namespace diamond {
         return *this;
     }
 
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    Db<TIArchive, TOArchive>::Query<T>&
+    Db<TIArchive, TOArchive>::Query<T>::range(Buffer start, Buffer end) {
+        _range_start = std::move(start);
+        _range_end = std::move(end);
+        return *this;
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    Db<TIArchive, TOArchive>::Query<T>&
+    Db<TIArchive, TOArchive>::Query<T>::reverse() {
+        _reverse = true;
+        return *this;
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    Db<TIArchive, TOArchive>::Query<T>&
+    Db<TIArchive, TOArchive>::Query<T>::snapshot() {
+        _snapshot = true;
+        return *this;
+    }
+
     template <class TIArchive, class TOArchive>
     template <class T>
     std::vector<T>
     Db<TIArchive, TOArchive>::Query<T>::execute() {
+        if (!_snapshot) {
+            StorageEngine::Iterator iter = _range_start ?
+                _storage_engine.get_iterator(_handle, *_range_start, *_range_end) :
+                _storage_engine.get_iterator(_handle);
+            return read(iter);
+        }
+
+        StorageEngine::Snapshot snapshot = _storage_engine.get_snapshot();
+        StorageEngine::Iterator iter = _range_start ?
+            _storage_engine.get_iterator(_handle, *_range_start, *_range_end, snapshot) :
+            _storage_engine.get_iterator(_handle, snapshot);
+        return read(iter);
+    }
+
+    template <class TIArchive, class TOArchive>
+    template <class T>
+    std::vector<T>
+    Db<TIArchive, TOArchive>::Query<T>::read(StorageEngine::Iterator& iter) {
         std::vector<T> result;
-        StorageEngine::Iterator iter = _storage_engine.get_iterator(
-            collection_name<T>());
+        if (_reverse) iter.seek_to_last();
         while (!iter.end()) {
-            Buffer value = iter.val();
+            StorageEngine::ValueReader reader = iter.val_reader();
             T obj;
-            TIArchive i_archive(value);
+            TIArchive i_archive(reader);
             i_archive >> obj;
-            if (_condition(obj)) {
+            if (!_condition || _condition(obj)) {
                 result.push_back(obj);
                 if (_top && result.size() == _top) break;
             }
-            iter.next();
+            if (_reverse) {
+                iter.prev();
+            } else {
+                iter.next();
+            }
         }
 
         return result;
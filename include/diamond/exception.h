@@ -28,7 +28,8 @@ namespace diamond {
         DUPLICATE_ENTRY_KEY,
         ENTRY_NOT_FOUND,
         NO_PAGE_SPACE_AVAILABLE,
-        PAGE_DOES_NOT_EXIST
+        PAGE_DOES_NOT_EXIST,
+        UNSUPPORTED_FILE_FORMAT
     };
 
     class Exception : public std::exception {
@@ -18,6 +18,7 @@
 #ifndef _DIAMOND_FILE_STORAGE_H
 #define _DIAMOND_FILE_STORAGE_H
 
+#include <atomic>
 #include <cstdio>
 #include <fstream>
 
@@ -34,11 +35,15 @@ namespace diamond {
 
     private:
         FILE* _file;
+        // Kept as the file grows, so size() doesn't have to seek
+        std::atomic<uint64_t> _size;
 
         void write_impl(const char* buffer, size_t n) override;
         void read_impl(char* buffer, size_t n) override;
         void seek_impl(size_t n) override;
         uint64_t size_impl() override;
+        void sync_impl() override;
+        void truncate_impl(uint64_t size) override;
     };
 
 } // namespace diamond
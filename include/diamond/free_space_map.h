@@ -0,0 +1,100 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_FREE_SPACE_MAP_H
+#define _DIAMOND_FREE_SPACE_MAP_H
+
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "diamond/page.h"
+#include "diamond/page_manager.h"
+#include "diamond/utility.h"
+
+namespace diamond {
+
+    /*
+        The free space of a collection's DATA pages, kept in memory and bucketed by
+        size class so a page with room for an entry is found without scanning the free
+        list. The FREE_LIST pages remain the record of it in storage, the map knows
+        where each data page's entry is and marks the ones that changed, store writes
+        them. Data pages are sharded by id with a lock per shard, and each thread
+        starts looking for space in a different shard, so concurrent writers rarely
+        wait on each other. Only new entries are written right away.
+    */
+    class FreeSpaceMap : noncopyable {
+    public:
+        static const size_t NUM_SHARDS = 16;
+        // Pages in size class c have at least c * SIZE_CLASS bytes free
+        static const uint16_t SIZE_CLASS = 256;
+        // Pages looked at in the size class that may or may not have enough space
+        static const size_t MAX_PARTIAL_CLASS_SCAN = 8;
+
+        FreeSpaceMap(PageManager& manager, Page::ID free_list_id);
+
+        // Takes space from a data page with enough of it free, returns false if there is none.
+        bool reserve(uint16_t space, Page::ID& data_id);
+        // Adds a data page that isn't on the free list yet.
+        void add(Page::ID data_id, uint16_t free_space);
+        // Gives space freed in a data page back, adding the page if it isn't on the free list.
+        void release(Page::ID data_id, uint16_t space);
+        // Writes the entries that changed since the last call to the FREE_LIST pages.
+        void store();
+
+    private:
+        static const size_t NUM_SIZE_CLASSES;
+
+        struct Entry {
+            uint16_t free_space;
+            // Location of the data page's entry in the FREE_LIST pages
+            Page::ID free_list_id;
+            size_t free_list_index;
+            // Position in the bucket of its size class
+            size_t bucket_index;
+            bool changed;
+        };
+
+        struct Shard {
+            Shard();
+
+            boost::mutex mutex;
+            std::unordered_map<Page::ID, Entry> entries;
+            // Data pages by size class
+            std::vector<std::vector<Page::ID>> buckets;
+            // Data pages whose entries weren't stored since they changed
+            std::vector<Page::ID> changed;
+        };
+
+        PageManager& _manager;
+        std::array<Shard, NUM_SHARDS> _shards;
+        // Last FREE_LIST page, new entries are appended to it
+        Page::ID _last_free_list_id;
+        boost::mutex _append_mutex;
+
+        Shard& get_shard(Page::ID data_id);
+        void insert(Shard& shard, Page::ID data_id, uint16_t free_space);
+        void set_free_space(Shard& shard, Page::ID data_id, Entry& entry, uint16_t free_space);
+        void add_to_bucket(Shard& shard, Page::ID data_id, Entry& entry);
+        void remove_from_bucket(Shard& shard, Entry& entry);
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_FREE_SPACE_MAP_H
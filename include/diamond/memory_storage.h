@@ -18,25 +18,45 @@
 #ifndef _DIAMOND_MEMORY_STORAGE_H
 #define _DIAMOND_MEMORY_STORAGE_H
 
-#include "diamond/page.h"
+#include <atomic>
+#include <memory>
+
+#include <boost/thread.hpp>
+
 #include "diamond/storage.h"
 
 namespace diamond {
 
+    /*
+        Keeps the data in memory in chunks of CHUNK_SIZE bytes, each allocated the
+        first time it's written and kept until the storage is destroyed. Growing
+        never copies what's already written, and reads and writes take no lock, so
+        the engine can run on it with no file at all.
+    */
     class MemoryStorage final : public Storage {
     public:
-        MemoryStorage(size_t initial_size = Page::SIZE);
+        static constexpr uint64_t CHUNK_SIZE = 4 * 1024 * 1024;
+        static constexpr size_t MAX_CHUNKS = 16384;
+
+        // The chunks holding the first reserved_size bytes are allocated up front.
+        MemoryStorage(uint64_t reserved_size = 0);
         ~MemoryStorage();
 
     private:
-        char* _buffer;
-        size_t _pos;
-        size_t _size;
+        std::unique_ptr<std::atomic<char*>[]> _chunks;
+        boost::mutex _chunks_mutex;
+        // One past the last byte written
+        std::atomic<uint64_t> _size;
+
+        char* get_chunk(size_t index, bool create);
 
-        void write_impl(const char* buffer, size_t n) override;
-        void read_impl(char* buffer, size_t n) override;
-        void seek_impl(size_t n) override;
+        void write_at(const char* buffer, size_t n, uint64_t offset) override;
+        // Bytes that were never written are read as zeros.
+        void read_at(char* buffer, size_t n, uint64_t offset) override;
         uint64_t size_impl() override;
+        void sync_impl() override;
+        // The chunks are kept, the bytes past size are zeroed so they're read as never written.
+        void truncate_impl(uint64_t size) override;
     };
 
 } // namespace diamond
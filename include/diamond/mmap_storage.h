@@ -0,0 +1,65 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_MMAP_STORAGE_H
+#define _DIAMOND_MMAP_STORAGE_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <boost/thread.hpp>
+
+#include "diamond/storage.h"
+
+namespace diamond {
+
+    /*
+        Opens a database file read-only and reads it through memory mappings, so a
+        read is a copy out of the page cache and takes no lock. The file is mapped in
+        extents of EXTENT_SIZE bytes, each mapped the first time it's read and kept
+        until the storage is destroyed. Extents are mapped past the end of the file,
+        so they see what another process appends to it later.
+    */
+    class MmapStorage final : public Storage {
+    public:
+        static constexpr uint64_t EXTENT_SIZE = 64 * 1024 * 1024;
+        static constexpr size_t MAX_EXTENTS = 4096;
+
+        MmapStorage(const std::string& file_name);
+        ~MmapStorage();
+
+    private:
+        int _fd;
+        std::unique_ptr<std::atomic<char*>[]> _extents;
+        boost::mutex _extents_mutex;
+        // Size of the file when it was last looked at, it never shrinks
+        std::atomic<uint64_t> _size;
+
+        uint64_t file_size();
+        const char* get_extent(size_t index);
+
+        void write_at(const char* buffer, size_t n, uint64_t offset) override;
+        // Bytes past the end of the file are read as zeros.
+        void read_at(char* buffer, size_t n, uint64_t offset) override;
+        uint64_t size_impl() override;
+        void sync_impl() override;
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_MMAP_STORAGE_H
@@ -19,11 +19,11 @@
 #define _DIAMOND_STORAGE_PAGE_H
 
 #include <atomic>
+#include <cstring>
 #include <exception>
 #include <functional>
-#include <list>
 #include <memory>
-#include <vector>
+#include <string_view>
 
 #include <boost/thread.hpp>
 #include <boost/utility.hpp>
@@ -38,16 +38,31 @@ namespace diamond {
     class UniquePageLock;
     class UpgradePageLock;
 
+    /*
+        A page is kept in memory exactly as it is stored. After a fixed size header
+        comes an array of slots, the offsets of the page's entries, which are allocated
+        from a heap growing down from the end of the page. The slots are kept in the
+        order of the entries, so entries can be accessed by index without being parsed.
+
+        Integers are stored in the host's byte order. Every written page has
+        FORMAT_VERSION in its header, pages of another version aren't read.
+    */
     class Page : boost::noncopyable {
     public:
         using ID = uint64_t;
 
         static const ID INVALID_ID;
 
+        static const uint8_t FORMAT_VERSION;
         static const uint16_t SIZE;
+        // Page data is aligned to this, so pages can be read and written with O_DIRECT
+        static const size_t ALIGNMENT;
         static const uint16_t MAX_KEY_SIZE;
+        static const uint16_t MAX_INLINE_KEY_SIZE;
+        // Nodes holding less than this are rebalanced with a sibling
+        static const uint16_t MIN_SIZE;
 
-        enum class Type {
+        enum class Type : uint8_t {
             COLLECTIONS,
             DATA,
             FREE_LIST,
@@ -57,29 +72,33 @@ namespace diamond {
 
         class Collection {
         public:
-            Collection(ID root_node_id, ID free_list_id);
+            Collection(ID root_node_id, ID free_list_id, uint64_t num_records);
 
             ID root_node_id() const;
             ID free_list_id() const;
+            uint64_t num_records() const;
 
         private:
             ID _root_node_id;
             ID _free_list_id;
+            uint64_t _num_records;
         };
 
+        // NOTE: A data entry points into its page, it is only valid while the page is locked.
         class DataEntry {
         public:
-            DataEntry(Buffer data, ID overflow_id = 0, size_t overflow_index = 0);
+            DataEntry(const char* data, size_t data_size, ID overflow_id = 0, size_t overflow_index = 0);
 
             size_t data_size() const;
-            const Buffer& data() const;
+            Buffer data() const;
 
             bool overflows() const;
             ID overflow_id() const;
             size_t overflow_index() const;
 
         private:
-            Buffer _data;
+            const char* _data;
+            size_t _data_size;
             ID _overflow_id;
             size_t _overflow_index;
         };
@@ -91,62 +110,92 @@ namespace diamond {
             ID data_id() const;
             uint16_t free_space() const;
 
-            void set_free_space(uint16_t free_space);
-
         private:
             ID _data_id;
             uint16_t _free_space;
         };
 
+        /*
+            The key of a node entry. Keys of up to MAX_INLINE_KEY_SIZE bytes are stored
+            in the node itself so they can be compared without reading another page,
+            larger keys are stored in a DATA page.
+        */
+        class Key {
+        public:
+            Key(Buffer data);
+            Key(ID data_id, size_t data_index);
+
+            bool inlined() const;
+            const Buffer& data() const;
+
+            ID data_id() const;
+            size_t data_index() const;
+
+        private:
+            Buffer _data;
+            ID _data_id;
+            size_t _data_index;
+        };
+
+        // NOTE: A key view points into its page, it is only valid while the page is locked.
+        class KeyView {
+        public:
+            KeyView(std::string_view data);
+            KeyView(ID data_id, size_t data_index);
+
+            bool inlined() const;
+            std::string_view data() const;
+
+            ID data_id() const;
+            size_t data_index() const;
+
+        private:
+            std::string_view _data;
+            ID _data_id;
+            size_t _data_index;
+        };
+
         class InternalNodeEntry {
         public:
-            InternalNodeEntry(ID key_data_id, size_t key_data_index, ID next_node_id);
+            InternalNodeEntry(Key key, ID next_node_id);
 
-            ID key_data_id() const;
-            size_t key_data_index() const;
+            const Key& key() const;
 
             ID next_node_id() const;
 
         private:
-            ID _key_data_id;
-            size_t _key_data_index;
+            Key _key;
             ID _next_node_id;
         };
 
         class LeafNodeEntry {
         public:
-            LeafNodeEntry(ID key_data_id, size_t key_data_index, ID val_data_id, size_t val_data_index);
+            LeafNodeEntry(Key key, ID val_data_id, size_t val_data_index);
 
-            ID key_data_id() const;
-            size_t key_data_index() const;
+            const Key& key() const;
 
             ID val_data_id() const;
             size_t val_data_index() const;
 
-            void set_val_data_ptr(ID val_data_id, size_t val_data_index);
-
         private:
-            ID _key_data_id;
-            size_t _key_data_index;
+            Key _key;
             ID _val_data_id;
             size_t _val_data_index;
         };
 
-        using Collections = std::unordered_map<
-            Buffer,
-            Collection,
-            Buffer::Hash,
-            Buffer::EqualTo
-        >;
-        using CollectionsIterator = Collections::iterator;
-        using InternalNodeEntryList = std::list<InternalNodeEntry>;
-        using InternalNodeEntryListIterator = InternalNodeEntryList::iterator;
-        using LeafNodeEntryList = std::list<LeafNodeEntry>;
-        using LeafNodeEntryListIterator = LeafNodeEntryList::iterator;
-
         static uint64_t file_pos_for_id(ID id);
         static Page* from_storage(ID id, Storage& storage);
         static Page* new_page(ID id, Type type);
+        static bool can_inline_key(const Buffer& key);
+        static size_t max_data_entry_size(bool overflows = false);
+
+        // Space a data entry takes in its page, slot included
+        static uint16_t data_entry_space_req(const Buffer& data, bool overflows = false) {
+            // data_size, data, then overflow_id, overflow_index if it continues elsewhere
+            uint16_t space = SLOT_SIZE + sizeof(uint16_t) + data.size();
+            if (overflows) space += sizeof(ID) + sizeof(uint16_t);
+            return space;
+        }
 
         ~Page();
 
@@ -156,57 +205,71 @@ namespace diamond {
         uint16_t get_size() const;
         uint16_t get_remaining_space() const;
         uint16_t header_size() const;
+        uint16_t get_entry_space(size_t i) const;
+        bool is_underfull() const;
 
         uint64_t file_pos() const;
 
         uint64_t usage_count() const;
+        uint64_t version() const;
+
+        void reset(Type type);
+        void move_entries(Page* other);
 
         ID get_next_collections_page() const;
         void set_next_collections_page(ID next);
-        const Collections* get_collections() const;
+        size_t get_num_collections() const;
         bool can_insert_collection(const Buffer& name) const;
         bool has_collection(const Buffer& name) const;
-        const Collection& get_collection(const Buffer& name) const;
-        void add_collection(Buffer name, ID root_node_id, ID free_list_id);
+        Collection get_collection(const Buffer& name) const;
+        void add_collection(const Buffer& name, ID root_node_id, ID free_list_id);
+        void set_collection_num_records(const Buffer& name, uint64_t num_records);
 
         size_t get_num_data_entries() const;
-        const std::vector<DataEntry>* get_data_entries() const;
-        const DataEntry& get_data_entry(size_t i) const;
-        size_t insert_data_entry(Buffer data);
-        bool can_insert_data_entry(const Buffer& data);
+        DataEntry get_data_entry(size_t i) const;
+        size_t insert_data_entry(const Buffer& data);
+        size_t insert_data_entry(const Buffer& data, ID overflow_id, size_t overflow_index);
+        bool can_insert_data_entry(const Buffer& data, bool overflows = false);
+        uint16_t erase_data_entry(size_t i);
 
         ID get_next_free_list_page() const;
         void set_next_free_list_page(ID next);
         size_t get_num_free_list_entries() const;
-        const std::vector<FreeListEntry>* get_free_list_entries() const;
-        const FreeListEntry& get_free_list_entry(size_t i) const;
-        bool reserve_free_list_entry(const Buffer& data, ID& data_id);
+        FreeListEntry get_free_list_entry(size_t i) const;
+        bool reserve_free_list_entry(const Buffer& data, ID& data_id, bool overflows = false);
         size_t insert_free_list_entry(ID data_id, uint16_t free_space);
+        void set_free_list_entry_free_space(size_t i, uint16_t free_space);
         bool can_insert_free_list_entry();
+        bool release_free_list_space(ID data_id, uint16_t space);
 
         size_t get_num_internal_node_entries() const;
-        const InternalNodeEntryList* get_internal_node_entries() const;
-        InternalNodeEntryListIterator internal_node_entries_begin() const;
-        InternalNodeEntryListIterator internal_node_entries_end() const;
-        void insert_internal_node_entry(
-            InternalNodeEntryListIterator pos,
-            ID key_data_id,
-            size_t key_data_index,
-            ID next_node_id);
+        InternalNodeEntry get_internal_node_entry(size_t i) const;
+        KeyView get_internal_node_entry_key(size_t i) const;
+        void insert_internal_node_entry(size_t pos, const Key& key, ID next_node_id);
+        void set_internal_node_entry_next_node(size_t i, ID next_node_id);
+        void erase_internal_node_entry(size_t i);
+        void set_internal_node_entry_key(size_t i, const Key& key);
+        bool can_set_internal_node_entry_key(size_t i, const Key& key) const;
         bool can_insert_internal_node_entry() const;
+        bool can_insert_internal_node_entry(const Key& key) const;
+        void split_internal_node_entries(Page* other);
 
         ID get_next_leaf_node_page() const;
+        void set_next_leaf_node_page(ID next);
+        ID get_prev_leaf_node_page() const;
+        void set_prev_leaf_node_page(ID prev);
         size_t get_num_leaf_node_entries() const;
-        const LeafNodeEntryList* get_leaf_node_entries() const;
-        LeafNodeEntryListIterator leaf_node_entries_begin() const;
-        LeafNodeEntryListIterator leaf_node_entries_end() const;
+        LeafNodeEntry get_leaf_node_entry(size_t i) const;
+        KeyView get_leaf_node_entry_key(size_t i) const;
         void insert_leaf_node_entry(
-            LeafNodeEntryListIterator pos,
-            ID key_data_id,
-            size_t key_data_index,
+            size_t pos,
+            const Key& key,
             ID val_data_id,
             size_t val_data_index);
-        bool can_insert_leaf_node_entry() const;
+        void set_leaf_node_entry_val_data_ptr(size_t i, ID val_data_id, size_t val_data_index);
+        void erase_leaf_node_entry(size_t i);
+        bool can_insert_leaf_node_entry(const Buffer& key) const;
+        bool can_insert_leaf_node_entry(const Key& key) const;
         void split_leaf_node_entries(Page* other);
 
         void write_to_storage(Storage& storage) const;
@@ -218,54 +281,112 @@ namespace diamond {
         friend class UniquePageLock;
         friend class UpgradePageLock;
 
+        // Header layout: type, format version, number of slots, heap offset, fragmented bytes, next page, previous leaf
+        static const uint16_t TYPE_OFFSET = 0;
+        static const uint16_t VERSION_OFFSET = 1;
+        static const uint16_t NUM_SLOTS_OFFSET = 2;
+        static const uint16_t HEAP_OFFSET_OFFSET = 4;
+        static const uint16_t FRAGMENTED_OFFSET = 6;
+        static const uint16_t NEXT_OFFSET = 8;
+        static const uint16_t PREV_OFFSET = 16;
+        static const uint16_t HEADER_SIZE = 24;
+        static const uint16_t SLOT_SIZE = sizeof(uint16_t);
+
+        // Set in the size of a data entry when it continues in an overflow entry
+        static const uint16_t OVERFLOW_FLAG = 0x8000;
+        // Set in the size of a node entry's key when it is stored in a DATA page
+        static const uint16_t EXTERNAL_KEY_FLAG = 0x8000;
+
         ID _id;
-        Type _type;
-        uint16_t _size;
-        union {
-            struct {
-                Collections* map;
-                ID next;
-            } _collections;
-            std::vector<DataEntry>* _data_entries;
-            struct {
-                std::vector<FreeListEntry>* entries;
-                ID next;
-            } _free_list;
-            InternalNodeEntryList* _internal_node_entries;
-            struct {
-                LeafNodeEntryList* entries;
-                ID next;
-            } _leaf;
-        };
+        char* _data;
         std::atomic_uint64_t _usage_count;
+        std::atomic_uint64_t _version;
         boost::shared_mutex _mutex;
 
-        Page(ID id, Type type);
+        Page(ID id);
 
-        static uint16_t collection_space_req(const Buffer& id) {
-            return sizeof(size_t) + id.size() + sizeof(ID) + sizeof(ID);
+        void init(Type type);
+
+        uint16_t num_slots() const {
+            return read_at<uint16_t>(NUM_SLOTS_OFFSET);
+        }
+
+        uint16_t heap_offset() const {
+            return read_at<uint16_t>(HEAP_OFFSET_OFFSET);
         }
 
-        static uint16_t data_entry_space_req(const Buffer& data) {
-            return sizeof(size_t) + data.size();
+        uint16_t slot_offset(size_t i) const {
+            return read_at<uint16_t>(HEADER_SIZE + i * SLOT_SIZE);
+        }
+
+        const char* entry(size_t i) const {
+            return _data + slot_offset(i);
+        }
+
+        char* entry(size_t i) {
+            return _data + slot_offset(i);
+        }
+
+        uint16_t entry_size(const char* e) const;
+        uint16_t allocate_entry(uint16_t size, size_t n);
+        char* insert_entry(size_t pos, uint16_t size);
+        char* insert_data_entry_slot(uint16_t size, size_t& i);
+        void erase_entry(size_t i);
+        void truncate_entries(size_t n);
+        void compact();
+        void split_entries(Page* other);
+
+        const char* find_collection(const Buffer& name) const;
+
+        static Key read_key(const char* e);
+        static KeyView read_key_view(const char* e);
+        static uint16_t key_field_size(const char* e);
+        static char* write_key(char* e, const Key& key);
+
+        template <class T>
+        T read_at(size_t offset) const {
+            T val;
+            std::memcpy(&val, _data + offset, sizeof(T));
+            return val;
+        }
+
+        template <class T>
+        void write_at(size_t offset, T val) {
+            std::memcpy(_data + offset, &val, sizeof(T));
+        }
+
+        static uint16_t collection_space_req(const Buffer& name) {
+            // name_size, name, root_node_id, free_list_id, num_records
+            return SLOT_SIZE + sizeof(uint16_t) + name.size() + sizeof(ID) + sizeof(ID) + sizeof(uint64_t);
         }
 
         static uint16_t free_list_entry_space_req() {
-            return sizeof(ID) + sizeof(uint16_t);
+            return SLOT_SIZE + sizeof(ID) + sizeof(uint16_t);
+        }
+
+        static uint16_t key_space_req(size_t key_size) {
+            // key_size, then either the key or key_data_id, key_data_index
+            if (key_size > MAX_INLINE_KEY_SIZE) return sizeof(uint16_t) + sizeof(ID) + sizeof(uint16_t);
+            return sizeof(uint16_t) + key_size;
+        }
+
+        static uint16_t key_space_req(const Key& key) {
+            if (!key.inlined()) return key_space_req(SIZE);
+            return key_space_req(key.data().size());
         }
 
-        static uint16_t internal_node_entry_space_req() {
-            // key_data_id, key_data_index, child_node_id
-            return sizeof(ID) + sizeof(size_t) + sizeof(ID);
+        static uint16_t internal_node_entry_space_req(uint16_t key_space) {
+            // key, child_node_id
+            return SLOT_SIZE + key_space + sizeof(ID);
         }
 
-        static uint16_t leaf_node_entry_space_req() {
-            // key_data_id, key_data_index, val_data_id, val_data_index
-            return sizeof(ID) + sizeof(size_t) + sizeof(ID) + sizeof(size_t);
+        static uint16_t leaf_node_entry_space_req(uint16_t key_space) {
+            // key, val_data_id, val_data_index
+            return SLOT_SIZE + key_space + sizeof(ID) + sizeof(uint16_t);
         }
 
         void ensure_type_is(Type type) const {
-            if (_type != type) throw std::logic_error("invalid type");
+            if (get_type() != type) throw std::logic_error("invalid type");
         }
 
         void ensure_space_available(size_t space) const {
@@ -32,6 +32,10 @@ namespace diamond {
         virtual PageAccessor create_page(Page::Type type) = 0;
         virtual PageAccessor get_page(Page::ID id) = 0;
         virtual void write_page(const Page* page) = 0;
+        // Returns once every page written so far has been handed to the storage, which still has to be synced
+        virtual void flush() = 0;
+        // Whether pages reach the storage as soon as they're written
+        virtual bool writes_synchronously() const = 0;
         virtual bool is_page_managed(Page::ID id) const = 0;
 
         Storage& storage() const;
@@ -25,6 +25,10 @@ namespace diamond {
     class PageWriter {
     public:
         virtual void write(const Page* page) = 0;
+        // Returns once every page written so far has been handed to the storage
+        virtual void flush() {}
+        // Whether write hands the page to the storage before it returns
+        virtual bool is_synchronous() const { return true; }
     };
 
     class PageWriterFactory {
@@ -46,6 +46,8 @@ namespace diamond {
         PageAccessor create_page(Page::Type type) override;
         PageAccessor get_page(Page::ID id) override;
         void write_page(const Page* page) override;
+        void flush() override;
+        bool writes_synchronously() const override;
         bool is_page_managed(Page::ID id) const override;
 
     private:
@@ -66,6 +68,10 @@ namespace diamond {
 
             void write_page(const Page* page);
 
+            void flush();
+
+            bool writes_synchronously() const;
+
             bool is_page_managed(Page::ID id) const;
 
         private:
@@ -0,0 +1,83 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_POSIX_FILE_STORAGE_H
+#define _DIAMOND_POSIX_FILE_STORAGE_H
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "diamond/storage.h"
+
+namespace diamond {
+
+    /*
+        Reads and writes a file with pread and pwrite at the given offset, there's no
+        file position, so threads read and write it at once without a lock.
+
+        If direct is set, the file is opened with O_DIRECT and bypasses the kernel's
+        page cache, so pages are only cached by the page manager. Reads and writes of
+        whole blocks from aligned buffers, like pages, go straight to the file. Others
+        go through an aligned copy, and writes of part of a block read it first. Every
+        direct write locks the blocks it covers, so a write of part of a block can't
+        undo a write of the whole block made meanwhile. Meant for the database file,
+        whose pages are read and written whole.
+    */
+    class PosixFileStorage final : public Storage {
+    public:
+        // The alignment of the buffers, offsets and sizes of direct reads and writes
+        static constexpr size_t DIRECT_ALIGNMENT = 4096;
+
+        PosixFileStorage(const std::string& file_name, bool direct = false);
+        ~PosixFileStorage();
+
+        int fd() const;
+
+    private:
+        using AlignedBuffer = std::unique_ptr<char, decltype(&std::free)>;
+
+        int _fd;
+        bool _direct;
+        // Kept as the file grows, so size() doesn't need a system call
+        std::atomic<uint64_t> _size;
+        // Direct writes lock the blocks they cover, a block's mutex is picked by its index
+        static constexpr size_t NUM_BLOCK_MUTEXES = 64;
+        std::array<boost::mutex, NUM_BLOCK_MUTEXES> _block_mutexes;
+
+        static AlignedBuffer allocate_aligned(size_t n);
+        bool is_aligned(const char* buffer, size_t n, uint64_t offset) const;
+        std::vector<boost::unique_lock<boost::mutex>> lock_blocks(uint64_t start, uint64_t end);
+        void pwrite_all(const char* buffer, size_t n, uint64_t offset);
+        void pread_all(char* buffer, size_t n, uint64_t offset);
+
+        void write_at(const char* buffer, size_t n, uint64_t offset) override;
+        // Bytes past the end of the file are read as zeros.
+        void read_at(char* buffer, size_t n, uint64_t offset) override;
+        uint64_t size_impl() override;
+        void sync_impl() override;
+        void truncate_impl(uint64_t size) override;
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_POSIX_FILE_STORAGE_H
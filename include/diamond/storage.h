@@ -18,6 +18,8 @@
 #ifndef _DIAMOND_STORAGE_H
 #define _DIAMOND_STORAGE_H
 
+#include <vector>
+
 #include <boost/thread.hpp>
 #include <boost/utility.hpp>
 
@@ -27,17 +29,45 @@ namespace diamond {
 
     class Storage : boost::noncopyable {
     public:
+        struct Write {
+            const char* buffer;
+            size_t n;
+            uint64_t offset;
+        };
+
         Storage() = default;
+        virtual ~Storage() = default;
 
         void write(const char* buffer, size_t n, uint64_t offset);
+        // Makes the writes in no particular order, they mustn't overlap
+        void write(const std::vector<Write>& writes);
         void read(char* buffer, size_t n, uint64_t offset);
         uint64_t size();
+        // Returns once everything written so far is durable
+        void sync();
+        // Cuts the storage down to its first size bytes
+        void truncate(uint64_t size);
 
     protected:
-        virtual void write_impl(const char* buffer, size_t n) = 0;
-        virtual void read_impl(char* buffer, size_t n) = 0;
-        virtual void seek_impl(size_t n) = 0;
+        /*
+            The default ones seek and call write_impl or read_impl under one lock.
+            Storages with no position to seek override them instead, so several
+            threads can read and write at once.
+        */
+        virtual void write_at(const char* buffer, size_t n, uint64_t offset);
+        virtual void read_at(char* buffer, size_t n, uint64_t offset);
+        // The default one makes the writes one at a time, storages that can have several in flight override it.
+        virtual void write_batch_at(const std::vector<Write>& writes);
+
+        // NOTE: Only called by the default write_at and read_at, the others throw std::logic_error.
+        virtual void write_impl(const char* buffer, size_t n);
+        virtual void read_impl(char* buffer, size_t n);
+        virtual void seek_impl(size_t n);
+        // NOTE: Called without a lock, while other threads read and write, so they have to be thread-safe.
         virtual uint64_t size_impl() = 0;
+        virtual void sync_impl() = 0;
+        // The default one throws std::logic_error, for storages that can't be truncated.
+        virtual void truncate_impl(uint64_t size);
 
     private:
         boost::mutex _mutex;
@@ -18,48 +18,215 @@
 #ifndef _DIAMOND_STORAGE_ENGINE_H
 #define _DIAMOND_STORAGE_ENGINE_H
 
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread.hpp>
+
 #include "diamond/buffer.h"
 #include "diamond/exception.h"
+#include "diamond/free_space_map.h"
 #include "diamond/page_manager.h"
 #include "diamond/utility.h"
+#include "diamond/value_log.h"
+#include "diamond/write_ahead_log.h"
+#include "diamond/write_batch.h"
 
 namespace diamond {
 
     class StorageEngine {
+    private:
+        struct Collection;
+
+        template <class TLock>
+        struct LockedPage : noncopyable {
+            LockedPage(PageAccessor _page);
+
+            PageAccessor page;
+            TLock lock;
+        };
+
     public:
-        using Compare = std::function<int(const Buffer&, const Buffer&)>;
+        // NOTE: Keys are compared as views, a key in a page is compared without copying it.
+        using Compare = std::function<int(std::string_view, std::string_view)>;
+
+        /*
+            Reads a value one DATA page entry at a time, following the chain of overflow
+            entries of values too large for a single page, so the value never has to be
+            copied into one buffer.
+        */
+        class ValueReader : public Reader, noncopyable {
+        public:
+            using Reader::read;
+            void read(void* val, size_t size) override;
 
+            bool end() const;
+            Buffer read_all();
+
+        private:
+            friend class StorageEngine;
+
+            PageManager& _manager;
+            // Keeps the value from being erased while it's read
+            std::unique_ptr<LockedPage<SharedPageLock>> _leaf;
+            Buffer _chunk;
+            size_t _pos;
+            Page::ID _next_id;
+            size_t _next_index;
+
+            ValueReader(
+                PageManager& manager,
+                Page::ID data_id,
+                size_t data_index,
+                std::unique_ptr<LockedPage<SharedPageLock>> leaf = nullptr);
+            // Reads a value that was already read in full, from the value log
+            ValueReader(
+                PageManager& manager,
+                Buffer val,
+                std::unique_ptr<LockedPage<SharedPageLock>> leaf = nullptr);
+
+            void load_next_chunk();
+        };
+
+        /*
+            A point in time view of the database. Each change made while a snapshot is
+            held keeps where the value it replaced is, the value itself isn't freed
+            until no snapshot taken before the change is left. A crash while it's held
+            leaves the space of those values unused.
+        */
+        class Snapshot : noncopyable {
+        public:
+            ~Snapshot();
+
+        private:
+            friend class StorageEngine;
+
+            StorageEngine& _storage_engine;
+            // Changes numbered up to it are seen
+            uint64_t _sequence;
+
+            Snapshot(StorageEngine& storage_engine, uint64_t sequence);
+        };
+
+        /*
+            Moves over the keys of a collection in order, in either direction. An iterator
+            given a start key doesn't move below it, one given an end key stops before the
+            first key not less than it.
+
+            An iterator given a snapshot sees the keys and values as they were when it was
+            taken. It copies the entries of one leaf at a time, so no page stays locked
+            between moves and writers are never held up by it. The snapshot has to
+            outlive it.
+        */
         class Iterator : noncopyable {
         public:
             ~Iterator();
 
             void next();
+            void prev();
+            void seek_to_last();
 
             Buffer key();
             Buffer val();
+            ValueReader val_reader();
 
             bool end() const;
 
         private:
             friend class StorageEngine;
 
+            StorageEngine& _storage_engine;
             PageManager& _manager;
 
             struct LeafPageIterator {
-                LeafPageIterator(PageAccessor _page);
+                LeafPageIterator(std::unique_ptr<LockedPage<SharedPageLock>> _leaf, size_t _index);
 
-                PageAccessor page;
-                SharedPageLock lock;
-                Page::LeafNodeEntryListIterator iter;
+                std::unique_ptr<LockedPage<SharedPageLock>> leaf;
+                size_t index;
             };
             LeafPageIterator* _leaf_page_iterator;
+            Page::ID _root_node_id;
+            std::optional<Buffer> _start_key;
+            std::optional<Buffer> _end_key;
+            Compare _compare_func;
+
+            // The keys and values of one leaf as the snapshot sees them
+            struct SnapshotEntries {
+                std::vector<std::tuple<Buffer, Buffer>> entries;
+                size_t index;
+            };
+            const Snapshot* _snapshot;
+            const Collection* _collection;
+            std::optional<SnapshotEntries> _snapshot_entries;
+
+            // Starts at the end if there's no leaf
+            Iterator(
+                StorageEngine& storage_engine,
+                Page::ID root_node_id,
+                std::unique_ptr<LockedPage<SharedPageLock>> leaf,
+                size_t index = 0,
+                std::optional<Buffer> start_key = std::nullopt,
+                std::optional<Buffer> end_key = std::nullopt,
+                Compare compare_func = &default_compare);
+            Iterator(
+                StorageEngine& storage_engine,
+                const Collection& collection,
+                const Snapshot& snapshot,
+                std::optional<Buffer> start_key,
+                std::optional<Buffer> end_key,
+                Compare compare_func);
 
-            Iterator(PageManager& manager, PageAccessor page);
+            void load_next_snapshot_entries(const std::optional<Buffer>& after);
+            void load_prev_snapshot_entries(const std::optional<Buffer>& before);
+
+            void skip_exhausted_pages();
+            void seek_before(const std::optional<Buffer>& key);
+            void stop_at_start_key();
+            void stop_at_end_key();
         };
 
-        static int default_compare(const Buffer& b0, const Buffer& b1);
+        /*
+            A collection looked up once by name. Operations given the handle skip the
+            lookup, it stays valid for as long as the StorageEngine it came from.
+        */
+        class CollectionHandle {
+        public:
+            const Buffer& name() const;
 
-        StorageEngine(PageManager& page_manager);
+        private:
+            friend class StorageEngine;
+
+            const Collection* _collection;
+
+            CollectionHandle(const Collection* collection);
+        };
+
+        // Fills in the next key and value to load, returns false once there are none left
+        using BulkLoadSource = std::function<bool(Buffer& key, Buffer& val)>;
+
+        // Share of a page filled by bulk_load, leaving room for later inserts
+        static const double DEFAULT_FILL_FACTOR;
+
+        static int default_compare(std::string_view b0, std::string_view b1);
+
+        /*
+            Values of at least value_log's min_value_size are kept in it, if given. Given
+            the WriteAheadLog the page manager writes to, changes are only committed
+            whole. value_log has to outlive wal.
+        */
+        StorageEngine(
+            PageManager& page_manager,
+            ValueLog* value_log = nullptr,
+            WriteAheadLog* wal = nullptr);
+        ~StorageEngine();
 
         uint64_t count(const Buffer& collection_name);
         bool exists(
@@ -70,43 +237,397 @@ namespace diamond {
             const Buffer& collection_name,
             const Buffer& key,
             Compare compare_func = &default_compare);
+        std::vector<std::optional<Buffer>> multi_get(
+            const Buffer& collection_name,
+            const std::vector<Buffer>& keys,
+            Compare compare_func = &default_compare);
+        ValueReader get_reader(
+            const Buffer& collection_name,
+            const Buffer& key,
+            Compare compare_func = &default_compare);
         void put(
             const Buffer& collection_name,
             Buffer key,
             Buffer val,
             Compare compare_func = &default_compare);
+        bool erase(
+            const Buffer& collection_name,
+            const Buffer& key,
+            Compare compare_func = &default_compare);
+        void write(const WriteBatch& batch, Compare compare_func = &default_compare);
+        /*
+            Returns once the changes made so far are durable. put, erase and write
+            return before that, unless the WriteBatch is set to sync. It mustn't be
+            called within a WriteAheadLog::Operation.
+        */
+        void sync();
+        void bulk_load(
+            const Buffer& collection_name,
+            const BulkLoadSource& source,
+            double fill_factor = DEFAULT_FILL_FACTOR,
+            Compare compare_func = &default_compare);
+        template <class TIterator>
+        void bulk_load(
+            const Buffer& collection_name,
+            TIterator begin,
+            TIterator end,
+            double fill_factor = DEFAULT_FILL_FACTOR,
+            Compare compare_func = &default_compare);
         Iterator get_iterator(const Buffer& collection_name);
+        Iterator get_iterator(
+            const Buffer& collection_name,
+            const Buffer& start_key,
+            Compare compare_func = &default_compare);
+        Iterator get_iterator(
+            const Buffer& collection_name,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            Compare compare_func = &default_compare);
+        Iterator get_iterator(const Buffer& collection_name, const Snapshot& snapshot);
+        Iterator get_iterator(
+            const Buffer& collection_name,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            const Snapshot& snapshot,
+            Compare compare_func = &default_compare);
+
+        /*
+            NOTE: Waits for the batches and bulk loads in progress, so it mustn't be taken
+            by a thread holding an iterator without a snapshot.
+        */
+        Snapshot get_snapshot();
+
+        // The same operations on a collection looked up beforehand
+        CollectionHandle get_collection(const Buffer& collection_name);
+        uint64_t count(const CollectionHandle& handle);
+        bool exists(
+            const CollectionHandle& handle,
+            const Buffer& key,
+            Compare compare_func = &default_compare);
+        Buffer get(
+            const CollectionHandle& handle,
+            const Buffer& key,
+            Compare compare_func = &default_compare);
+        std::vector<std::optional<Buffer>> multi_get(
+            const CollectionHandle& handle,
+            const std::vector<Buffer>& keys,
+            Compare compare_func = &default_compare);
+        ValueReader get_reader(
+            const CollectionHandle& handle,
+            const Buffer& key,
+            Compare compare_func = &default_compare);
+        void put(
+            const CollectionHandle& handle,
+            Buffer key,
+            Buffer val,
+            Compare compare_func = &default_compare);
+        bool erase(
+            const CollectionHandle& handle,
+            const Buffer& key,
+            Compare compare_func = &default_compare);
+        Iterator get_iterator(const CollectionHandle& handle);
+        Iterator get_iterator(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            Compare compare_func = &default_compare);
+        Iterator get_iterator(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            Compare compare_func = &default_compare);
+        Iterator get_iterator(const CollectionHandle& handle, const Snapshot& snapshot);
+        Iterator get_iterator(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            const Snapshot& snapshot,
+            Compare compare_func = &default_compare);
+
+        bool collect_value_log_garbage(
+            double min_garbage_ratio = 0,
+            Compare compare_func = &default_compare);
 
     private:
+        // Stored as a collection's number of records while the stored one may be wrong
+        static const uint64_t UNKNOWN_NUM_RECORDS = UINT64_MAX;
+
         PageManager& _manager;
+        ValueLog* _value_log;
+        WriteAheadLog* _wal;
+        uint64_t _store_collections_callback;
 
+        struct VersionStore;
         struct Collection {
+            Buffer name;
+            // The COLLECTIONS page holding the collection's entry
+            Page::ID collections_page_id;
             Page::ID root_node_id;
             Page::ID free_list_id;
+            // Number of records in the collection's entry, as last read or written
+            uint64_t stored_num_records = 0;
+            // Set once the collection is cached
+            std::unique_ptr<FreeSpaceMap> free_space_map = nullptr;
+            std::unique_ptr<std::atomic<uint64_t>> num_records = nullptr;
+            // Without a WAL, the stored number is marked unknown the first time it changes
+            std::unique_ptr<std::once_flag> num_records_changed = nullptr;
+            std::unique_ptr<VersionStore> versions = nullptr;
+        };
+
+        // Entries are never removed, so references to them stay valid
+        std::unordered_map<Buffer, Collection, Buffer::Hash, Buffer::EqualTo> _collections;
+        boost::shared_mutex _collections_mutex;
+
+        /*
+            Where the value a key had before a change is, none if the change inserted it.
+            The value is left where it was and only freed once the version is dropped.
+        */
+        struct Version {
+            uint64_t sequence;
+            std::optional<std::tuple<Page::ID, size_t>> val;
+        };
+        struct KeyLess {
+            Compare compare_func;
+
+            bool operator()(const Buffer& b0, const Buffer& b1) const;
+        };
+        // The versions of each changed key of a collection, oldest first
+        using Versions = std::map<Buffer, std::vector<Version>, KeyLess>;
+        // Each collection keeps its own versions, so writers to different collections don't share a lock
+        struct VersionStore {
+            boost::shared_mutex mutex;
+            // Made with the compare function of the first change saved
+            std::optional<Versions> versions;
+        };
+
+        // Number of the last change made to a leaf entry
+        std::atomic<uint64_t> _sequence;
+        std::atomic<size_t> _num_snapshots;
+        std::multiset<uint64_t> _snapshots;
+        boost::mutex _snapshots_mutex;
+        // Held shared by changes to more than one key, so a snapshot sees all or none of them
+        boost::shared_mutex _snapshot_mutex;
+        // Held shared by bulk loads, their values in the value log aren't in the tree until they're done
+        boost::shared_mutex _value_log_gc_mutex;
+
+        // Returns the index of the entry to descend into
+        using ChildSelector = std::function<size_t(PageAccessor&)>;
+
+        struct PathNode : noncopyable {
+            PathNode(PageAccessor _page);
+
+            PageAccessor page;
+            UpgradePageLock lock;
+            size_t index;
+        };
+        using Path = std::list<PathNode>;
+
+        // An entry taken out of a leaf, its value is freed by the version instead if one kept it
+        struct ErasedEntry {
+            Page::LeafNodeEntry entry;
+            bool val_kept;
         };
 
         Collection create_collection(const Buffer& name);
-        Collection get_or_create_collection(const Buffer& name);
-        Collection get_or_create_collection(const Buffer& name, bool& created);
+        const Collection& get_or_create_collection(const Buffer& name);
+        const Collection& get_or_create_collection(const Buffer& name, bool& created);
+        Collection load_collection(const Buffer& name, bool& created);
+        uint64_t recount_records(Page::ID root_node_id);
+        void add_num_records(const Collection& collection, int64_t n);
+        void store_num_records(const Collection& collection, uint64_t num_records);
+        void store_collections();
+        void apply_write_batch(const WriteBatch& batch, Compare compare_func);
 
-        Page::InternalNodeEntryListIterator search_internal_node_entries(
-            PageAccessor& page,
+        void release_snapshot(uint64_t sequence);
+        bool save_version(
+            const Collection& collection,
+            const Buffer& key,
+            const Page::LeafNodeEntry* entry,
+            Compare compare_func);
+        void apply_versions(
+            const Collection& collection,
+            uint64_t sequence,
+            std::vector<std::tuple<Buffer, Buffer>>& entries,
+            const std::optional<Buffer>& lower,
+            bool lower_inclusive,
+            const std::optional<Buffer>& upper,
+            bool upper_inclusive,
+            Compare compare_func);
+        void move_version_value(
+            const Collection& collection,
             const Buffer& key,
+            const ValueLog::Pointer& pointer,
+            const Buffer& val);
+
+        Iterator seek(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            std::optional<Buffer> end_key,
             Compare compare_func);
-        Page::LeafNodeEntryListIterator find_leaf_node_entry(
+
+        Buffer get_data(Page::ID data_id, size_t data_index);
+        ValueReader get_value_reader(
+            Page::ID data_id,
+            size_t data_index,
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf = nullptr);
+        int compare_key(const Page::Key& entry_key, const Buffer& key, const Compare& compare_func);
+        int compare_key(const Page::KeyView& entry_key, const Buffer& key, const Compare& compare_func);
+        ChildSelector select_child_with_bound(
+            Page::ID root_node_id,
+            const Buffer& key,
+            Compare compare_func,
+            std::optional<Buffer>& bound);
+        void read_values(
+            std::vector<std::tuple<Page::ID, size_t, size_t>>& val_ptrs,
+            std::vector<std::optional<Buffer>>& vals);
+
+        size_t search_internal_node_entries(
             PageAccessor& page,
             const Buffer& key,
             Compare compare_func);
-        PageAccessor get_leaf_page(
+        size_t search_leaf_node_entries(
+            PageAccessor& page,
+            const Buffer& key,
+            Compare compare_func,
+            bool& found);
+
+        template <class TLock>
+        std::unique_ptr<LockedPage<TLock>> get_leaf_page(
+            Page::ID root_node_id,
+            const ChildSelector& select_child);
+        template <class TLock>
+        std::unique_ptr<LockedPage<TLock>> get_leaf_page(
             Page::ID root_node_id,
             const Buffer& key,
             Compare compare_func);
 
-        std::tuple<Page::ID, size_t> insert_value_into_data_page(
-            Page::ID free_list_id,
+        static bool can_insert_entry(const PageAccessor& page, const Buffer& key);
+        static bool can_erase_entry(const PageAccessor& page, size_t index, bool is_root);
+
+        void split_path(const Collection& collection, Path& path, const Buffer& key, Compare compare_func);
+        void split_root(const Collection& collection, Path& path);
+        Path::iterator split_node(
+            const Collection& collection,
+            Path& path,
+            Path::iterator node,
+            const Buffer& key,
+            Compare compare_func);
+
+        // NOTE: The leaf page is written by the caller, so it can be changed more than once before.
+        void insert_leaf_node_entry(
+            const Collection& collection,
+            PageAccessor& page,
+            size_t pos,
+            const Buffer& key,
+            const Buffer& val,
+            Compare compare_func);
+        void update_leaf_node_entry(
+            const Collection& collection,
+            PageAccessor& page,
+            size_t pos,
+            const Buffer& key,
+            const Buffer& val,
+            Compare compare_func);
+
+        std::tuple<Page::ID, size_t> insert_leaf_value(
+            const Collection& collection,
+            const Buffer& key,
             const Buffer& val);
+
+        std::tuple<Page::ID, size_t> insert_value(
+            FreeSpaceMap& free_space_map,
+            const Buffer& val);
+        std::tuple<Page::ID, size_t> insert_value_into_data_page(
+            FreeSpaceMap& free_space_map,
+            const Buffer& val,
+            Page::ID overflow_id = Page::INVALID_ID,
+            size_t overflow_index = 0);
+
+        bool apply_to_leaf(
+            const Collection& collection,
+            PageAccessor& leaf,
+            const WriteBatch::Operation& operation,
+            Compare compare_func,
+            std::vector<ErasedEntry>& erased);
+        std::optional<ErasedEntry> erase_and_rebalance(
+            const Collection& collection,
+            const Buffer& key,
+            Compare compare_func);
+        bool rebalance_node(
+            const Collection& collection,
+            PathNode& parent,
+            PathNode& node,
+            std::optional<PathNode>& left_sibling);
+        void collapse_root(const Collection& collection, PathNode& root);
+        void set_prev_leaf_node_page(Page::ID page_id, Page::ID prev_id);
+
+        static Page::Key get_node_entry_key(const PageAccessor& page, size_t i);
+        static bool can_insert_node_entry(const PageAccessor& page, const Page::Key& key);
+        static void move_node_entry(
+            PageAccessor& src,
+            size_t i,
+            PageAccessor& dst,
+            size_t pos,
+            const Page::Key& key);
+
+        Page::Key create_node_key(const Collection& collection, const Buffer& key);
+        Page::Key copy_node_key(const Collection& collection, const Page::Key& key);
+        void free_node_key(const Collection& collection, const Page::Key& key);
+
+        void free_node_page(const Collection& collection, PageAccessor& page);
+        void free_leaf_node_entry(const Collection& collection, const ErasedEntry& erased);
+        void free_value(FreeSpaceMap& free_space_map, Page::ID data_id, size_t data_index);
+
+        // The pages of a bulk load in progress
+        struct BulkLoad {
+            // The leaf and DATA page being filled
+            std::optional<PageAccessor> leaf;
+            std::optional<PageAccessor> data_page;
+            // Every page created, they're freed if the load fails
+            std::vector<Page::ID> page_ids;
+            // Filled DATA pages and the space left in them, added to the free list once loaded
+            std::vector<std::tuple<Page::ID, uint16_t>> data_pages;
+            Page::ID first_leaf_id = Page::INVALID_ID;
+            uint64_t num_records = 0;
+        };
+
+        bool is_empty_collection(const Collection& collection);
+        Page::ID build_bulk_load_tree(
+            const Collection& collection,
+            BulkLoad& load,
+            const BulkLoadSource& source,
+            uint16_t target_size,
+            Compare compare_func);
+        void abort_bulk_load(const Collection& collection, BulkLoad& load);
+        std::tuple<Page::ID, size_t> append_value(BulkLoad& load, const Buffer& val);
+        PageAccessor create_bulk_load_page(BulkLoad& load, Page::Type type);
+        PageAccessor create_data_page(BulkLoad& load);
+        void close_data_page(BulkLoad& load);
     };
 
+    /*
+        Loads pairs of key and value from [begin, end). The pairs have to be sorted
+        by key, see bulk_load with a BulkLoadSource.
+    */
+    template <class TIterator>
+    void StorageEngine::bulk_load(
+            const Buffer& collection_name,
+            TIterator begin,
+            TIterator end,
+            double fill_factor,
+            Compare compare_func) {
+        bulk_load(
+            collection_name,
+            [&begin, &end](Buffer& key, Buffer& val) {
+                if (begin == end) return false;
+                key = Buffer(begin->first);
+                val = Buffer(begin->second);
+                ++begin;
+                return true;
+            },
+            fill_factor,
+            compare_func);
+    }
+
 }
 
 #endif // _DIAMOND_STORAGE_ENGINE_H
@@ -0,0 +1,109 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_URING_STORAGE_H
+#define _DIAMOND_URING_STORAGE_H
+
+#include <atomic>
+#include <exception>
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "diamond/posix_file_storage.h"
+
+namespace diamond {
+
+    /*
+        Reads and writes a file through an io_uring. Reads and writes are queued and
+        only handed to the kernel together by submit, a background thread then
+        fulfills their futures as they complete. Many of them can be in flight at
+        once, which a single thread reading one page at a time never has.
+
+        If io_uring isn't available, reads and writes are made with pread and pwrite
+        right away and return futures that are ready. Every future has to be ready
+        before the storage is destroyed.
+
+        Plain read and write calls wait for their result anyway, so they're made with
+        pread and pwrite too. Of what the engine does, only batched writes, those of a
+        BgPageWriter or of a WriteAheadLog committing to the file, go through the ring.
+        Pages are read one at a time with pread, nothing in the engine calls
+        read_async. If the ring fails, the futures of the requests in flight get the
+        error, and so do the ones of any requests made after.
+    */
+    class UringStorage final : public Storage {
+    public:
+        static constexpr unsigned DEFAULT_QUEUE_DEPTH = 64;
+
+        UringStorage(const std::string& file_name, unsigned queue_depth = DEFAULT_QUEUE_DEPTH);
+        ~UringStorage();
+
+        // NOTE: The buffers have to stay valid until the futures are ready.
+        std::future<void> read_async(char* buffer, size_t n, uint64_t offset);
+        std::future<void> write_async(const char* buffer, size_t n, uint64_t offset);
+        // Hands the queued reads and writes to the kernel.
+        void submit();
+
+        bool uses_io_uring() const;
+
+    private:
+        struct Ring;
+        struct Request;
+
+        PosixFileStorage _file;
+        // Not set if io_uring isn't available
+        std::unique_ptr<Ring> _ring;
+        // How far writes through the ring have grown the file, _file only sees its own
+        std::atomic<uint64_t> _size;
+
+        // Requests queued and not submitted yet
+        unsigned _num_queued;
+        // Requests whose futures aren't ready yet
+        std::unordered_set<Request*> _in_flight;
+        // Set once the ring has failed
+        std::exception_ptr _error;
+        boost::mutex _sq_mutex;
+
+        std::atomic_bool _stop;
+        boost::thread _thread;
+
+        static std::unique_ptr<Ring> setup(unsigned queue_depth);
+        std::future<void> enqueue(bool write, char* buffer, size_t n, uint64_t offset);
+        void queue(Request* request, boost::unique_lock<boost::mutex>& lock);
+        void submit_queued(boost::unique_lock<boost::mutex>& lock);
+        int enter(unsigned to_submit, unsigned min_complete);
+        bool complete(Request* request, int result);
+        bool requeue(std::vector<Request*>& requests);
+        void finish(Request* request, std::exception_ptr error);
+        void fail(std::exception_ptr error);
+        void bg_task();
+
+        void write_at(const char* buffer, size_t n, uint64_t offset) override;
+        void read_at(char* buffer, size_t n, uint64_t offset) override;
+        void write_batch_at(const std::vector<Write>& writes) override;
+        uint64_t size_impl() override;
+        void sync_impl() override;
+        void truncate_impl(uint64_t size) override;
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_URING_STORAGE_H
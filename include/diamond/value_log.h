@@ -0,0 +1,146 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_VALUE_LOG_H
+#define _DIAMOND_VALUE_LOG_H
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "diamond/buffer.h"
+#include "diamond/page.h"
+#include "diamond/storage.h"
+#include "diamond/utility.h"
+
+namespace diamond {
+
+    // Opens, lists and removes the storage of each segment of a value log.
+    class ValueLogSegmentFactory {
+    public:
+        virtual std::unique_ptr<Storage> open(uint32_t segment_id) const = 0;
+        virtual std::vector<uint32_t> list() const = 0;
+        virtual void remove(uint32_t segment_id) const = 0;
+    };
+
+    // Keeps each segment in a file named after the prefix and the segment's id.
+    class FileValueLogSegmentFactory : public ValueLogSegmentFactory {
+    public:
+        FileValueLogSegmentFactory(std::string file_name_prefix);
+
+        std::unique_ptr<Storage> open(uint32_t segment_id) const override;
+        std::vector<uint32_t> list() const override;
+        void remove(uint32_t segment_id) const override;
+
+    private:
+        std::string _file_name_prefix;
+
+        std::string file_name(uint32_t segment_id) const;
+    };
+
+    /*
+        An append-only log holding values too large to be worth keeping in DATA pages,
+        so leaves only keep where a value is and updating it doesn't rewrite any page.
+        Values are appended to the last segment, along with their collection and key
+        so the garbage collector can tell whether a leaf still points at them. Once a
+        segment is full a new one is started. Space is reclaimed a segment at a time,
+        StorageEngine::collect_value_log_garbage moves the values still in use to
+        the end of the log and removes the segment. Each segment starts with the
+        number of bytes of garbage it holds, so it's still collected after a restart.
+    */
+    class ValueLog : noncopyable {
+    public:
+        // The data index of a leaf entry whose value is in the value log
+        static const size_t POINTER_INDEX;
+
+        static const size_t DEFAULT_MIN_VALUE_SIZE = 1024;
+        static const uint64_t DEFAULT_MAX_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+        /*
+            Where a value is in the log. It fits in a leaf entry's data id, the segment
+            id in the top 24 bits and the offset in the bottom 40.
+        */
+        struct Pointer {
+            uint32_t segment_id;
+            uint64_t offset;
+
+            Page::ID to_data_id() const;
+            static Pointer from_data_id(Page::ID data_id);
+        };
+
+        using ScanCallback = std::function<void(
+            const Pointer& pointer,
+            const Buffer& collection_name,
+            const Buffer& key,
+            const Buffer& val)>;
+
+        ValueLog(
+            const ValueLogSegmentFactory& segment_factory,
+            size_t min_value_size = DEFAULT_MIN_VALUE_SIZE,
+            uint64_t max_segment_size = DEFAULT_MAX_SEGMENT_SIZE);
+
+        // Values of at least this size are kept in the log.
+        size_t min_value_size() const;
+
+        Pointer append(const Buffer& collection_name, const Buffer& key, const Buffer& val);
+        Buffer read(const Pointer& pointer);
+        // Counts the value as garbage, it is reclaimed once its segment is collected.
+        void release(const Pointer& pointer);
+        // Returns once every value appended so far is durable
+        void sync();
+
+        // Returns the full segment with the largest share of garbage, if it is at least min_garbage_ratio.
+        std::optional<uint32_t> pick_segment(double min_garbage_ratio);
+        void scan(uint32_t segment_id, const ScanCallback& callback);
+        void remove_segment(uint32_t segment_id);
+
+    private:
+        // The segment's garbage size
+        static const uint64_t SEGMENT_HEADER_SIZE = sizeof(uint64_t);
+        // Sizes of the collection name, key and value
+        static const size_t RECORD_HEADER_SIZE = 3 * sizeof(uint32_t);
+        static const uint64_t OFFSET_BITS = 40;
+
+        struct Segment {
+            std::unique_ptr<Storage> storage;
+            uint64_t size;
+            uint64_t garbage_size;
+        };
+
+        const ValueLogSegmentFactory& _segment_factory;
+        size_t _min_value_size;
+        uint64_t _max_segment_size;
+
+        std::map<uint32_t, Segment> _segments;
+        uint32_t _head_id;
+        boost::shared_mutex _mutex;
+        // Held while appending, so records are appended one after the other
+        boost::mutex _append_mutex;
+
+        Segment open_segment(uint32_t segment_id);
+        void read_header(Storage& storage, uint64_t offset, uint32_t (&sizes)[3]);
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_VALUE_LOG_H
@@ -0,0 +1,163 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_WRITE_AHEAD_LOG_H
+#define _DIAMOND_WRITE_AHEAD_LOG_H
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "diamond/buffer.h"
+#include "diamond/storage.h"
+
+namespace diamond {
+
+    /*
+        Sits between the page manager and the database file, so pages are written to
+        the log before they reach the file. Writes are gathered in a batch, keeping
+        the last one at each offset, and a background thread commits the batch every
+        DELAY ms: it is appended to the log as one record and the log is synced, then
+        its writes are made to the database file without ordering or syncing them.
+        Reads see the writes that haven't reached the file yet.
+
+        A batch is only cut between operations, see Operation, so the log never holds
+        half of a split. Opening the log replays the records that were committed since
+        the last checkpoint into the database file, which is then consistent whatever
+        writes reached it before a crash.
+
+        Once the log holds checkpoint_size bytes of records, a checkpoint syncs the
+        database file and cuts the log back to its header, so recovery never replays
+        more than that and the log's file doesn't keep its largest size. The file is
+        synced once while batches are still committed, then again with commits held
+        off, which only has the writes made in between, before the log is cut.
+
+        Pages have to be written to it synchronously, by a SyncPageWriter, so each
+        one reaches the batch within the operation that changed it. StorageEngine
+        refuses a page manager that writes them in the background.
+    */
+    class WriteAheadLog final : public Storage {
+    public:
+        static const uint64_t DELAY = 10;
+        static const uint64_t DEFAULT_CHECKPOINT_SIZE = 64 * 1024 * 1024;
+
+        /*
+            Held for the duration of a change to the database that takes more than one
+            write, the background thread waits for the operations in progress before it
+            cuts a batch. Operations started within another one of the same log on the
+            same thread are part of it.
+
+            NOTE: An operation is started before any page is locked. A thread holding
+            page locks, like those of an Iterator, mustn't start one: a cut waiting for
+            the operations in progress holds off new ones, and an operation in progress
+            may be waiting for those page locks.
+        */
+        class Operation : boost::noncopyable {
+        public:
+            Operation(WriteAheadLog* wal);
+            ~Operation();
+
+        private:
+            // The logs the thread is in an operation of
+            static thread_local std::vector<const WriteAheadLog*> _held;
+
+            WriteAheadLog* _wal;
+            bool _nested;
+        };
+
+        WriteAheadLog(
+            Storage& log_storage,
+            Storage& storage,
+            uint64_t checkpoint_size = DEFAULT_CHECKPOINT_SIZE);
+        ~WriteAheadLog();
+
+        // Commits the current batch, it must not be called within an Operation.
+        void commit();
+        // Waits for the batch holding the writes made so far to be committed, not within an Operation either.
+        void wait_for_commit();
+        // Syncs the committed writes to the database file and starts the log over.
+        void checkpoint();
+        // Sequence number of the first record after the last checkpoint
+        uint64_t checkpoint_sequence();
+        // Adds a callback called before each batch is committed, to sync what it depends on.
+        void before_commit(std::function<void()> callback);
+        /*
+            Adds a callback called before each batch is cut, once the operations in
+            progress are done, to write what they left to it. Returns the id to remove
+            it by.
+        */
+        uint64_t before_cut(std::function<void()> callback);
+        void remove_before_cut(uint64_t id);
+
+    private:
+        // Sequence number of the first record and checksum of the header at the start of the log
+        static const uint64_t HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+        // Sequence number, size of the writes and checksum of a record
+        static const uint64_t RECORD_HEADER_SIZE = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+        // Offset and size of a write in a record
+        static const uint64_t WRITE_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+        using Batch = std::map<uint64_t, Buffer>;
+
+        Storage& _log_storage;
+        Storage& _storage;
+
+        Batch _batch;
+        // The batch being committed, its writes may not have reached the file yet
+        Batch _committing;
+        // Numbers of batches cut and committed, a batch is cut before its writes are committed
+        uint64_t _num_cut;
+        uint64_t _num_committed;
+        boost::condition_variable _committed;
+        boost::mutex _batch_mutex;
+        // Only grown under _batch_mutex, read without it
+        std::atomic<uint64_t> _size;
+
+        uint64_t _checkpoint_size;
+        uint64_t _log_pos;
+        uint64_t _sequence;
+        uint64_t _checkpoint_sequence;
+        std::vector<std::function<void()>> _before_commit;
+        std::map<uint64_t, std::function<void()>> _before_cut;
+        uint64_t _next_callback_id;
+        boost::mutex _commit_mutex;
+        boost::shared_mutex _operations_mutex;
+
+        std::atomic_bool _stop;
+
+        boost::thread _thread;
+
+        void recover();
+        void commit_batch();
+        void checkpoint_log();
+        void bg_task();
+
+        static uint32_t checksum(uint64_t sequence, const Buffer& writes);
+        static uint32_t checksum(uint64_t sequence);
+
+        void write_at(const char* buffer, size_t n, uint64_t offset) override;
+        void read_at(char* buffer, size_t n, uint64_t offset) override;
+        uint64_t size_impl() override;
+        void sync_impl() override;
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_WRITE_AHEAD_LOG_H
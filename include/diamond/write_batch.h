@@ -0,0 +1,70 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _DIAMOND_WRITE_BATCH_H
+#define _DIAMOND_WRITE_BATCH_H
+
+#include <optional>
+#include <vector>
+
+#include "diamond/buffer.h"
+
+namespace diamond {
+
+    /*
+        Puts and erases for one or more collections, applied together by
+        StorageEngine::write. Operations on the same key are applied in the order
+        they were added. A batch set to sync is durable once write returns, see
+        StorageEngine::sync.
+    */
+    class WriteBatch {
+    public:
+        class Operation {
+        public:
+            Operation(Buffer collection_name, Buffer key, std::optional<Buffer> val);
+
+            const Buffer& collection_name() const;
+            const Buffer& key() const;
+
+            bool is_erase() const;
+            const Buffer& val() const;
+
+        private:
+            Buffer _collection_name;
+            Buffer _key;
+            std::optional<Buffer> _val;
+        };
+
+        void put(Buffer collection_name, Buffer key, Buffer val);
+        void erase(Buffer collection_name, Buffer key);
+
+        const std::vector<Operation>& operations() const;
+        size_t size() const;
+        bool empty() const;
+        void clear();
+
+        void set_sync(bool sync);
+        bool sync() const;
+
+    private:
+        std::vector<Operation> _operations;
+        bool _sync = false;
+    };
+
+} // namespace diamond
+
+#endif // _DIAMOND_WRITE_BATCH_H
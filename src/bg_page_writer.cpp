@@ -28,6 +28,14 @@ namespace diamond {
         _queue.enqueue_write(page);
     }
 
+    void BgPageWriter::flush() {
+        _queue.flush();
+    }
+
+    bool BgPageWriter::is_synchronous() const {
+        return false;
+    }
+
     BgPageWriterQueue::BgPageWriterQueue(Storage& storage)
         : _storage(storage),
         _stop(false),
@@ -38,11 +46,7 @@ namespace diamond {
         _stop = true;
         _thread.join();
         for (const Batch& batch : _batches) {
-            for (const auto& [_, batch_item] : batch) {
-                batch_item.buffer.write_to_storage(
-                    _storage,
-                    batch_item.pos);
-            }
+            write_batch(batch);
         }
     }
 
@@ -61,11 +65,26 @@ namespace diamond {
         }
     }
 
+    void BgPageWriterQueue::flush() {
+        boost::lock_guard<boost::mutex> write_lock(_write_mutex);
+        std::list<Batch> batches;
+        {
+            boost::unique_lock<boost::mutex> lock(_mutex);
+            batches = std::move(_batches);
+            _batches.clear();
+            _current_batch = _batches.end();
+        }
+        for (const Batch& batch : batches) {
+            write_batch(batch);
+        }
+    }
+
     void BgPageWriterQueue::bg_task() {
         while (!_stop) {
             boost::this_thread::sleep_for(
                 boost::chrono::milliseconds(DELAY));
             if (_stop) break;
+            boost::lock_guard<boost::mutex> write_lock(_write_mutex);
             Batch batch;
             {
                 boost::unique_lock<boost::mutex> lock(_mutex);
@@ -74,12 +93,21 @@ namespace diamond {
                 batch = std::move(*_current_batch);
                 _current_batch = _batches.erase(_current_batch);
             }
-            for (const auto &[_, batch_item] : batch) {
-                batch_item.buffer.write_to_storage(
-                    _storage,
-                    batch_item.pos);
-            }
+            write_batch(batch);
+        }
+    }
+
+    // The pages are handed to the storage at once, so it can have all of their writes in flight
+    void BgPageWriterQueue::write_batch(const Batch& batch) {
+        std::vector<Storage::Write> writes;
+        writes.reserve(batch.size());
+        for (const auto& [_, batch_item] : batch) {
+            writes.push_back(Storage::Write{
+                batch_item.buffer.buffer(),
+                batch_item.buffer.size(),
+                batch_item.pos});
         }
+        _storage.write(writes);
     }
 
     BgPageWriterQueue::BatchItem::BatchItem(Buffer _buffer, uint64_t _pos)
@@ -0,0 +1,48 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "diamond/bg_value_log_collector.h"
+
+namespace diamond {
+
+    const double BgValueLogCollector::DEFAULT_MIN_GARBAGE_RATIO = 0.5;
+
+    BgValueLogCollector::BgValueLogCollector(
+            StorageEngine& storage_engine,
+            double min_garbage_ratio,
+            StorageEngine::Compare compare_func)
+        : _storage_engine(storage_engine),
+        _min_garbage_ratio(min_garbage_ratio),
+        _compare_func(compare_func),
+        _stop(false),
+        _thread(std::bind(&BgValueLogCollector::bg_task, this)) {}
+
+    BgValueLogCollector::~BgValueLogCollector() {
+        _stop = true;
+        _thread.join();
+    }
+
+    void BgValueLogCollector::bg_task() {
+        while (!_stop) {
+            boost::this_thread::sleep_for(
+                boost::chrono::milliseconds(DELAY));
+            // Segments are collected one after the other until none has enough garbage
+            while (!_stop && _storage_engine.collect_value_log_garbage(_min_garbage_ratio, _compare_func)) {}
+        }
+    }
+
+} // namespace diamond
@@ -20,7 +20,11 @@
 namespace diamond {
 
     BinaryIArchive::BinaryIArchive(const Buffer& buffer)
-        : _reader(buffer) {}
+        : _buffer_reader(std::make_unique<BufferReader>(buffer)),
+        _reader(*_buffer_reader) {}
+
+    BinaryIArchive::BinaryIArchive(Reader& reader)
+        : _reader(reader) {}
 
     template <>
     void BinaryIArchive::load_primitive(std::string& str) {
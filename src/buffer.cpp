@@ -16,6 +16,7 @@
 */
 
 #include <cstring>
+#include <new>
 
 #include "diamond/buffer.h"
 #include "diamond/storage.h"
@@ -28,14 +29,14 @@ namespace diamond {
 
     Buffer::Buffer(size_t size)
         : _size(size),
-        _buffer(new char[size]) {}
+        _buffer(allocate(size)) {}
 
     Buffer::Buffer(const char* buffer)
         : Buffer(buffer, strlen(buffer)) {}
 
     Buffer::Buffer(const char* buffer, size_t size)
             : _size(size),
-            _buffer(new char[size]) {
+            _buffer(allocate(size)) {
         std::memcpy(_buffer, buffer, _size);
     }
 
@@ -44,13 +45,13 @@ namespace diamond {
 
     Buffer::Buffer(Storage& storage, size_t size, uint64_t offset)
             : _size(size),
-            _buffer(new char[size]) {
+            _buffer(allocate(size)) {
         storage.read(_buffer, size, offset);
     }
 
     Buffer::Buffer(const Buffer& other)
             : _size(other._size),
-            _buffer(new char[other._size]){
+            _buffer(allocate(other._size)) {
         std::memcpy(_buffer, other._buffer, _size);
     }
 
@@ -62,7 +63,7 @@ namespace diamond {
     }
 
     Buffer::~Buffer() {
-        if (_buffer) delete[] _buffer;
+        if (_buffer) deallocate(_buffer, _size);
     }
 
     size_t Buffer::size() const {
@@ -70,9 +71,10 @@ namespace diamond {
     }
 
     void Buffer::resize(size_t s) {
-        char* new_buffer = new char[s];
+        char* new_buffer = allocate(s);
         if (_buffer) {
             std::memcpy(new_buffer, _buffer, (_size > s) ? s : _size);
+            deallocate(_buffer, _size);
         }
         _buffer = new_buffer;
         _size = s;
@@ -94,15 +96,19 @@ namespace diamond {
         return std::string(_buffer, _size);
     }
 
+    Buffer::operator std::string_view() const {
+        return std::string_view(_buffer, _size);
+    }
+
     char Buffer::operator[](size_t i) const {
         return _buffer[i];
     }
 
     Buffer& Buffer::operator=(const Buffer& other) {
         if (this != &other) {
-            if (_buffer) delete[] _buffer;
+            if (_buffer) deallocate(_buffer, _size);
             _size = other._size;
-            _buffer = new char[_size];
+            _buffer = allocate(_size);
             std::memcpy(_buffer, other._buffer, _size);
         }
 
@@ -111,7 +117,7 @@ namespace diamond {
 
     Buffer& Buffer::operator=(Buffer&& other) {
         if (this != &other) {
-            if (_buffer) delete[] _buffer;
+            if (_buffer) deallocate(_buffer, _size);
             _size = other._size;
             _buffer = other._buffer;
             other._size = 0;
@@ -130,15 +136,36 @@ namespace diamond {
         return !(*this == other);
     }
 
+    /* Static */
+    char* Buffer::allocate(size_t size) {
+        if (size > 0 && size % ALIGNMENT == 0) {
+            return new (std::align_val_t(ALIGNMENT)) char[size];
+        }
+        return new char[size];
+    }
+
+    /* Static */
+    // NOTE: size has to be the one the buffer was allocated with.
+    void Buffer::deallocate(char* buffer, size_t size) {
+        if (size > 0 && size % ALIGNMENT == 0) {
+            ::operator delete[](buffer, std::align_val_t(ALIGNMENT));
+        } else {
+            delete[] buffer;
+        }
+    }
+
     std::ostream& operator<<(std::ostream& os, const Buffer& buffer) {
         os << buffer.to_str();
         return os;
     }
 
+    Reader::Reader(endian::Endianness endianness)
+        : _endianness(endianness) {}
+
     BufferReader::BufferReader(const Buffer& buffer, endian::Endianness endianness)
-        : _ptr(0),
-        _buffer(buffer),
-        _endianness(endianness) {}
+        : Reader(endianness),
+        _ptr(0),
+        _buffer(buffer) {}
 
     size_t BufferReader::bytes_read() const {
         return _ptr;
@@ -184,7 +211,9 @@ namespace diamond {
         while (_ptr + size > buffer_size) {
             buffer_size *= 2;
         }
-        _buffer.resize(buffer_size);
+        if (buffer_size != _buffer.size()) {
+            _buffer.resize(buffer_size);
+        }
         std::memcpy(_buffer.buffer() + _ptr, val, size);
         _ptr += size;
     }
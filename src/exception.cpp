@@ -43,6 +43,8 @@ namespace diamond {
             return "max page capacity has been reached and there are no unused pages available to evict.";
         case ErrorCode::PAGE_DOES_NOT_EXIST:
             return "the requested page does not exist.";
+        case ErrorCode::UNSUPPORTED_FILE_FORMAT:
+            return "database file was written in an unsupported format.";
         }
     }
 
@@ -15,6 +15,8 @@
 **  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <unistd.h>
+
 #include "diamond/file_storage.h"
 
 namespace diamond {
@@ -23,6 +25,8 @@ namespace diamond {
         if ((_file = fopen(file_name.c_str(), "r+")) == nullptr) {
             _file = fopen(file_name.c_str(), "w+");
         }
+        fseek(_file, 0, SEEK_END);
+        _size = ftell(_file);
     }
 
     FileStorage::~FileStorage() {
@@ -31,6 +35,9 @@ namespace diamond {
 
     void FileStorage::write_impl(const char* buffer, size_t n) {
         fwrite(buffer, sizeof(char), n, _file);
+        // Only called under the storage's lock, so nothing else grows the size meanwhile
+        uint64_t end = ftell(_file);
+        if (end > _size) _size = end;
     }
 
     void FileStorage::read_impl(char* buffer, size_t n) {
@@ -42,11 +49,18 @@ namespace diamond {
     }
 
     uint64_t FileStorage::size_impl() {
-        uint64_t pos = ftell(_file);
-        fseek(_file, 0, SEEK_END);
-        uint64_t size = ftell(_file);
-        fseek(_file, pos, SEEK_SET);
-        return size;
+        return _size;
+    }
+
+    void FileStorage::sync_impl() {
+        fflush(_file);
+        fsync(fileno(_file));
+    }
+
+    void FileStorage::truncate_impl(uint64_t size) {
+        fflush(_file);
+        ftruncate(fileno(_file), size);
+        _size = size;
     }
 
 } // namespace diamond
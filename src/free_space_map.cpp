@@ -0,0 +1,210 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <thread>
+
+#include "diamond/exception.h"
+#include "diamond/free_space_map.h"
+
+namespace diamond {
+
+    const size_t FreeSpaceMap::NUM_SIZE_CLASSES = Page::SIZE / SIZE_CLASS + 1;
+
+    // Loads the entries of all of the collection's FREE_LIST pages
+    FreeSpaceMap::FreeSpaceMap(PageManager& manager, Page::ID free_list_id)
+            : _manager(manager),
+            _last_free_list_id(free_list_id) {
+        Page::ID page_id = free_list_id;
+        while (page_id != Page::INVALID_ID) {
+            PageAccessor page = _manager.get_page(page_id);
+            if (page->get_type() != Page::Type::FREE_LIST) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+
+            SharedPageLock page_lock(page);
+            size_t n = page->get_num_free_list_entries();
+            for (size_t i = 0; i < n; i++) {
+                Page::FreeListEntry free_list_entry = page->get_free_list_entry(i);
+                Shard& shard = get_shard(free_list_entry.data_id());
+                auto [it, inserted] = shard.entries.try_emplace(
+                    free_list_entry.data_id(),
+                    Entry{
+                        .free_space = free_list_entry.free_space(),
+                        .free_list_id = page_id,
+                        .free_list_index = i,
+                        .bucket_index = 0,
+                        .changed = false
+                    });
+                if (inserted) add_to_bucket(shard, free_list_entry.data_id(), it->second);
+            }
+
+            _last_free_list_id = page_id;
+            page_id = page->get_next_free_list_page();
+        }
+    }
+
+    /*
+        Looks in the size classes from the smallest one that can hold space, starting
+        with the shard picked by the calling thread. Only the last few pages of the
+        smallest class are looked at, its pages may have less space free than needed,
+        every page of the classes above it has enough.
+    */
+    bool FreeSpaceMap::reserve(uint16_t space, Page::ID& data_id) {
+        size_t size_class = space / SIZE_CLASS;
+        if (size_class >= NUM_SIZE_CLASSES) return false;
+
+        size_t first = std::hash<std::thread::id>()(std::this_thread::get_id()) % NUM_SHARDS;
+        for (size_t i = 0; i < NUM_SHARDS; i++) {
+            Shard& shard = _shards[(first + i) % NUM_SHARDS];
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+            for (size_t c = size_class; c < NUM_SIZE_CLASSES; c++) {
+                const std::vector<Page::ID>& bucket = shard.buckets[c];
+                size_t n = bucket.size();
+                if (c == size_class && n > MAX_PARTIAL_CLASS_SCAN) n = MAX_PARTIAL_CLASS_SCAN;
+                for (size_t j = 1; j <= n; j++) {
+                    Entry& entry = shard.entries.at(bucket[bucket.size() - j]);
+                    if (entry.free_space < space) continue;
+                    data_id = bucket[bucket.size() - j];
+                    set_free_space(shard, data_id, entry, entry.free_space - space);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void FreeSpaceMap::add(Page::ID data_id, uint16_t free_space) {
+        Shard& shard = get_shard(data_id);
+        boost::lock_guard<boost::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(data_id);
+        if (it != shard.entries.end()) {
+            set_free_space(shard, data_id, it->second, free_space);
+        } else {
+            insert(shard, data_id, free_space);
+        }
+    }
+
+    void FreeSpaceMap::release(Page::ID data_id, uint16_t space) {
+        Shard& shard = get_shard(data_id);
+        boost::lock_guard<boost::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(data_id);
+        if (it != shard.entries.end()) {
+            // CASE 1: Free List has an entry for the data page, add to its free space
+            uint16_t free_space = std::min<size_t>(it->second.free_space + space, Page::SIZE);
+            set_free_space(shard, data_id, it->second, free_space);
+        } else {
+            // CASE 2: Data page has no entry, it was full or it's an overflow page
+            insert(shard, data_id, space);
+        }
+    }
+
+    /*
+        The entries that changed are gathered shard by shard, then each FREE_LIST page
+        is written once. An entry that changes again meanwhile is stored next time.
+    */
+    void FreeSpaceMap::store() {
+        std::map<Page::ID, std::vector<std::tuple<size_t, uint16_t>>> changed;
+        for (Shard& shard : _shards) {
+            boost::lock_guard<boost::mutex> lock(shard.mutex);
+            for (Page::ID data_id : shard.changed) {
+                Entry& entry = shard.entries.at(data_id);
+                changed[entry.free_list_id].emplace_back(entry.free_list_index, entry.free_space);
+                entry.changed = false;
+            }
+            shard.changed.clear();
+        }
+
+        for (const auto& [free_list_id, entries] : changed) {
+            PageAccessor page = _manager.get_page(free_list_id);
+            UniquePageLock page_lock(page);
+            for (const auto& [free_list_index, free_space] : entries) {
+                page->set_free_list_entry_free_space(free_list_index, free_space);
+            }
+            _manager.write_page(page.instance());
+        }
+    }
+
+    FreeSpaceMap::Shard::Shard()
+        : buckets(NUM_SIZE_CLASSES) {}
+
+    FreeSpaceMap::Shard& FreeSpaceMap::get_shard(Page::ID data_id) {
+        return _shards[data_id % NUM_SHARDS];
+    }
+
+    // Appends an entry for the data page to the last FREE_LIST page, or to a new one once it's full
+    void FreeSpaceMap::insert(Shard& shard, Page::ID data_id, uint16_t free_space) {
+        boost::lock_guard<boost::mutex> append_lock(_append_mutex);
+        PageAccessor page = _manager.get_page(_last_free_list_id);
+        UniquePageLock page_lock(page);
+        Entry entry{
+            .free_space = free_space,
+            .free_list_id = page->get_id(),
+            .free_list_index = 0,
+            .bucket_index = 0,
+            .changed = false
+        };
+        if (page->can_insert_free_list_entry()) {
+            entry.free_list_index = page->insert_free_list_entry(data_id, free_space);
+            _manager.write_page(page.instance());
+        } else {
+            PageAccessor new_page = _manager.create_page(Page::Type::FREE_LIST);
+            UniquePageLock new_page_lock(new_page);
+            entry.free_list_id = new_page->get_id();
+            entry.free_list_index = new_page->insert_free_list_entry(data_id, free_space);
+            page->set_next_free_list_page(new_page->get_id());
+            _manager.write_page(new_page.instance());
+            _manager.write_page(page.instance());
+            _last_free_list_id = new_page->get_id();
+        }
+        add_to_bucket(shard, data_id, shard.entries.emplace(data_id, entry).first->second);
+    }
+
+    // Moves the data page to the bucket of its new size class and marks its entry to be stored
+    void FreeSpaceMap::set_free_space(Shard& shard, Page::ID data_id, Entry& entry, uint16_t free_space) {
+        if (free_space / SIZE_CLASS != entry.free_space / SIZE_CLASS) {
+            remove_from_bucket(shard, entry);
+            entry.free_space = free_space;
+            add_to_bucket(shard, data_id, entry);
+        } else {
+            entry.free_space = free_space;
+        }
+
+        if (!entry.changed) {
+            entry.changed = true;
+            shard.changed.push_back(data_id);
+        }
+    }
+
+    void FreeSpaceMap::add_to_bucket(Shard& shard, Page::ID data_id, Entry& entry) {
+        std::vector<Page::ID>& bucket = shard.buckets[entry.free_space / SIZE_CLASS];
+        entry.bucket_index = bucket.size();
+        bucket.push_back(data_id);
+    }
+
+    // Moves the last page of the bucket into the entry's place
+    void FreeSpaceMap::remove_from_bucket(Shard& shard, Entry& entry) {
+        std::vector<Page::ID>& bucket = shard.buckets[entry.free_space / SIZE_CLASS];
+        Page::ID last_id = bucket.back();
+        bucket[entry.bucket_index] = last_id;
+        shard.entries.at(last_id).bucket_index = entry.bucket_index;
+        bucket.pop_back();
+    }
+
+} // namespace diamond
@@ -32,15 +32,17 @@ namespace diamond {
     }
 
     Page::ID LRUEvictionPolicy::next(Page::ID after) {
+        // The least recently used page is at the back of the list.
         if (after != Page::INVALID_ID) {
             auto iter = _iters.at(after);
-            if (iter != _list.end()) {
-                return *iter;
+            if (iter != _list.begin()) {
+                return *--iter;
             }
             return Page::INVALID_ID;
-        } else {
-            return *_list.begin();
+        } else if (!_list.empty()) {
+            return _list.back();
         }
+        return Page::INVALID_ID;
     }
 
     void LRUEvictionPolicy::remove(Page::ID id) {
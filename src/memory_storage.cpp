@@ -15,40 +15,96 @@
 **  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
 #include "diamond/memory_storage.h"
 
 namespace diamond {
 
-    MemoryStorage::MemoryStorage(size_t initial_size)
-        : _buffer(new char[initial_size]),
-        _pos(0),
-        _size(initial_size) {}
+    MemoryStorage::MemoryStorage(uint64_t reserved_size)
+            : _chunks(new std::atomic<char*>[MAX_CHUNKS]),
+            _size(0) {
+        for (size_t i = 0; i < MAX_CHUNKS; i++) {
+            _chunks[i] = nullptr;
+        }
+        for (uint64_t offset = 0; offset < reserved_size; offset += CHUNK_SIZE) {
+            get_chunk(offset / CHUNK_SIZE, true);
+        }
+    }
 
     MemoryStorage::~MemoryStorage() {
-        delete[] _buffer;
+        for (size_t i = 0; i < MAX_CHUNKS; i++) {
+            delete[] _chunks[i].load();
+        }
     }
 
-    void MemoryStorage::write_impl(const char* buffer, size_t n) {
-        if (_pos + n >= _size) {
-            _size *= 2;
-            char* new_buffer = new char[_size];
-            std::memcpy(new_buffer, _buffer, _size);
-            delete[] _buffer;
-            _buffer = new_buffer;
+    // Chunks are only allocated, never freed, while the storage is in use, so an allocated one is used without locking.
+    char* MemoryStorage::get_chunk(size_t index, bool create) {
+        if (index >= MAX_CHUNKS) {
+            throw std::out_of_range("offset is past the last chunk");
         }
-        std::memcpy(_buffer, buffer, n);
+        char* chunk = _chunks[index].load(std::memory_order_acquire);
+        if (chunk != nullptr || !create) return chunk;
+
+        boost::lock_guard<boost::mutex> lock(_chunks_mutex);
+        chunk = _chunks[index].load(std::memory_order_relaxed);
+        if (chunk != nullptr) return chunk;
+        chunk = new char[CHUNK_SIZE]();
+        _chunks[index].store(chunk, std::memory_order_release);
+        return chunk;
     }
 
-    void MemoryStorage::read_impl(char* buffer, size_t n) {
-        std::memcpy(buffer, _buffer, n);
+    void MemoryStorage::write_at(const char* buffer, size_t n, uint64_t offset) {
+        uint64_t end = offset + n;
+        while (n > 0) {
+            char* chunk = get_chunk(offset / CHUNK_SIZE, true);
+            uint64_t chunk_offset = offset % CHUNK_SIZE;
+            size_t chunk_size = std::min<uint64_t>(n, CHUNK_SIZE - chunk_offset);
+            std::memcpy(chunk + chunk_offset, buffer, chunk_size);
+            buffer += chunk_size;
+            offset += chunk_size;
+            n -= chunk_size;
+        }
+
+        uint64_t size = _size.load();
+        while (size < end && !_size.compare_exchange_weak(size, end)) {}
     }
 
-    void MemoryStorage::seek_impl(size_t n) {
-        _pos = n;
+    void MemoryStorage::read_at(char* buffer, size_t n, uint64_t offset) {
+        while (n > 0) {
+            const char* chunk = get_chunk(offset / CHUNK_SIZE, false);
+            uint64_t chunk_offset = offset % CHUNK_SIZE;
+            size_t chunk_size = std::min<uint64_t>(n, CHUNK_SIZE - chunk_offset);
+            if (chunk != nullptr) {
+                std::memcpy(buffer, chunk + chunk_offset, chunk_size);
+            } else {
+                std::memset(buffer, 0, chunk_size);
+            }
+            buffer += chunk_size;
+            offset += chunk_size;
+            n -= chunk_size;
+        }
     }
 
     uint64_t MemoryStorage::size_impl() {
         return _size;
     }
 
+    void MemoryStorage::sync_impl() {}
+
+    void MemoryStorage::truncate_impl(uint64_t size) {
+        uint64_t offset = size;
+        uint64_t end = _size;
+        while (offset < end) {
+            char* chunk = get_chunk(offset / CHUNK_SIZE, false);
+            uint64_t chunk_offset = offset % CHUNK_SIZE;
+            size_t chunk_size = std::min<uint64_t>(end - offset, CHUNK_SIZE - chunk_offset);
+            if (chunk != nullptr) std::memset(chunk + chunk_offset, 0, chunk_size);
+            offset += chunk_size;
+        }
+        if (size < end) _size = size;
+    }
+
 } // namespace diamond
@@ -0,0 +1,109 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include "diamond/mmap_storage.h"
+
+namespace diamond {
+
+    MmapStorage::MmapStorage(const std::string& file_name)
+            : _extents(new std::atomic<char*>[MAX_EXTENTS]),
+            _size(0) {
+        if ((_fd = open(file_name.c_str(), O_RDONLY)) == -1) {
+            throw std::system_error(errno, std::generic_category(), file_name);
+        }
+        for (size_t i = 0; i < MAX_EXTENTS; i++) {
+            _extents[i] = nullptr;
+        }
+        file_size();
+    }
+
+    MmapStorage::~MmapStorage() {
+        for (size_t i = 0; i < MAX_EXTENTS; i++) {
+            if (_extents[i] != nullptr) munmap(_extents[i], EXTENT_SIZE);
+        }
+        close(_fd);
+    }
+
+    uint64_t MmapStorage::file_size() {
+        struct stat st;
+        if (fstat(_fd, &st) == -1) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        _size = st.st_size;
+        return st.st_size;
+    }
+
+    // Extents are only mapped, never unmapped, while the storage is in use, so a mapped one is read without locking.
+    const char* MmapStorage::get_extent(size_t index) {
+        if (index >= MAX_EXTENTS) {
+            throw std::out_of_range("offset is past the last extent");
+        }
+        char* extent = _extents[index].load(std::memory_order_acquire);
+        if (extent != nullptr) return extent;
+
+        boost::lock_guard<boost::mutex> lock(_extents_mutex);
+        extent = _extents[index].load(std::memory_order_relaxed);
+        if (extent != nullptr) return extent;
+        void* addr = mmap(nullptr, EXTENT_SIZE, PROT_READ, MAP_SHARED, _fd, index * EXTENT_SIZE);
+        if (addr == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        extent = static_cast<char*>(addr);
+        _extents[index].store(extent, std::memory_order_release);
+        return extent;
+    }
+
+    void MmapStorage::write_at(const char*, size_t, uint64_t) {
+        throw std::logic_error("mmap storage is read-only");
+    }
+
+    void MmapStorage::read_at(char* buffer, size_t n, uint64_t offset) {
+        // The file is only looked at again if it may have grown since
+        uint64_t size = _size;
+        if (offset + n > size) size = file_size();
+        size_t available = offset < size ? std::min<uint64_t>(n, size - offset) : 0;
+        std::memset(buffer + available, 0, n - available);
+
+        while (available > 0) {
+            const char* extent = get_extent(offset / EXTENT_SIZE);
+            uint64_t extent_offset = offset % EXTENT_SIZE;
+            size_t chunk_size = std::min<uint64_t>(available, EXTENT_SIZE - extent_offset);
+            std::memcpy(buffer, extent + extent_offset, chunk_size);
+            buffer += chunk_size;
+            offset += chunk_size;
+            available -= chunk_size;
+        }
+    }
+
+    uint64_t MmapStorage::size_impl() {
+        return file_size();
+    }
+
+    void MmapStorage::sync_impl() {}
+
+} // namespace diamond
@@ -17,17 +17,25 @@
 
 #include <algorithm>
 #include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
 #include <utility>
 
 #include "diamond/buffer.h"
+#include "diamond/exception.h"
 #include "diamond/page.h"
 
 namespace diamond {
 
     const Page::ID Page::INVALID_ID = 0;
 
+    const uint8_t Page::FORMAT_VERSION = 1;
     const uint16_t Page::SIZE = 8192;
+    const size_t Page::ALIGNMENT = 4096;
     const uint16_t Page::MAX_KEY_SIZE = SIZE / 4;
+    const uint16_t Page::MAX_INLINE_KEY_SIZE = SIZE / 8;
+    const uint16_t Page::MIN_SIZE = SIZE / 4;
 
     /* Static */
     uint64_t Page::file_pos_for_id(ID id) {
@@ -40,103 +48,15 @@ namespace diamond {
 
         if (storage.size() < SIZE * id) return nullptr;
 
-        Buffer buffer(storage, SIZE, file_pos_for_id(id));
-        BufferReader buffer_reader(buffer);
+        Page* page = new Page(id);
+        storage.read(page->_data, SIZE, file_pos_for_id(id));
 
-        Page* page = new Page(id, buffer_reader.read<Type>());
-        switch (page->_type) {
-        case Type::COLLECTIONS: {
-            page->_collections.next = buffer_reader.read<ID>();
-            size_t num_elements = buffer_reader.read<size_t>();
-            page->_collections.map = new Collections();
-            for (size_t i = 0; i < num_elements; i++) {
-                size_t id_size = buffer_reader.read<size_t>();
-                Buffer id(id_size);
-                buffer_reader.read(id);
-
-                ID root_node_id = buffer_reader.read<ID>();
-                ID free_list_id = buffer_reader.read<ID>();
-
-                page->_collections.map->try_emplace(
-                    std::move(id),
-                    root_node_id,
-                    free_list_id);
-                page->_size += collection_space_req(id);
-            }
-            break;
-        }
-        case Type::DATA: {
-            size_t num_entries = buffer_reader.read<size_t>();
-            page->_data_entries = new std::vector<DataEntry>();
-            for (size_t i = 0; i < num_entries; i++) {
-                size_t data_size = buffer_reader.read<size_t>();
-                size_t rem = buffer_reader.bytes_remaining();
-                if (rem < data_size) {
-                    ID overflow_id;
-                    size_t overflow_index;
-
-                    size_t to_read = rem - (sizeof(overflow_id) + sizeof(overflow_index));
-                    Buffer data(to_read);
-                    buffer_reader.read(data);
-
-                    overflow_id = buffer_reader.read<ID>();
-                    overflow_index = buffer_reader.read<size_t>();
-
-                    page->_data_entries->emplace_back(std::move(data), overflow_id, overflow_index);
-                    page->_size += to_read + sizeof(overflow_id) + sizeof(overflow_index);
-                } else {
-                    Buffer data(data_size);
-                    buffer_reader.read(data);
-                    page->_data_entries->emplace_back(std::move(data));
-                    page->_size += data_size;
-                }
-            }
-            break;
-        }
-        case Type::FREE_LIST: {
-            page->_free_list.next = buffer_reader.read<ID>();
-            size_t num_entries = buffer_reader.read<size_t>();
-            page->_free_list.entries = new std::vector<FreeListEntry>();
-            for (size_t i = 0; i < num_entries; i++) {
-                ID data_id = buffer_reader.read<ID>(); 
-                uint16_t free_space = buffer_reader.read<uint16_t>();
-                page->_free_list.entries->emplace_back(data_id, free_space);
-                page->_size += free_list_entry_space_req();
-            }
-            break;
-        }
-        case Type::INTERNAL_NODE: {
-            size_t num_entries = buffer_reader.read<size_t>();
-            page->_internal_node_entries = new InternalNodeEntryList();
-            for (size_t i = 0; i < num_entries; i++) {
-                ID key_data_id = buffer_reader.read<ID>();
-                size_t key_data_index = buffer_reader.read<size_t>();
-                ID next_node_id = buffer_reader.read<ID>();
-
-                page->_internal_node_entries->emplace_back(key_data_id, key_data_index, next_node_id);
-                page->_size += internal_node_entry_space_req();
-            }
-            break;
-        }
-        case Type::LEAF_NODE: {
-            page->_leaf.next = buffer_reader.read<ID>();
-            size_t num_entries = buffer_reader.read<size_t>();
-            page->_leaf.entries = new LeafNodeEntryList();
-            for (size_t i = 0; i < num_entries; i++) {
-                ID key_data_id = buffer_reader.read<ID>();
-                size_t key_data_index = buffer_reader.read<size_t>();
-                ID val_data_id = buffer_reader.read<ID>();
-                size_t val_data_index = buffer_reader.read<size_t>();
-
-                page->_leaf.entries->emplace_back(
-                    key_data_id,
-                    key_data_index,
-                    val_data_id,
-                    val_data_index);
-                page->_size += leaf_node_entry_space_req();
-            }
-            break;
-        }
+        // NOTE: A page that was allocated but never written is all zeros.
+        if (page->heap_offset() == 0) {
+            page->init(page->get_type());
+        } else if (page->read_at<uint8_t>(VERSION_OFFSET) != FORMAT_VERSION) {
+            delete page;
+            throw Exception(ErrorCode::UNSUPPORTED_FILE_FORMAT);
         }
 
         return page;
@@ -144,31 +64,33 @@ namespace diamond {
 
     /* Static */
     Page* Page::new_page(ID id, Type type) {
-        return new Page(id, type);
+        Page* page = new Page(id);
+        page->init(type);
+        return page;
+    }
+
+    /* Static */
+    bool Page::can_inline_key(const Buffer& key) {
+        return key.size() <= MAX_INLINE_KEY_SIZE;
+    }
+
+    /*
+        The most data an entry can hold in an empty page, larger data has to be split
+        over several entries chained together through their overflow ids.
+    */
+    /* Static */
+    size_t Page::max_data_entry_size(bool overflows) {
+        size_t size = SIZE - HEADER_SIZE - SLOT_SIZE - sizeof(uint16_t);
+        if (overflows) size -= sizeof(ID) + sizeof(uint16_t);
+        return size;
     }
 
     Page::~Page() {
-        switch (_type) {
-        case Type::COLLECTIONS:
-            delete _collections.map;
-            break;
-        case Type::DATA:
-            delete _data_entries;
-            break;
-        case Type::FREE_LIST:
-            delete _free_list.entries;
-            break;
-        case Type::INTERNAL_NODE:
-            delete _internal_node_entries;
-            break;
-        case Type::LEAF_NODE:
-            delete _leaf.entries;
-            break;
-        }
+        ::operator delete[](_data, std::align_val_t(ALIGNMENT));
     }
 
     Page::Type Page::get_type() const {
-        return _type;
+        return static_cast<Type>(read_at<uint8_t>(TYPE_OFFSET));
     }
 
     Page::ID Page::get_id() const {
@@ -176,27 +98,27 @@ namespace diamond {
     }
 
     uint16_t Page::get_size() const {
-        return _size;
+        return SIZE - get_remaining_space();
     }
 
     uint16_t Page::get_remaining_space() const {
-        return SIZE - _size;
+        return heap_offset()
+            - (HEADER_SIZE + num_slots() * SLOT_SIZE)
+            + read_at<uint16_t>(FRAGMENTED_OFFSET);
     }
 
     uint16_t Page::header_size() const {
-        uint16_t size = sizeof(Type);
-        switch (_type) {
-        case Type::COLLECTIONS:
-            return size + sizeof(ID) + sizeof(size_t);
-        case Type::DATA:
-            return size + sizeof(size_t);
-        case Type::FREE_LIST:
-            return size + sizeof(ID) + sizeof(size_t);
-        case Type::INTERNAL_NODE:
-            return size + sizeof(size_t);
-        case Type::LEAF_NODE:
-            return size + sizeof(ID) + sizeof(size_t);
-        }
+        return HEADER_SIZE;
+    }
+
+    // Returns the space taken by an entry, including its slot.
+    uint16_t Page::get_entry_space(size_t i) const {
+        if (i >= num_slots() || slot_offset(i) == 0) throw std::out_of_range("entry does not exist");
+        return SLOT_SIZE + entry_size(entry(i));
+    }
+
+    bool Page::is_underfull() const {
+        return get_size() < MIN_SIZE;
     }
 
     uint64_t Page::file_pos() const {
@@ -207,117 +129,223 @@ namespace diamond {
         return _usage_count.load(std::memory_order::memory_order_acquire);
     }
 
+    uint64_t Page::version() const {
+        return _version.load(std::memory_order::memory_order_acquire);
+    }
+
+    void Page::reset(Type type) {
+        _version++;
+        init(type);
+    }
+
+    void Page::move_entries(Page* other) {
+        Type type = get_type();
+        other->ensure_type_is(type);
+        if (type != Type::INTERNAL_NODE && type != Type::LEAF_NODE) {
+            throw std::logic_error("invalid type");
+        }
+        if (other->num_slots() != 0) {
+            throw std::logic_error("can only move entries into an empty page");
+        }
+
+        // The header is copied along with the entries, which moves the leaf link as well.
+        std::memcpy(other->_data, _data, SIZE);
+        init(type);
+        _version++;
+        other->_version++;
+    }
+
     Page::ID Page::get_next_collections_page() const {
         ensure_type_is(Type::COLLECTIONS);
-        return _collections.next;
+        return read_at<ID>(NEXT_OFFSET);
     }
 
     void Page::set_next_collections_page(ID next) {
         ensure_type_is(Type::COLLECTIONS);
-        _collections.next = next;
+        write_at<ID>(NEXT_OFFSET, next);
     }
 
-    const Page::Collections* Page::get_collections() const {
+    size_t Page::get_num_collections() const {
         ensure_type_is(Type::COLLECTIONS);
-        return _collections.map;
+        return num_slots();
     }
 
-    bool Page::can_insert_collection(const Buffer& id) const {
+    bool Page::can_insert_collection(const Buffer& name) const {
         ensure_type_is(Type::COLLECTIONS);
-        return get_remaining_space() >= collection_space_req(id);
+        return get_remaining_space() >= collection_space_req(name);
     }
 
     bool Page::has_collection(const Buffer& name) const {
         ensure_type_is(Type::COLLECTIONS);
-        return _collections.map->find(name) != _collections.map->end();
+        return find_collection(name) != nullptr;
     }
 
-    const Page::Collection& Page::get_collection(const Buffer& name) const {
+    Page::Collection Page::get_collection(const Buffer& name) const {
         ensure_type_is(Type::COLLECTIONS);
-        return _collections.map->at(name);
+        const char* e = find_collection(name);
+        if (!e) throw std::out_of_range("collection does not exist");
+
+        e += sizeof(uint16_t) + name.size();
+        ID root_node_id;
+        ID free_list_id;
+        uint64_t num_records;
+        std::memcpy(&root_node_id, e, sizeof(ID));
+        std::memcpy(&free_list_id, e + sizeof(ID), sizeof(ID));
+        std::memcpy(&num_records, e + 2 * sizeof(ID), sizeof(uint64_t));
+        return Collection(root_node_id, free_list_id, num_records);
     }
 
-    void Page::add_collection(Buffer name, ID root_node_id, ID free_list_id) {
+    void Page::add_collection(const Buffer& name, ID root_node_id, ID free_list_id) {
         ensure_type_is(Type::COLLECTIONS);
         uint16_t space = collection_space_req(name);
         ensure_space_available(space);
 
-        if (_collections.map->try_emplace(
-                std::move(name),
-                root_node_id,
-                free_list_id).second) {
-            _size += space;
-        }
+        if (has_collection(name)) return;
+
+        uint16_t name_size = name.size();
+        char* e = insert_entry(num_slots(), space - SLOT_SIZE);
+        std::memcpy(e, &name_size, sizeof(name_size));
+        e += sizeof(name_size);
+        std::memcpy(e, name.buffer(), name_size);
+        e += name_size;
+        std::memcpy(e, &root_node_id, sizeof(ID));
+        std::memcpy(e + sizeof(ID), &free_list_id, sizeof(ID));
+        std::memset(e + 2 * sizeof(ID), 0, sizeof(uint64_t));
+    }
+
+    void Page::set_collection_num_records(const Buffer& name, uint64_t num_records) {
+        ensure_type_is(Type::COLLECTIONS);
+        const char* e = find_collection(name);
+        if (!e) throw std::out_of_range("collection does not exist");
+
+        size_t offset = e - _data + sizeof(uint16_t) + name.size() + 2 * sizeof(ID);
+        write_at<uint64_t>(offset, num_records);
     }
 
     size_t Page::get_num_data_entries() const {
         ensure_type_is(Type::DATA);
-        return _data_entries->size();
+        return num_slots();
     }
 
-    const std::vector<Page::DataEntry>* Page::get_data_entries() const {
+    Page::DataEntry Page::get_data_entry(size_t i) const {
         ensure_type_is(Type::DATA);
-        return _data_entries;
+        if (i >= num_slots()) throw std::out_of_range("data entry does not exist");
+
+        if (slot_offset(i) == 0) throw std::out_of_range("data entry was erased");
+
+        const char* e = entry(i);
+        uint16_t size;
+        std::memcpy(&size, e, sizeof(size));
+        e += sizeof(size);
+
+        if (size & OVERFLOW_FLAG) {
+            size &= ~OVERFLOW_FLAG;
+            ID overflow_id;
+            uint16_t overflow_index;
+            std::memcpy(&overflow_id, e + size, sizeof(overflow_id));
+            std::memcpy(&overflow_index, e + size + sizeof(overflow_id), sizeof(overflow_index));
+            return DataEntry(e, size, overflow_id, overflow_index);
+        }
+        return DataEntry(e, size);
     }
 
-    const Page::DataEntry& Page::get_data_entry(size_t i) const {
+    size_t Page::insert_data_entry(const Buffer& data) {
         ensure_type_is(Type::DATA);
-        return _data_entries->at(i);
+        if (data.size() > max_data_entry_size()) throw std::invalid_argument("data is too large");
+        uint16_t space = data_entry_space_req(data);
+        ensure_space_available(space);
+
+        uint16_t size = data.size();
+        size_t i;
+        char* e = insert_data_entry_slot(space - SLOT_SIZE, i);
+        std::memcpy(e, &size, sizeof(size));
+        std::memcpy(e + sizeof(size), data.buffer(), size);
+        return i;
     }
 
-    size_t Page::insert_data_entry(Buffer data) {
+    size_t Page::insert_data_entry(const Buffer& data, ID overflow_id, size_t overflow_index) {
         ensure_type_is(Type::DATA);
-        // TODO: Handle overflows
-        uint16_t space = data_entry_space_req(data);
+        if (data.size() > max_data_entry_size(true)) throw std::invalid_argument("data is too large");
+        uint16_t space = data_entry_space_req(data, true);
         ensure_space_available(space);
 
-        size_t i = _data_entries->size();
-        _data_entries->emplace_back(std::move(data));
-        _size += space;
+        uint16_t size = data.size() | OVERFLOW_FLAG;
+        uint16_t index = overflow_index;
+        size_t i;
+        char* e = insert_data_entry_slot(space - SLOT_SIZE, i);
+        std::memcpy(e, &size, sizeof(size));
+        e += sizeof(size);
+        std::memcpy(e, data.buffer(), data.size());
+        e += data.size();
+        std::memcpy(e, &overflow_id, sizeof(overflow_id));
+        std::memcpy(e + sizeof(overflow_id), &index, sizeof(index));
         return i;
     }
 
-    bool Page::can_insert_data_entry(const Buffer& data) {
+    bool Page::can_insert_data_entry(const Buffer& data, bool overflows) {
         ensure_type_is(Type::DATA);
-        // TODO: Handle overflows
-        return get_remaining_space() >= data_entry_space_req(data);
+        return get_remaining_space() >= data_entry_space_req(data, overflows);
+    }
+
+    /*
+        Data entries are referenced by their index, so an erased entry leaves its slot
+        behind to be reused by a later insert. Returns the space freed in the page.
+    */
+    uint16_t Page::erase_data_entry(size_t i) {
+        ensure_type_is(Type::DATA);
+        if (i >= num_slots() || slot_offset(i) == 0) throw std::out_of_range("data entry does not exist");
+
+        uint16_t remaining_space = get_remaining_space();
+        uint16_t size = entry_size(entry(i));
+        write_at<uint16_t>(HEADER_SIZE + i * SLOT_SIZE, 0);
+        write_at<uint16_t>(FRAGMENTED_OFFSET, read_at<uint16_t>(FRAGMENTED_OFFSET) + size);
+
+        // Slots at the end no longer reference anything, they can go
+        size_t n = num_slots();
+        while (n > 0 && slot_offset(n - 1) == 0) n--;
+        write_at<uint16_t>(NUM_SLOTS_OFFSET, n);
+        return get_remaining_space() - remaining_space;
     }
 
     Page::ID Page::get_next_free_list_page() const {
         ensure_type_is(Type::FREE_LIST);
-        return _free_list.next;
+        return read_at<ID>(NEXT_OFFSET);
     }
 
     void Page::set_next_free_list_page(ID next) {
         ensure_type_is(Type::FREE_LIST);
-        _free_list.next = next;
+        write_at<ID>(NEXT_OFFSET, next);
     }
 
     size_t Page::get_num_free_list_entries() const {
         ensure_type_is(Type::FREE_LIST);
-        return _free_list.entries->size();
+        return num_slots();
     }
 
-    const std::vector<Page::FreeListEntry>* Page::get_free_list_entries() const {
+    Page::FreeListEntry Page::get_free_list_entry(size_t i) const {
         ensure_type_is(Type::FREE_LIST);
-        return _free_list.entries;
-    }
+        if (i >= num_slots()) throw std::out_of_range("free list entry does not exist");
 
-    const Page::FreeListEntry& Page::get_free_list_entry(size_t i) const {
-        ensure_type_is(Type::FREE_LIST);
-        return _free_list.entries->at(i);
+        const char* e = entry(i);
+        ID data_id;
+        uint16_t free_space;
+        std::memcpy(&data_id, e, sizeof(data_id));
+        std::memcpy(&free_space, e + sizeof(data_id), sizeof(free_space));
+        return FreeListEntry(data_id, free_space);
     }
 
-    bool Page::reserve_free_list_entry(const Buffer& data, ID& data_id) {
+    bool Page::reserve_free_list_entry(const Buffer& data, ID& data_id, bool overflows) {
         ensure_type_is(Type::FREE_LIST);
-        uint16_t space_req = data_entry_space_req(data);
-        size_t n = _free_list.entries->size();
+        uint16_t space_req = data_entry_space_req(data, overflows);
+        size_t n = num_slots();
         for (size_t i = 0; i < n; i++) {
-            FreeListEntry& entry = _free_list.entries->at(i);
-            uint16_t free_space = entry.free_space();
+            char* e = entry(i);
+            uint16_t free_space;
+            std::memcpy(&free_space, e + sizeof(ID), sizeof(free_space));
             if (free_space >= space_req) {
-                entry.set_free_space(free_space - space_req);
-                data_id = _free_list.entries->at(i).data_id();
+                free_space -= space_req;
+                std::memcpy(e + sizeof(ID), &free_space, sizeof(free_space));
+                std::memcpy(&data_id, e, sizeof(data_id));
                 return true;
             }
         }
@@ -329,248 +357,435 @@ namespace diamond {
         uint16_t space = free_list_entry_space_req();
         ensure_space_available(space);
 
-        size_t i = _free_list.entries->size();
-        _free_list.entries->emplace_back(data_id, free_space);
-        _size += space;
+        size_t i = num_slots();
+        char* e = insert_entry(i, space - SLOT_SIZE);
+        std::memcpy(e, &data_id, sizeof(data_id));
+        std::memcpy(e + sizeof(data_id), &free_space, sizeof(free_space));
         return i;
     }
 
+    void Page::set_free_list_entry_free_space(size_t i, uint16_t free_space) {
+        ensure_type_is(Type::FREE_LIST);
+        if (i >= num_slots()) throw std::out_of_range("free list entry does not exist");
+
+        std::memcpy(entry(i) + sizeof(ID), &free_space, sizeof(free_space));
+    }
+
     bool Page::can_insert_free_list_entry() {
         ensure_type_is(Type::FREE_LIST);
         return get_remaining_space() >= free_list_entry_space_req();
     }
 
+    // Adds space freed in the data page to its entry, returns false if it has none.
+    bool Page::release_free_list_space(ID data_id, uint16_t space) {
+        ensure_type_is(Type::FREE_LIST);
+        size_t n = num_slots();
+        for (size_t i = 0; i < n; i++) {
+            char* e = entry(i);
+            ID id;
+            std::memcpy(&id, e, sizeof(id));
+            if (id == data_id) {
+                uint16_t free_space;
+                std::memcpy(&free_space, e + sizeof(ID), sizeof(free_space));
+                free_space = std::min<uint16_t>(free_space + space, SIZE);
+                std::memcpy(e + sizeof(ID), &free_space, sizeof(free_space));
+                return true;
+            }
+        }
+        return false;
+    }
+
     size_t Page::get_num_internal_node_entries() const {
         ensure_type_is(Type::INTERNAL_NODE);
-        return _internal_node_entries->size();
+        return num_slots();
     }
 
-    const Page::InternalNodeEntryList* Page::get_internal_node_entries() const {
+    Page::InternalNodeEntry Page::get_internal_node_entry(size_t i) const {
         ensure_type_is(Type::INTERNAL_NODE);
-        return _internal_node_entries;
+        if (i >= num_slots()) throw std::out_of_range("internal node entry does not exist");
+
+        const char* e = entry(i);
+        ID next_node_id;
+        std::memcpy(&next_node_id, e + key_field_size(e), sizeof(next_node_id));
+        return InternalNodeEntry(read_key(e), next_node_id);
     }
 
-    Page::InternalNodeEntryListIterator Page::internal_node_entries_begin() const {
+    Page::KeyView Page::get_internal_node_entry_key(size_t i) const {
         ensure_type_is(Type::INTERNAL_NODE);
-        return _internal_node_entries->begin();
+        if (i >= num_slots()) throw std::out_of_range("internal node entry does not exist");
+        return read_key_view(entry(i));
     }
 
-    Page::InternalNodeEntryListIterator Page::internal_node_entries_end() const {
+    void Page::insert_internal_node_entry(size_t pos, const Key& key, ID next_node_id) {
         ensure_type_is(Type::INTERNAL_NODE);
-        return _internal_node_entries->end();
+        if (pos > num_slots()) throw std::out_of_range("invalid entry position");
+        uint16_t space = internal_node_entry_space_req(key_space_req(key));
+        ensure_space_available(space);
+
+        char* e = write_key(insert_entry(pos, space - SLOT_SIZE), key);
+        std::memcpy(e, &next_node_id, sizeof(next_node_id));
     }
 
-    void Page::insert_internal_node_entry(
-            InternalNodeEntryListIterator pos,
-            ID key_data_id,
-            size_t key_data_index,
-            ID next_node_id) {
+    void Page::set_internal_node_entry_next_node(size_t i, ID next_node_id) {
         ensure_type_is(Type::INTERNAL_NODE);
-        uint16_t space = internal_node_entry_space_req();
-        ensure_space_available(space);
+        if (i >= num_slots()) throw std::out_of_range("internal node entry does not exist");
 
-        _internal_node_entries->emplace(
-            pos,
-            key_data_id,
-            key_data_index,
-            next_node_id);
-        _size += space;
+        char* e = entry(i);
+        std::memcpy(e + key_field_size(e), &next_node_id, sizeof(next_node_id));
     }
 
+    void Page::erase_internal_node_entry(size_t i) {
+        ensure_type_is(Type::INTERNAL_NODE);
+        if (i >= num_slots()) throw std::out_of_range("internal node entry does not exist");
+        erase_entry(i);
+    }
+
+    void Page::set_internal_node_entry_key(size_t i, const Key& key) {
+        if (!can_set_internal_node_entry_key(i, key)) throw std::logic_error("not enough space in page");
+
+        ID next_node_id = get_internal_node_entry(i).next_node_id();
+        erase_entry(i);
+        insert_internal_node_entry(i, key, next_node_id);
+    }
+
+    bool Page::can_set_internal_node_entry_key(size_t i, const Key& key) const {
+        ensure_type_is(Type::INTERNAL_NODE);
+        if (i >= num_slots()) throw std::out_of_range("internal node entry does not exist");
+        return get_remaining_space() + get_entry_space(i) >= internal_node_entry_space_req(key_space_req(key));
+    }
+
+    // NOTE: Separators are copied from child entries, so they are never larger than MAX_INLINE_KEY_SIZE.
     bool Page::can_insert_internal_node_entry() const {
         ensure_type_is(Type::INTERNAL_NODE);
-        return get_remaining_space() >= internal_node_entry_space_req();
+        return get_remaining_space() >= internal_node_entry_space_req(key_space_req(MAX_INLINE_KEY_SIZE));
+    }
+
+    bool Page::can_insert_internal_node_entry(const Key& key) const {
+        ensure_type_is(Type::INTERNAL_NODE);
+        return get_remaining_space() >= internal_node_entry_space_req(key_space_req(key));
+    }
+
+    void Page::split_internal_node_entries(Page* other) {
+        ensure_type_is(Type::INTERNAL_NODE);
+        other->ensure_type_is(Type::INTERNAL_NODE);
+        split_entries(other);
     }
 
     Page::ID Page::get_next_leaf_node_page() const {
         ensure_type_is(Type::LEAF_NODE);
-        return _leaf.next;
+        return read_at<ID>(NEXT_OFFSET);
     }
 
-    size_t Page::get_num_leaf_node_entries() const {
+    void Page::set_next_leaf_node_page(ID next) {
+        ensure_type_is(Type::LEAF_NODE);
+        write_at<ID>(NEXT_OFFSET, next);
+    }
+
+    Page::ID Page::get_prev_leaf_node_page() const {
         ensure_type_is(Type::LEAF_NODE);
-        return _leaf.entries->size();
+        return read_at<ID>(PREV_OFFSET);
     }
 
-    const Page::LeafNodeEntryList* Page::get_leaf_node_entries() const {
+    void Page::set_prev_leaf_node_page(ID prev) {
         ensure_type_is(Type::LEAF_NODE);
-        return _leaf.entries;
+        write_at<ID>(PREV_OFFSET, prev);
     }
 
-    Page::LeafNodeEntryListIterator Page::leaf_node_entries_begin() const {
+    size_t Page::get_num_leaf_node_entries() const {
+        ensure_type_is(Type::LEAF_NODE);
+        return num_slots();
+    }
+
+    Page::LeafNodeEntry Page::get_leaf_node_entry(size_t i) const {
         ensure_type_is(Type::LEAF_NODE);
-        return _leaf.entries->begin();
+        if (i >= num_slots()) throw std::out_of_range("leaf node entry does not exist");
+
+        const char* e = entry(i);
+        const char* val = e + key_field_size(e);
+        ID val_data_id;
+        uint16_t val_data_index;
+        std::memcpy(&val_data_id, val, sizeof(val_data_id));
+        std::memcpy(&val_data_index, val + sizeof(val_data_id), sizeof(val_data_index));
+        return LeafNodeEntry(read_key(e), val_data_id, val_data_index);
     }
 
-    Page::LeafNodeEntryListIterator Page::leaf_node_entries_end() const {
+    Page::KeyView Page::get_leaf_node_entry_key(size_t i) const {
         ensure_type_is(Type::LEAF_NODE);
-        return _leaf.entries->end();
+        if (i >= num_slots()) throw std::out_of_range("leaf node entry does not exist");
+        return read_key_view(entry(i));
     }
 
     void Page::insert_leaf_node_entry(
-            LeafNodeEntryListIterator pos,
-            ID key_data_id,
-            size_t key_data_index,
+            size_t pos,
+            const Key& key,
             ID val_data_id,
             size_t val_data_index) {
         ensure_type_is(Type::LEAF_NODE);
-        uint16_t space = leaf_node_entry_space_req();
+        if (pos > num_slots()) throw std::out_of_range("invalid entry position");
+        uint16_t space = leaf_node_entry_space_req(key_space_req(key));
         ensure_space_available(space);
 
-        _leaf.entries->emplace(
-            pos,
-            key_data_id,
-            key_data_index,
-            val_data_id,
-            val_data_index);
-        _size += space;
+        uint16_t val_index = val_data_index;
+        char* e = write_key(insert_entry(pos, space - SLOT_SIZE), key);
+        std::memcpy(e, &val_data_id, sizeof(val_data_id));
+        std::memcpy(e + sizeof(val_data_id), &val_index, sizeof(val_index));
     }
 
-    bool Page::can_insert_leaf_node_entry() const {
+    void Page::set_leaf_node_entry_val_data_ptr(size_t i, ID val_data_id, size_t val_data_index) {
         ensure_type_is(Type::LEAF_NODE);
-        return get_remaining_space() >= leaf_node_entry_space_req();
+        if (i >= num_slots()) throw std::out_of_range("leaf node entry does not exist");
+
+        uint16_t val_index = val_data_index;
+        char* e = entry(i);
+        e += key_field_size(e);
+        std::memcpy(e, &val_data_id, sizeof(val_data_id));
+        std::memcpy(e + sizeof(val_data_id), &val_index, sizeof(val_index));
+    }
+
+    void Page::erase_leaf_node_entry(size_t i) {
+        ensure_type_is(Type::LEAF_NODE);
+        if (i >= num_slots()) throw std::out_of_range("leaf node entry does not exist");
+        erase_entry(i);
+    }
+
+    bool Page::can_insert_leaf_node_entry(const Buffer& key) const {
+        ensure_type_is(Type::LEAF_NODE);
+        return get_remaining_space() >= leaf_node_entry_space_req(key_space_req(key.size()));
+    }
+
+    bool Page::can_insert_leaf_node_entry(const Key& key) const {
+        ensure_type_is(Type::LEAF_NODE);
+        return get_remaining_space() >= leaf_node_entry_space_req(key_space_req(key));
     }
 
     void Page::split_leaf_node_entries(Page* other) {
         ensure_type_is(Type::LEAF_NODE);
         other->ensure_type_is(Type::LEAF_NODE);
+        split_entries(other);
 
-        if (_leaf.entries->size() == 0) return;
-
-        size_t i = 0;
-        size_t n = _leaf.entries->size() / 2;
-        other->ensure_space_available(n * leaf_node_entry_space_req());
-        while (i < n) {
-            const LeafNodeEntry& entry = _leaf.entries->front();
-            other->_leaf.entries->push_back(entry);
-            _leaf.entries->pop_front();
-            i++;
-        }
+        // NOTE: The previous link of the page after other has to be set by the caller.
+        other->write_at<ID>(NEXT_OFFSET, read_at<ID>(NEXT_OFFSET));
+        other->write_at<ID>(PREV_OFFSET, _id);
+        write_at<ID>(NEXT_OFFSET, other->_id);
     }
 
     void Page::write_to_storage(Storage& storage) const {
-        Buffer buffer(SIZE);
-        write_to_buffer(buffer);
-        buffer.write_to_storage(storage, file_pos());
+        storage.write(_data, SIZE, file_pos());
     }
 
     void Page::write_to_buffer(Buffer& buffer) const {
-        if (buffer.size() < _size) throw std::logic_error("buffer is too small to fit entire page data.");
-        BufferWriter buffer_writer(buffer);
+        if (buffer.size() < SIZE) throw std::logic_error("buffer is too small to fit entire page data.");
+        std::memcpy(buffer.buffer(), _data, SIZE);
+    }
 
-        buffer_writer.write<Type>(_type);
-        switch (_type) {
+    Page::Page(ID id)
+            : _id(id),
+            _data(new (std::align_val_t(ALIGNMENT)) char[SIZE]),
+            _usage_count(0),
+            _version(0) {}
+
+    void Page::init(Type type) {
+        std::memset(_data, 0, HEADER_SIZE);
+        write_at<uint8_t>(TYPE_OFFSET, static_cast<uint8_t>(type));
+        write_at<uint8_t>(VERSION_OFFSET, FORMAT_VERSION);
+        write_at<uint16_t>(HEAP_OFFSET_OFFSET, SIZE);
+    }
+
+    uint16_t Page::entry_size(const char* e) const {
+        switch (get_type()) {
         case Type::COLLECTIONS: {
-            buffer_writer.write<ID>(_collections.next);
-            size_t num_elements = _collections.map->size();
-            buffer_writer.write<size_t>(num_elements);
-            CollectionsIterator iter;
-            for (iter = _collections.map->begin();
-                    iter != _collections.map->end();
-                    iter++) {
-                const std::pair<Buffer, Collection>& pair = *iter;
-
-                buffer_writer.write<size_t>(pair.first.size());
-                buffer_writer.write(pair.first);
-
-                buffer_writer.write<ID>(pair.second.root_node_id());
-                buffer_writer.write<ID>(pair.second.free_list_id());
-            }
-            break;
+            uint16_t name_size;
+            std::memcpy(&name_size, e, sizeof(name_size));
+            return sizeof(name_size) + name_size + sizeof(ID) + sizeof(ID) + sizeof(uint64_t);
         }
         case Type::DATA: {
-            size_t num_entries = _data_entries->size();
-            buffer_writer.write<size_t>(num_entries);
-            for (size_t i = 0; i < num_entries; i++) {
-                const DataEntry& entry = _data_entries->at(i);
-
-                buffer_writer.write<size_t>(entry.data_size());
-                buffer_writer.write(entry.data());
-
-                if (entry.overflows()) {
-                    buffer_writer.write<ID>(entry.overflow_id());
-                    buffer_writer.write<size_t>(entry.overflow_index());
-                }
+            uint16_t size;
+            std::memcpy(&size, e, sizeof(size));
+            if (size & OVERFLOW_FLAG) {
+                return sizeof(size) + (size & ~OVERFLOW_FLAG) + sizeof(ID) + sizeof(uint16_t);
             }
-            break;
+            return sizeof(size) + size;
         }
-        case Type::FREE_LIST: {
-            buffer_writer.write<ID>(_free_list.next);
-            size_t num_entries = _free_list.entries->size();
-            buffer_writer.write<size_t>(num_entries);
-            for (size_t i = 0; i < num_entries; i++) {
-                const FreeListEntry& entry = _free_list.entries->at(i);
-
-                buffer_writer.write<ID>(entry.data_id());
-                buffer_writer.write<uint16_t>(entry.free_space());
-            }
-            break;
+        case Type::FREE_LIST:
+            return free_list_entry_space_req() - SLOT_SIZE;
+        case Type::INTERNAL_NODE:
+            return internal_node_entry_space_req(key_field_size(e)) - SLOT_SIZE;
+        case Type::LEAF_NODE:
+            return leaf_node_entry_space_req(key_field_size(e)) - SLOT_SIZE;
         }
-        case Type::INTERNAL_NODE: {
-            size_t num_entries = _internal_node_entries->size();
-            buffer_writer.write<size_t>(num_entries);
-            InternalNodeEntryListIterator iter;
-            for (iter = _internal_node_entries->begin();
-                    iter != _internal_node_entries->end();
-                    iter++) {
-                const InternalNodeEntry& entry = *iter;
-
-                buffer_writer.write<ID>(entry.key_data_id());
-                buffer_writer.write<size_t>(entry.key_data_index());
-                buffer_writer.write<ID>(entry.next_node_id());
-            }
-            break;
+        throw std::logic_error("invalid type");
+    }
+
+    // Takes size bytes from the heap, leaving room for n slots.
+    uint16_t Page::allocate_entry(uint16_t size, size_t n) {
+        if (heap_offset() < HEADER_SIZE + n * SLOT_SIZE + size) compact();
+
+        uint16_t offset = heap_offset() - size;
+        write_at<uint16_t>(HEAP_OFFSET_OFFSET, offset);
+        return offset;
+    }
+
+    char* Page::insert_entry(size_t pos, uint16_t size) {
+        uint16_t n = num_slots();
+        uint16_t offset = allocate_entry(size, n + 1);
+
+        char* slot = _data + HEADER_SIZE + pos * SLOT_SIZE;
+        std::memmove(slot + SLOT_SIZE, slot, (n - pos) * SLOT_SIZE);
+        std::memcpy(slot, &offset, sizeof(offset));
+        write_at<uint16_t>(NUM_SLOTS_OFFSET, n + 1);
+
+        return _data + offset;
+    }
+
+    char* Page::insert_data_entry_slot(uint16_t size, size_t& i) {
+        size_t n = num_slots();
+        for (i = 0; i < n && slot_offset(i) != 0; i++);
+        if (i == n) return insert_entry(i, size);
+
+        uint16_t offset = allocate_entry(size, n);
+        write_at<uint16_t>(HEADER_SIZE + i * SLOT_SIZE, offset);
+        return _data + offset;
+    }
+
+    void Page::erase_entry(size_t i) {
+        uint16_t n = num_slots();
+        uint16_t size = entry_size(entry(i));
+        char* slot = _data + HEADER_SIZE + i * SLOT_SIZE;
+        std::memmove(slot, slot + SLOT_SIZE, (n - i - 1) * SLOT_SIZE);
+        write_at<uint16_t>(NUM_SLOTS_OFFSET, n - 1);
+        write_at<uint16_t>(FRAGMENTED_OFFSET, read_at<uint16_t>(FRAGMENTED_OFFSET) + size);
+        _version++;
+    }
+
+    void Page::truncate_entries(size_t n) {
+        uint16_t fragmented = read_at<uint16_t>(FRAGMENTED_OFFSET);
+        for (size_t i = n; i < num_slots(); i++) {
+            fragmented += entry_size(entry(i));
+        }
+        write_at<uint16_t>(FRAGMENTED_OFFSET, fragmented);
+        write_at<uint16_t>(NUM_SLOTS_OFFSET, n);
+    }
+
+    /*
+        Moves the upper half of the entries, by size, to other, which must be empty.
+        Both pages keep at least one entry.
+    */
+    void Page::split_entries(Page* other) {
+        size_t total = num_slots();
+        if (total < 2) return;
+        if (other->num_slots() != 0) {
+            throw std::logic_error("can only split entries into an empty page");
         }
-        case Type::LEAF_NODE: {
-            buffer_writer.write<ID>(_leaf.next);
-            size_t num_entries = _leaf.entries->size();
-            buffer_writer.write<size_t>(num_entries);
-            LeafNodeEntryListIterator iter;
-            for (iter = _leaf.entries->begin();
-                    iter != _leaf.entries->end();
-                    iter++) {
-                const LeafNodeEntry& entry = *iter;
-
-                buffer_writer.write<ID>(entry.key_data_id());
-                buffer_writer.write<size_t>(entry.key_data_index());
-                buffer_writer.write<ID>(entry.val_data_id());
-                buffer_writer.write<size_t>(entry.val_data_index());
+
+        uint16_t half = get_size() / 2;
+        uint16_t size = HEADER_SIZE;
+        size_t n = 0;
+        while (n < total - 1 && size < half) {
+            size += SLOT_SIZE + entry_size(entry(n++));
+        }
+        if (n == 0) n = 1;
+
+        for (size_t i = n; i < total; i++) {
+            const char* e = entry(i);
+            uint16_t e_size = entry_size(e);
+            std::memcpy(other->insert_entry(other->num_slots(), e_size), e, e_size);
+        }
+        truncate_entries(n);
+        _version++;
+        other->_version++;
+    }
+
+    // Returns the entry of the collection called name, or nullptr if there is none
+    const char* Page::find_collection(const Buffer& name) const {
+        size_t n = num_slots();
+        for (size_t i = 0; i < n; i++) {
+            const char* e = entry(i);
+            uint16_t name_size;
+            std::memcpy(&name_size, e, sizeof(name_size));
+            if (name_size == name.size() &&
+                    std::memcmp(e + sizeof(name_size), name.buffer(), name_size) == 0) {
+                return e;
             }
-            break;
         }
+        return nullptr;
+    }
+
+    /* Static */
+    Page::Key Page::read_key(const char* e) {
+        KeyView key = read_key_view(e);
+        if (!key.inlined()) return Key(key.data_id(), key.data_index());
+        return Key(Buffer(key.data().data(), key.data().size()));
+    }
+
+    /* Static */
+    Page::KeyView Page::read_key_view(const char* e) {
+        uint16_t key_size;
+        std::memcpy(&key_size, e, sizeof(key_size));
+        e += sizeof(key_size);
+
+        if (key_size & EXTERNAL_KEY_FLAG) {
+            ID key_data_id;
+            uint16_t key_data_index;
+            std::memcpy(&key_data_id, e, sizeof(key_data_id));
+            std::memcpy(&key_data_index, e + sizeof(key_data_id), sizeof(key_data_index));
+            return KeyView(key_data_id, key_data_index);
+        }
+        return KeyView(std::string_view(e, key_size));
+    }
+
+    /* Static */
+    uint16_t Page::key_field_size(const char* e) {
+        uint16_t key_size;
+        std::memcpy(&key_size, e, sizeof(key_size));
+        if (key_size & EXTERNAL_KEY_FLAG) {
+            return sizeof(key_size) + sizeof(ID) + sizeof(uint16_t);
         }
+        return sizeof(key_size) + key_size;
     }
 
-    Page::Page(ID id, Type type)
-            : _id(id),
-            _type(type),
-            _size(header_size()),
-            _usage_count(0) {
-        switch (type) {
-        case Type::COLLECTIONS:
-            _collections.next = 0;
-            _collections.map = new Collections();
-            break;
-        case Type::DATA:
-            _data_entries = new std::vector<DataEntry>();
-            break;
-        case Type::FREE_LIST:
-            _free_list.next = 0;
-            _free_list.entries = new std::vector<FreeListEntry>();
-            break;
-        case Type::INTERNAL_NODE:
-            _internal_node_entries = new InternalNodeEntryList();
-            break;
-        case Type::LEAF_NODE:
-            _leaf.next = 0;
-            _leaf.entries = new LeafNodeEntryList();
-            break;
+    /* Static */
+    char* Page::write_key(char* e, const Key& key) {
+        if (!key.inlined()) {
+            uint16_t flag = EXTERNAL_KEY_FLAG;
+            ID key_data_id = key.data_id();
+            uint16_t key_data_index = key.data_index();
+            std::memcpy(e, &flag, sizeof(flag));
+            e += sizeof(flag);
+            std::memcpy(e, &key_data_id, sizeof(key_data_id));
+            e += sizeof(key_data_id);
+            std::memcpy(e, &key_data_index, sizeof(key_data_index));
+            return e + sizeof(key_data_index);
         }
+
+        uint16_t key_size = key.data().size();
+        std::memcpy(e, &key_size, sizeof(key_size));
+        e += sizeof(key_size);
+        std::memcpy(e, key.data().buffer(), key_size);
+        return e + key_size;
     }
 
-    Page::Collection::Collection(ID root_node_id, ID free_list_id)
+    void Page::compact() {
+        std::unique_ptr<char[]> copy(new char[SIZE]);
+        std::memcpy(copy.get(), _data, SIZE);
+
+        uint16_t offset = SIZE;
+        size_t n = num_slots();
+        for (size_t i = 0; i < n; i++) {
+            if (slot_offset(i) == 0) continue;
+            const char* e = copy.get() + slot_offset(i);
+            uint16_t size = entry_size(e);
+            offset -= size;
+            std::memcpy(_data + offset, e, size);
+            write_at<uint16_t>(HEADER_SIZE + i * SLOT_SIZE, offset);
+        }
+        write_at<uint16_t>(HEAP_OFFSET_OFFSET, offset);
+        write_at<uint16_t>(FRAGMENTED_OFFSET, 0);
+    }
+
+    Page::Collection::Collection(ID root_node_id, ID free_list_id, uint64_t num_records)
         : _root_node_id(root_node_id),
-        _free_list_id(free_list_id) {}
+        _free_list_id(free_list_id),
+        _num_records(num_records) {}
 
     Page::ID Page::Collection::root_node_id() const {
         return _root_node_id;
@@ -580,19 +795,22 @@ namespace diamond {
         return _free_list_id;
     }
 
-    Page::DataEntry::DataEntry(Buffer data, ID overflow_id, size_t overflow_index)
-        : _data(std::move(data)),
-        _overflow_id(overflow_id),
-        _overflow_index(overflow_index) {
-        if (_data.size() >= SIZE) throw std::invalid_argument("data is too large");
+    uint64_t Page::Collection::num_records() const {
+        return _num_records;
     }
 
+    Page::DataEntry::DataEntry(const char* data, size_t data_size, ID overflow_id, size_t overflow_index)
+        : _data(data),
+        _data_size(data_size),
+        _overflow_id(overflow_id),
+        _overflow_index(overflow_index) {}
+
     size_t Page::DataEntry::data_size() const {
-        return _data.size();
+        return _data_size;
     }
 
-    const Buffer& Page::DataEntry::data() const {
-        return _data;
+    Buffer Page::DataEntry::data() const {
+        return Buffer(_data, _data_size);
     }
 
     bool Page::DataEntry::overflows() const {
@@ -619,52 +837,85 @@ namespace diamond {
         return _free_space;
     }
 
-    void Page::FreeListEntry::set_free_space(uint16_t free_space) {
-        _free_space = free_space;
+    Page::Key::Key(Buffer data)
+        : _data(std::move(data)),
+        _data_id(INVALID_ID),
+        _data_index(0) {
+        if (_data.size() > MAX_INLINE_KEY_SIZE) throw std::invalid_argument("key is too large to inline");
     }
 
-    Page::InternalNodeEntry::InternalNodeEntry(ID key_data_id, size_t key_data_index, ID next_node_id)
-        : _key_data_id(key_data_id),
-        _key_data_index(key_data_index),
-        _next_node_id(next_node_id) {}
+    Page::Key::Key(ID data_id, size_t data_index)
+        : _data_id(data_id),
+        _data_index(data_index) {}
+
+    bool Page::Key::inlined() const {
+        return _data_id == INVALID_ID;
+    }
 
-    Page::ID Page::InternalNodeEntry::key_data_id() const {
-        return _key_data_id;
+    const Buffer& Page::Key::data() const {
+        return _data;
+    }
+
+    Page::ID Page::Key::data_id() const {
+        return _data_id;
     }
 
-    size_t Page::InternalNodeEntry::key_data_index() const {
-        return _key_data_index;
+    size_t Page::Key::data_index() const {
+        return _data_index;
+    }
+
+    Page::KeyView::KeyView(std::string_view data)
+        : _data(data),
+        _data_id(INVALID_ID),
+        _data_index(0) {}
+
+    Page::KeyView::KeyView(ID data_id, size_t data_index)
+        : _data_id(data_id),
+        _data_index(data_index) {}
+
+    bool Page::KeyView::inlined() const {
+        return _data_id == INVALID_ID;
+    }
+
+    std::string_view Page::KeyView::data() const {
+        return _data;
+    }
+
+    Page::ID Page::KeyView::data_id() const {
+        return _data_id;
+    }
+
+    size_t Page::KeyView::data_index() const {
+        return _data_index;
+    }
+
+    Page::InternalNodeEntry::InternalNodeEntry(Key key, ID next_node_id)
+        : _key(std::move(key)),
+        _next_node_id(next_node_id) {}
+
+    const Page::Key& Page::InternalNodeEntry::key() const {
+        return _key;
     }
 
     Page::ID Page::InternalNodeEntry::next_node_id() const {
         return _next_node_id;
     }
 
-    Page::LeafNodeEntry::LeafNodeEntry(ID key_data_id, size_t key_data_index, ID val_data_id, size_t val_data_index)
-        : _key_data_id(key_data_id),
-        _key_data_index(key_data_index),
+    Page::LeafNodeEntry::LeafNodeEntry(Key key, ID val_data_id, size_t val_data_index)
+        : _key(std::move(key)),
         _val_data_id(val_data_id),
         _val_data_index(val_data_index) {}
 
-    Page::ID Page::LeafNodeEntry::key_data_id() const {
-        return _key_data_id;
-    }
-
-    size_t Page::LeafNodeEntry::key_data_index() const {
-        return _key_data_index;
+    const Page::Key& Page::LeafNodeEntry::key() const {
+        return _key;
     }
 
     Page::ID Page::LeafNodeEntry::val_data_id() const {
         return _val_data_id;
     }
 
-    Page::ID Page::LeafNodeEntry::val_data_index() const {
+    size_t Page::LeafNodeEntry::val_data_index() const {
         return _val_data_index;
     }
 
-    void Page::LeafNodeEntry::set_val_data_ptr(ID val_data_id, size_t val_data_index) {
-        _val_data_id = val_data_id;
-        _val_data_index = val_data_index;
-    }
-
 } // namespace diamond
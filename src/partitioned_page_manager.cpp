@@ -52,6 +52,19 @@ namespace diamond {
         get_partition(page->get_id())->write_page(page);
     }
 
+    void PartitionedPageManager::flush() {
+        for (std::unique_ptr<Partition>& partition : _partitions) {
+            partition->flush();
+        }
+    }
+
+    bool PartitionedPageManager::writes_synchronously() const {
+        for (const std::unique_ptr<Partition>& partition : _partitions) {
+            if (!partition->writes_synchronously()) return false;
+        }
+        return true;
+    }
+
     bool PartitionedPageManager::is_page_managed(Page::ID id) const {
         return get_partition(id)->is_page_managed(id);
     }
@@ -109,6 +122,14 @@ namespace diamond {
         _page_writer->write(page);
     }
 
+    void PartitionedPageManager::Partition::flush() {
+        _page_writer->flush();
+    }
+
+    bool PartitionedPageManager::Partition::writes_synchronously() const {
+        return _page_writer->is_synchronous();
+    }
+
     bool PartitionedPageManager::Partition::is_page_managed(Page::ID id) const {
         boost::lock_guard<boost::mutex> lock(_mutex);
         return _pages.find(id) != _pages.end();
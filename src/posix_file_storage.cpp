@@ -0,0 +1,175 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <system_error>
+
+#include "diamond/posix_file_storage.h"
+
+namespace diamond {
+
+    PosixFileStorage::PosixFileStorage(const std::string& file_name, bool direct)
+            : _direct(direct) {
+        int flags = O_RDWR | O_CREAT;
+        if (direct) flags |= O_DIRECT;
+        if ((_fd = open(file_name.c_str(), flags, 0644)) == -1) {
+            throw std::system_error(errno, std::generic_category(), file_name);
+        }
+        struct stat st;
+        if (fstat(_fd, &st) == -1) {
+            int error = errno;
+            close(_fd);
+            throw std::system_error(error, std::generic_category(), file_name);
+        }
+        _size = st.st_size;
+    }
+
+    PosixFileStorage::~PosixFileStorage() {
+        close(_fd);
+    }
+
+    int PosixFileStorage::fd() const {
+        return _fd;
+    }
+
+    void PosixFileStorage::write_at(const char* buffer, size_t n, uint64_t offset) {
+        if (!_direct) {
+            pwrite_all(buffer, n, offset);
+            return;
+        }
+
+        uint64_t start = offset / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        uint64_t end = (offset + n + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        if (is_aligned(buffer, n, offset)) {
+            auto locks = lock_blocks(start, end);
+            pwrite_all(buffer, n, offset);
+            return;
+        }
+
+        AlignedBuffer copy = allocate_aligned(end - start);
+        auto locks = lock_blocks(start, end);
+        if (start == offset && end == offset + n) {
+            std::memcpy(copy.get(), buffer, n);
+            pwrite_all(copy.get(), n, offset);
+            return;
+        }
+
+        // The rest of the first and last blocks have to be written back as they are
+        pread_all(copy.get(), end - start, start);
+        std::memcpy(copy.get() + (offset - start), buffer, n);
+        pwrite_all(copy.get(), end - start, start);
+    }
+
+    void PosixFileStorage::read_at(char* buffer, size_t n, uint64_t offset) {
+        if (!_direct || is_aligned(buffer, n, offset)) {
+            pread_all(buffer, n, offset);
+            return;
+        }
+
+        uint64_t start = offset / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        uint64_t end = (offset + n + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+        AlignedBuffer copy = allocate_aligned(end - start);
+        pread_all(copy.get(), end - start, start);
+        std::memcpy(buffer, copy.get() + (offset - start), n);
+    }
+
+    /* Static */
+    PosixFileStorage::AlignedBuffer PosixFileStorage::allocate_aligned(size_t n) {
+        AlignedBuffer buffer(static_cast<char*>(std::aligned_alloc(DIRECT_ALIGNMENT, n)), &std::free);
+        if (!buffer) throw std::bad_alloc();
+        return buffer;
+    }
+
+    bool PosixFileStorage::is_aligned(const char* buffer, size_t n, uint64_t offset) const {
+        return reinterpret_cast<uintptr_t>(buffer) % DIRECT_ALIGNMENT == 0
+            && n % DIRECT_ALIGNMENT == 0
+            && offset % DIRECT_ALIGNMENT == 0;
+    }
+
+    // The mutexes are locked in order of their index, so writes locking several can't deadlock
+    std::vector<boost::unique_lock<boost::mutex>> PosixFileStorage::lock_blocks(uint64_t start, uint64_t end) {
+        uint64_t first = start / DIRECT_ALIGNMENT;
+        uint64_t num_blocks = std::min<uint64_t>((end - start) / DIRECT_ALIGNMENT, NUM_BLOCK_MUTEXES);
+        std::vector<boost::unique_lock<boost::mutex>> locks;
+        locks.reserve(num_blocks);
+        for (size_t i = 0; i < NUM_BLOCK_MUTEXES; i++) {
+            if ((i + NUM_BLOCK_MUTEXES - first % NUM_BLOCK_MUTEXES) % NUM_BLOCK_MUTEXES < num_blocks) {
+                locks.emplace_back(_block_mutexes[i]);
+            }
+        }
+        return locks;
+    }
+
+    void PosixFileStorage::pwrite_all(const char* buffer, size_t n, uint64_t offset) {
+        uint64_t end = offset + n;
+        while (n > 0) {
+            ssize_t written = pwrite(_fd, buffer, n, offset);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category());
+            }
+            buffer += written;
+            n -= written;
+            offset += written;
+        }
+        uint64_t size = _size;
+        while (size < end && !_size.compare_exchange_weak(size, end)) {}
+    }
+
+    void PosixFileStorage::pread_all(char* buffer, size_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t num_read = pread(_fd, buffer, n, offset);
+            if (num_read == -1) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category());
+            }
+            // NOTE: A direct read stops short at the end of the file, even partway through a block.
+            if (num_read == 0 || (_direct && num_read % DIRECT_ALIGNMENT != 0)) {
+                std::memset(buffer + num_read, 0, n - num_read);
+                return;
+            }
+            buffer += num_read;
+            n -= num_read;
+            offset += num_read;
+        }
+    }
+
+    uint64_t PosixFileStorage::size_impl() {
+        return _size;
+    }
+
+    void PosixFileStorage::sync_impl() {
+        if (fdatasync(_fd) == -1) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    void PosixFileStorage::truncate_impl(uint64_t size) {
+        if (ftruncate(_fd, size) == -1) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        _size = size;
+    }
+
+} // namespace diamond
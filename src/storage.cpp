@@ -15,26 +15,69 @@
 **  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <stdexcept>
+
 #include "diamond/storage.h"
 
 namespace diamond {
 
     void Storage::write(const char* buffer, size_t n, uint64_t offset) {
+        write_at(buffer, n, offset);
+    }
+
+    void Storage::write(const std::vector<Write>& writes) {
+        write_batch_at(writes);
+    }
+
+    void Storage::read(char* buffer, size_t n, uint64_t offset) {
+        read_at(buffer, n, offset);
+    }
+
+    uint64_t Storage::size() {
+        return size_impl();
+    }
+
+    void Storage::sync() {
+        sync_impl();
+    }
+
+    void Storage::truncate(uint64_t size) {
+        boost::lock_guard<boost::mutex> lock(_mutex);
+        truncate_impl(size);
+    }
+
+    void Storage::write_at(const char* buffer, size_t n, uint64_t offset) {
         boost::lock_guard<boost::mutex> lock(_mutex);
         seek_impl(offset);
         write_impl(buffer, n);
     }
 
-    void Storage::read(char* buffer, size_t n, uint64_t offset) {
+    void Storage::read_at(char* buffer, size_t n, uint64_t offset) {
         boost::lock_guard<boost::mutex> lock(_mutex);
         seek_impl(offset);
         read_impl(buffer, n);
     }
 
-    size_t Storage::size() {
-        boost::lock_guard<boost::mutex> lock(_mutex);
-        return size_impl();
+    void Storage::write_batch_at(const std::vector<Write>& writes) {
+        for (const Write& write : writes) {
+            write_at(write.buffer, write.n, write.offset);
+        }
     }
 
+    void Storage::write_impl(const char*, size_t) {
+        throw std::logic_error("storage has no position to write at");
+    }
+
+    void Storage::read_impl(char*, size_t) {
+        throw std::logic_error("storage has no position to read at");
+    }
+
+    void Storage::seek_impl(size_t) {
+        throw std::logic_error("storage has no position to seek");
+    }
+
+    void Storage::truncate_impl(uint64_t) {
+        throw std::logic_error("storage can't be truncated");
+    }
 
 } // namespace diamond
@@ -15,135 +15,716 @@
 **  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
 #include "diamond/storage_engine.h"
 
 namespace diamond {
 
+    const double StorageEngine::DEFAULT_FILL_FACTOR = 0.9;
+
     /* Static */
-    int StorageEngine::default_compare(const Buffer& b0, const Buffer& b1) {
+    int StorageEngine::default_compare(std::string_view b0, std::string_view b1) {
         size_t b0_n = b0.size();
         size_t b1_n = b1.size();
         size_t n = (b0_n <= b1_n) ? b0_n : b1_n;
-        int r = std::memcmp(b0.buffer(), b1.buffer(), n);
+        int r = std::memcmp(b0.data(), b1.data(), n);
         if (r != 0 || b0_n == b1_n) {
             return r;
         }
         return (b0_n < b1_n) ? -1 : 1;
     }
 
-    StorageEngine::StorageEngine(PageManager& page_manager)
-            : _manager(page_manager) {
+    bool StorageEngine::KeyLess::operator()(const Buffer& b0, const Buffer& b1) const {
+        return compare_func(b0, b1) < 0;
+    }
+
+    StorageEngine::StorageEngine(PageManager& page_manager, ValueLog* value_log, WriteAheadLog* wal)
+            : _manager(page_manager),
+            _value_log(value_log),
+            _wal(wal),
+            _sequence(0),
+            _num_snapshots(0) {
+        if (_wal != nullptr && !_manager.writes_synchronously()) {
+            // A page held back by the writer could miss the batch of the operation that changed it
+            throw std::invalid_argument("pages have to be written synchronously to a write-ahead log");
+        }
+        if (_wal != nullptr && _value_log != nullptr) {
+            // Leaves pointing into the value log mustn't be committed before the values are durable
+            _wal->before_commit([value_log]() {
+                value_log->sync();
+            });
+        }
+        if (_wal != nullptr) {
+            _store_collections_callback = _wal->before_cut([this]() {
+                store_collections();
+            });
+        }
+
+        WriteAheadLog::Operation wal_operation(_wal);
         if (_manager.storage().size() == 0) {
             _manager.create_page(Page::Type::COLLECTIONS);
         }
     }
 
-    uint64_t StorageEngine::count(const Buffer& collection_name) {
-        Collection collection = get_or_create_collection(collection_name);
-        Page::ID page_id = collection.root_node_id;
-        uint64_t count = 0;
-        while (page_id) {
-            PageAccessor page = _manager.get_page(page_id);
-            SharedPageLock page_lock(page);
-            switch (page->get_type()) {
-            case Page::Type::INTERNAL_NODE:
-                page_id = (*++page->internal_node_entries_begin()).next_node_id();
-                break;
-            case Page::Type::LEAF_NODE:
-                count += page->get_num_leaf_node_entries();
-                page_id = page->get_next_leaf_node_page();
-                break;
-            default:
-                throw Exception(ErrorCode::CORRUPTED_FILE);
-            }
-        }
+    StorageEngine::~StorageEngine() {
+        if (_wal != nullptr) _wal->remove_before_cut(_store_collections_callback);
+        WriteAheadLog::Operation wal_operation(_wal);
+        store_collections();
+    }
+
+    StorageEngine::CollectionHandle StorageEngine::get_collection(const Buffer& collection_name) {
+        return CollectionHandle(&get_or_create_collection(collection_name));
+    }
 
-        return count;
+    uint64_t StorageEngine::count(const Buffer& collection_name) {
+        return count(get_collection(collection_name));
     }
 
     bool StorageEngine::exists(const Buffer& collection_name, const Buffer& key, Compare compare_func) {
-        Collection collection = get_or_create_collection(collection_name);
-        PageAccessor page = get_leaf_page(
+        return exists(get_collection(collection_name), key, compare_func);
+    }
+
+    Buffer StorageEngine::get(const Buffer& collection_name, const Buffer& key, Compare compare_func) {
+        return get(get_collection(collection_name), key, compare_func);
+    }
+
+    std::vector<std::optional<Buffer>> StorageEngine::multi_get(
+            const Buffer& collection_name,
+            const std::vector<Buffer>& keys,
+            Compare compare_func) {
+        return multi_get(get_collection(collection_name), keys, compare_func);
+    }
+
+    StorageEngine::ValueReader StorageEngine::get_reader(
+            const Buffer& collection_name,
+            const Buffer& key,
+            Compare compare_func) {
+        return get_reader(get_collection(collection_name), key, compare_func);
+    }
+
+    void StorageEngine::put(const Buffer& collection_name, Buffer key, Buffer val, Compare compare_func) {
+        put(get_collection(collection_name), std::move(key), std::move(val), compare_func);
+    }
+
+    bool StorageEngine::erase(const Buffer& collection_name, const Buffer& key, Compare compare_func) {
+        return erase(get_collection(collection_name), key, compare_func);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(const Buffer& collection_name) {
+        return get_iterator(get_collection(collection_name));
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(
+            const Buffer& collection_name,
+            const Buffer& start_key,
+            Compare compare_func) {
+        return get_iterator(get_collection(collection_name), start_key, compare_func);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(
+            const Buffer& collection_name,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            Compare compare_func) {
+        return get_iterator(get_collection(collection_name), start_key, end_key, compare_func);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(const Buffer& collection_name, const Snapshot& snapshot) {
+        return get_iterator(get_collection(collection_name), snapshot);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(
+            const Buffer& collection_name,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            const Snapshot& snapshot,
+            Compare compare_func) {
+        return get_iterator(get_collection(collection_name), start_key, end_key, snapshot, compare_func);
+    }
+
+    /*
+        Changes are numbered as they're made under the leaf's lock, the snapshot sees
+        the ones numbered up to the last one made. It's counted before the number is
+        read, so a change numbered after it always sees it's held and saves a version.
+    */
+    StorageEngine::Snapshot StorageEngine::get_snapshot() {
+        boost::unique_lock<boost::shared_mutex> snapshot_lock(_snapshot_mutex);
+        boost::lock_guard<boost::mutex> lock(_snapshots_mutex);
+        _num_snapshots++;
+        uint64_t sequence = _sequence;
+        _snapshots.insert(sequence);
+        return Snapshot(*this, sequence);
+    }
+
+    // The number of records is counted in the cached collection, put and erase update it along with the leaf
+    uint64_t StorageEngine::count(const CollectionHandle& handle) {
+        return *handle._collection->num_records;
+    }
+
+    bool StorageEngine::exists(const CollectionHandle& handle, const Buffer& key, Compare compare_func) {
+        const Collection& collection = *handle._collection;
+        std::unique_ptr<LockedPage<SharedPageLock>> leaf = get_leaf_page<SharedPageLock>(
             collection.root_node_id,
             key,
             compare_func);
-        SharedPageLock page_lock(page);
-        Page::LeafNodeEntryListIterator iter = find_leaf_node_entry(page, key, compare_func);
-        return iter != page->leaf_node_entries_end();
+        bool found;
+        search_leaf_node_entries(leaf->page, key, compare_func, found);
+        return found;
     }
 
-    Buffer StorageEngine::get(const Buffer& collection_name, const Buffer& key, Compare compare_func) {
-        Collection collection = get_or_create_collection(collection_name);
-        PageAccessor page = get_leaf_page(
+    Buffer StorageEngine::get(const CollectionHandle& handle, const Buffer& key, Compare compare_func) {
+        const Collection& collection = *handle._collection;
+        std::unique_ptr<LockedPage<SharedPageLock>> leaf = get_leaf_page<SharedPageLock>(
             collection.root_node_id,
             key,
             compare_func);
-        SharedPageLock page_lock(page);
-        Page::LeafNodeEntryListIterator iter = find_leaf_node_entry(page, key, compare_func);
-        if (iter == page->leaf_node_entries_end()) {
+        bool found;
+        size_t index = search_leaf_node_entries(
+            leaf->page,
+            key,
+            compare_func,
+            found);
+        if (!found) {
             throw Exception(ErrorCode::ENTRY_NOT_FOUND);
         }
-        const Page::LeafNodeEntry& entry = *iter;
-        PageAccessor data_page = _manager.get_page(entry.val_data_id());
-        SharedPageLock data_page_lock(data_page);
-        return Buffer(data_page->get_data_entry(entry.val_data_index()).data());      
+        Page::LeafNodeEntry entry = leaf->page->get_leaf_node_entry(index);
+        return get_data(entry.val_data_id(), entry.val_data_index());
     }
 
-    void StorageEngine::put(const Buffer& collection_name, Buffer key, Buffer val, Compare compare_func) {
-        Collection collection = get_or_create_collection(collection_name);
+    /*
+        Looks up several keys at once and returns their values in the order of keys,
+        with no value for keys that aren't found. The keys are looked up in sorted
+        order, so all the keys falling in one leaf share its descent and lock, and
+        their values are read grouped by DATA page.
+    */
+    std::vector<std::optional<Buffer>> StorageEngine::multi_get(
+            const CollectionHandle& handle,
+            const std::vector<Buffer>& keys,
+            Compare compare_func) {
+        std::vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&keys, &compare_func](size_t i0, size_t i1) {
+            return compare_func(keys[i0], keys[i1]) < 0;
+        });
+
+        const Collection& collection = *handle._collection;
+        std::vector<std::optional<Buffer>> vals(keys.size());
+        size_t i = 0;
+        while (i < order.size()) {
+            std::optional<Buffer> bound;
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf = get_leaf_page<SharedPageLock>(
+                collection.root_node_id,
+                select_child_with_bound(collection.root_node_id, keys[order[i]], compare_func, bound));
+
+            // Value of each key found in the leaf, as data id, data index and position in keys
+            std::vector<std::tuple<Page::ID, size_t, size_t>> val_ptrs;
+            size_t first = i;
+            while (i < order.size()) {
+                const Buffer& key = keys[order[i]];
+                if (i > first && bound && compare_func(*bound, key) < 0) break;
+                bool found;
+                size_t index = search_leaf_node_entries(leaf->page, key, compare_func, found);
+                if (found) {
+                    Page::LeafNodeEntry entry = leaf->page->get_leaf_node_entry(index);
+                    if (entry.val_data_index() == ValueLog::POINTER_INDEX) {
+                        vals[order[i]] = get_data(entry.val_data_id(), entry.val_data_index());
+                    } else {
+                        val_ptrs.emplace_back(entry.val_data_id(), entry.val_data_index(), order[i]);
+                    }
+                }
+                i++;
+            }
+
+            // The leaf stays locked so the values can't be erased while they're read
+            read_values(val_ptrs, vals);
+        }
+
+        return vals;
+    }
+
+    StorageEngine::ValueReader StorageEngine::get_reader(
+            const CollectionHandle& handle,
+            const Buffer& key,
+            Compare compare_func) {
+        const Collection& collection = *handle._collection;
+        std::unique_ptr<LockedPage<SharedPageLock>> leaf = get_leaf_page<SharedPageLock>(
+            collection.root_node_id,
+            key,
+            compare_func);
+        bool found;
+        size_t index = search_leaf_node_entries(
+            leaf->page,
+            key,
+            compare_func,
+            found);
+        if (!found) {
+            throw Exception(ErrorCode::ENTRY_NOT_FOUND);
+        }
+        Page::LeafNodeEntry entry = leaf->page->get_leaf_node_entry(index);
+        return get_value_reader(entry.val_data_id(), entry.val_data_index(), std::move(leaf));
+    }
+
+    void StorageEngine::put(const CollectionHandle& handle, Buffer key, Buffer val, Compare compare_func) {
+        WriteAheadLog::Operation wal_operation(_wal);
+        const Collection& collection = *handle._collection;
         {
-            // Make optimisitic descent
-            PageAccessor page = get_leaf_page(collection.root_node_id, key, compare_func);
-            UniquePageLock page_lock(page);
-            Page::LeafNodeEntryListIterator iter = find_leaf_node_entry(page, key, compare_func);
-            if (iter != page->leaf_node_entries_end()) {
+            // Make optimisitic descent, only the leaf page is exclusively locked
+            std::unique_ptr<LockedPage<UniquePageLock>> leaf = get_leaf_page<UniquePageLock>(
+                collection.root_node_id,
+                key,
+                compare_func);
+            bool found;
+            size_t index = search_leaf_node_entries(
+                leaf->page,
+                key,
+                compare_func,
+                found);
+            if (found) {
                 // CASE 1: Entry with key exists, update the value
-                auto [val_data_id, val_data_index] = insert_value_into_data_page(
-                    collection.free_list_id, std::move(val));
-                (*iter).set_val_data_ptr(val_data_id, val_data_index);
-                _manager.write_page(page.instance());
+                update_leaf_node_entry(collection, leaf->page, index, key, val, compare_func);
+                _manager.write_page(leaf->page.instance());
                 return;
-            } else if (page->can_insert_leaf_node_entry()) {
+            } else if (leaf->page->can_insert_leaf_node_entry(key)) {
                 // CASE 2: Leaf Page is safe, insert
-                auto [key_data_id, key_data_index] = insert_value_into_data_page(
-                    collection.free_list_id, std::move(key));
-                auto [val_data_id, val_data_index] = insert_value_into_data_page(
-                    collection.free_list_id, std::move(val));
-                page->insert_leaf_node_entry(
-                    iter,
-                    key_data_id,
-                    key_data_index,
-                    val_data_id,
-                    val_data_index);
-                _manager.write_page(page.instance());
+                insert_leaf_node_entry(collection, leaf->page, index, key, val, compare_func);
+                _manager.write_page(leaf->page.instance());
+                add_num_records(collection, 1);
                 return;
             }
         }
 
-        // TODO: Make descent using Update Locks, unlocking only when we know
-        // a node is safe
-    }
-
-    StorageEngine::Iterator StorageEngine::get_iterator(const Buffer& collection_name) {
-        Collection collection = get_or_create_collection(collection_name);
+        /*
+            CASE 3: Leaf Page is full, descend again using update locks, which don't
+            block readers. The ancestors of a page are unlocked as soon as we know the
+            page is safe, that is it can take another entry without being split.
+        */
+        Path path;
         Page::ID page_id = collection.root_node_id;
         while (true) {
-            PageAccessor page = _manager.get_page(page_id);
-            switch (page->get_type()) {
-            case Page::Type::INTERNAL_NODE: {
-                SharedPageLock page_lock(page);
-                page_id = (*++page->internal_node_entries_begin()).next_node_id();
-                break;
-            }
-            case Page::Type::LEAF_NODE:
-                return Iterator(_manager, std::move(page));
-            default:
+            PathNode& node = path.emplace_back(_manager.get_page(page_id));
+            Page::Type type = node.page->get_type();
+            if (type != Page::Type::LEAF_NODE && type != Page::Type::INTERNAL_NODE) {
                 throw Exception(ErrorCode::CORRUPTED_FILE);
             }
+            if (can_insert_entry(node.page, key)) {
+                path.erase(path.begin(), std::prev(path.end()));
+            }
+            if (type == Page::Type::LEAF_NODE) break;
+            node.index = search_internal_node_entries(node.page, key, compare_func);
+            page_id = node.page->get_internal_node_entry(node.index).next_node_id();
+        }
+
+        bool found;
+        size_t index = search_leaf_node_entries(
+            path.back().page,
+            key,
+            compare_func,
+            found);
+        if (found || can_insert_entry(path.back().page, key)) {
+            // Another thread inserted the key or made room while the leaf was unlocked
+            path.erase(path.begin(), std::prev(path.end()));
+            path.back().lock.upgrade();
+            if (found) {
+                update_leaf_node_entry(collection, path.back().page, index, key, val, compare_func);
+            } else {
+                insert_leaf_node_entry(collection, path.back().page, index, key, val, compare_func);
+                add_num_records(collection, 1);
+            }
+            _manager.write_page(path.back().page.instance());
+            return;
+        }
+
+        /*
+            Every page below the topmost one we still hold has to be split, the topmost
+            one is either safe or the root. Upgrading the locks in place could deadlock
+            with readers coupling their way down, so only the topmost page is upgraded
+            and the pages below it are locked exclusively again. No other writer can
+            change the structure below it in the meantime, since they'd need its
+            update lock.
+        */
+        path.erase(std::next(path.begin()), path.end());
+        path.front().lock.upgrade();
+        Path::iterator node = path.begin();
+        while (node->page->get_type() == Page::Type::INTERNAL_NODE) {
+            node->index = search_internal_node_entries(node->page, key, compare_func);
+            node = path.emplace(
+                path.end(),
+                _manager.get_page(node->page->get_internal_node_entry(node->index).next_node_id()));
+            node->lock.upgrade();
+        }
+
+        index = search_leaf_node_entries(path.back().page, key, compare_func, found);
+        if (found) {
+            update_leaf_node_entry(collection, path.back().page, index, key, val, compare_func);
+            _manager.write_page(path.back().page.instance());
+            return;
+        }
+
+        if (!can_insert_entry(path.back().page, key)) {
+            split_path(collection, path, key, compare_func);
+            index = search_leaf_node_entries(path.back().page, key, compare_func, found);
+        }
+        insert_leaf_node_entry(collection, path.back().page, index, key, val, compare_func);
+        _manager.write_page(path.back().page.instance());
+        add_num_records(collection, 1);
+    }
+
+    bool StorageEngine::erase(const CollectionHandle& handle, const Buffer& key, Compare compare_func) {
+        WriteAheadLog::Operation wal_operation(_wal);
+        const Collection& collection = *handle._collection;
+        std::optional<ErasedEntry> erased;
+        {
+            // Make optimisitic descent, only the leaf page is exclusively locked
+            std::unique_ptr<LockedPage<UniquePageLock>> leaf = get_leaf_page<UniquePageLock>(
+                collection.root_node_id,
+                key,
+                compare_func);
+            bool found;
+            size_t index = search_leaf_node_entries(
+                leaf->page,
+                key,
+                compare_func,
+                found);
+            if (!found) return false;
+            if (can_erase_entry(leaf->page, index, leaf->page->get_id() == collection.root_node_id)) {
+                // CASE 1: Leaf Page won't be underfull, erase
+                Page::LeafNodeEntry entry = leaf->page->get_leaf_node_entry(index);
+                bool val_kept = save_version(collection, key, &entry, compare_func);
+                erased.emplace(ErasedEntry{entry, val_kept});
+                leaf->page->erase_leaf_node_entry(index);
+                _manager.write_page(leaf->page.instance());
+                add_num_records(collection, -1);
+            }
+        }
+
+        // CASE 2: Leaf Page would be underfull, it has to be rebalanced with a sibling
+        if (!erased) erased = erase_and_rebalance(collection, key, compare_func);
+        if (!erased) return false;
+
+        // The entry is unreachable now, its key and value, unless a version kept it, can be given back to the free list
+        free_leaf_node_entry(collection, *erased);
+        return true;
+    }
+
+    /*
+        Applies the operations of a batch in the order of their keys. The leaf holding
+        a key stays locked for the keys after it that fall in its range, so a leaf is
+        locked and written once for all of them. Operations that would split a leaf or
+        leave it underfull release it and go through put or erase instead. A batch
+        set to sync is durable once it returns.
+    */
+    void StorageEngine::write(const WriteBatch& batch, Compare compare_func) {
+        apply_write_batch(batch, compare_func);
+        if (batch.sync()) sync();
+    }
+
+    void StorageEngine::apply_write_batch(const WriteBatch& batch, Compare compare_func) {
+        // The whole batch is committed and seen by snapshots at once
+        WriteAheadLog::Operation wal_operation(_wal);
+        boost::shared_lock<boost::shared_mutex> snapshot_lock(_snapshot_mutex);
+        std::vector<const WriteBatch::Operation*> operations;
+        operations.reserve(batch.size());
+        for (const WriteBatch::Operation& operation : batch.operations()) {
+            operations.push_back(&operation);
+        }
+        // Stable, so operations on the same key keep their order
+        std::stable_sort(
+            operations.begin(),
+            operations.end(),
+            [&compare_func](const WriteBatch::Operation* o0, const WriteBatch::Operation* o1) {
+                int r = default_compare(o0->collection_name(), o1->collection_name());
+                if (r != 0) return r < 0;
+                return compare_func(o0->key(), o1->key()) < 0;
+            });
+
+        size_t i = 0;
+        while (i < operations.size()) {
+            const Buffer& collection_name = operations[i]->collection_name();
+            const Collection& collection = get_or_create_collection(collection_name);
+            size_t end = i;
+            while (end < operations.size() && operations[end]->collection_name() == collection_name) {
+                end++;
+            }
+
+            while (i < end) {
+                std::vector<ErasedEntry> erased;
+                bool applied = true;
+                {
+                    // Upper bound of the leaf's keys, there is none for the last leaf
+                    std::optional<Buffer> bound;
+                    const Buffer& key = operations[i]->key();
+                    std::unique_ptr<LockedPage<UniquePageLock>> leaf = get_leaf_page<UniquePageLock>(
+                        collection.root_node_id,
+                        select_child_with_bound(collection.root_node_id, key, compare_func, bound));
+
+                    size_t first = i;
+                    size_t num_entries = leaf->page->get_num_leaf_node_entries();
+                    while (i < end) {
+                        if (i > first && bound && compare_func(*bound, operations[i]->key()) < 0) break;
+                        applied = apply_to_leaf(collection, leaf->page, *operations[i], compare_func, erased);
+                        if (!applied) break;
+                        i++;
+                    }
+                    if (i > first) {
+                        _manager.write_page(leaf->page.instance());
+                        add_num_records(
+                            collection,
+                            static_cast<int64_t>(leaf->page->get_num_leaf_node_entries()) - num_entries);
+                    }
+                }
+
+                for (const ErasedEntry& entry : erased) {
+                    free_leaf_node_entry(collection, entry);
+                }
+
+                if (!applied) {
+                    // The leaf has to be split or rebalanced
+                    const WriteBatch::Operation& operation = *operations[i++];
+                    if (operation.is_erase()) {
+                        erase(CollectionHandle(&collection), operation.key(), compare_func);
+                    } else {
+                        put(CollectionHandle(&collection), operation.key(), operation.val(), compare_func);
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+        Builds the tree of an empty collection bottom up from keys in ascending order.
+        Leaves are filled up to fill_factor of a page one after the other, with values
+        appended to DATA pages the same way, then each level of internal nodes is built
+        from the last keys of the level below. None of the pages can be reached until
+        the root takes over the top node, so they're built without any lock or WAL
+        operation, and freed again if the load fails. Only taking over the top node is
+        an operation, the root is locked for it alone.
+    */
+    void StorageEngine::bulk_load(
+            const Buffer& collection_name,
+            const BulkLoadSource& source,
+            double fill_factor,
+            Compare compare_func) {
+        if (fill_factor <= 0 || fill_factor > 1) {
+            throw std::invalid_argument("fill factor must be greater than 0 and at most 1");
+        }
+        const uint16_t target_size = static_cast<uint16_t>(fill_factor * Page::SIZE);
+
+        const Collection* collection;
+        {
+            WriteAheadLog::Operation wal_operation(_wal);
+            collection = &get_or_create_collection(collection_name);
+        }
+        if (!is_empty_collection(*collection)) {
+            throw std::logic_error("bulk load requires an empty collection");
+        }
+
+        // Values appended to the value log aren't in the tree yet, garbage collection must not drop them
+        boost::shared_lock<boost::shared_mutex> value_log_gc_lock(_value_log_gc_mutex);
+        BulkLoad load;
+        Page::ID top_id;
+        try {
+            top_id = build_bulk_load_tree(*collection, load, source, target_size, compare_func);
+        } catch (...) {
+            abort_bulk_load(*collection, load);
+            throw;
+        }
+        if (top_id == Page::INVALID_ID) return;
+
+        {
+            WriteAheadLog::Operation wal_operation(_wal);
+            boost::shared_lock<boost::shared_mutex> snapshot_lock(_snapshot_mutex);
+            PageAccessor root = _manager.get_page(collection->root_node_id);
+            UniquePageLock root_lock(root);
+            if (root->get_type() != Page::Type::LEAF_NODE || root->get_num_leaf_node_entries() != 0) {
+                abort_bulk_load(*collection, load);
+                throw std::logic_error("bulk load requires an empty collection");
+            }
+
+            // A snapshot taken before the load must not see the loaded keys
+            if (_num_snapshots > 0) {
+                for (Page::ID leaf_id = load.first_leaf_id; leaf_id != Page::INVALID_ID;) {
+                    PageAccessor leaf = _manager.get_page(leaf_id);
+                    for (size_t i = 0; i < leaf->get_num_leaf_node_entries(); i++) {
+                        Page::LeafNodeEntry entry = leaf->get_leaf_node_entry(i);
+                        const Page::Key& key = entry.key();
+                        save_version(
+                            *collection,
+                            key.inlined() ? key.data() : get_data(key.data_id(), key.data_index()),
+                            nullptr,
+                            compare_func);
+                    }
+                    leaf_id = leaf->get_next_leaf_node_page();
+                }
+            }
+
+            // The root keeps its id, it takes over the entries of the top node
+            PageAccessor top = _manager.get_page(top_id);
+            root->reset(top->get_type());
+            top->move_entries(root.instance());
+            _manager.write_page(root.instance());
+            add_num_records(*collection, load.num_records);
+            free_node_page(*collection, top);
+        }
+
+        for (const auto& [data_id, free_space] : load.data_pages) {
+            collection->free_space_map->add(data_id, free_space);
+        }
+    }
+
+    bool StorageEngine::is_empty_collection(const Collection& collection) {
+        PageAccessor root = _manager.get_page(collection.root_node_id);
+        SharedPageLock root_lock(root);
+        return root->get_type() == Page::Type::LEAF_NODE && root->get_num_leaf_node_entries() == 0;
+    }
+
+    // Builds the levels of a bulk loaded tree, returns the id of its top node or none if there was nothing to load
+    Page::ID StorageEngine::build_bulk_load_tree(
+            const Collection& collection,
+            BulkLoad& load,
+            const BulkLoadSource& source,
+            uint16_t target_size,
+            Compare compare_func) {
+        // Last key and page id of each node in the level being built
+        std::vector<std::tuple<Page::Key, Page::ID>> nodes;
+
+        std::optional<Buffer> prev_key;
+        Buffer key;
+        Buffer val;
+        while (source(key, val)) {
+            if (prev_key && compare_func(*prev_key, key) >= 0) {
+                throw std::invalid_argument("bulk load keys must be unique and in ascending order");
+            }
+
+            Page::Key page_key = Page::can_inline_key(key)
+                ? Page::Key(key)
+                : std::make_from_tuple<Page::Key>(append_value(load, key));
+            // Values going to the value log are appended to it right away, it's append-only already
+            auto [val_data_id, val_data_index] = _value_log && val.size() >= _value_log->min_value_size()
+                ? insert_leaf_value(collection, key, val)
+                : append_value(load, val);
+
+            std::optional<PageAccessor>& leaf = load.leaf;
+            if (leaf && ((*leaf)->get_size() >= target_size || !(*leaf)->can_insert_leaf_node_entry(page_key))) {
+                PageAccessor next_leaf = create_bulk_load_page(load, Page::Type::LEAF_NODE);
+                (*leaf)->set_next_leaf_node_page(next_leaf->get_id());
+                next_leaf->set_prev_leaf_node_page((*leaf)->get_id());
+                _manager.write_page(leaf->instance());
+                leaf.emplace(std::move(next_leaf));
+            } else if (!leaf) {
+                leaf.emplace(create_bulk_load_page(load, Page::Type::LEAF_NODE));
+                load.first_leaf_id = (*leaf)->get_id();
+            }
+
+            size_t n = (*leaf)->get_num_leaf_node_entries();
+            if (n == 0) {
+                nodes.emplace_back(page_key, (*leaf)->get_id());
+            } else {
+                std::get<0>(nodes.back()) = page_key;
+            }
+            (*leaf)->insert_leaf_node_entry(n, page_key, val_data_id, val_data_index);
+            load.num_records++;
+            prev_key = std::move(key);
+        }
+
+        if (!load.leaf) return Page::INVALID_ID;
+        _manager.write_page(load.leaf->instance());
+        load.leaf.reset();
+
+        while (nodes.size() > 1) {
+            std::vector<std::tuple<Page::Key, Page::ID>> parents;
+            std::optional<PageAccessor> node;
+            for (const auto& [child_key, child_id] : nodes) {
+                // Internal nodes keep their own copies of the keys, in the load's DATA pages
+                Page::Key node_key = child_key.inlined()
+                    ? child_key
+                    : std::make_from_tuple<Page::Key>(
+                        append_value(load, get_data(child_key.data_id(), child_key.data_index())));
+                if (node && ((*node)->get_size() >= target_size || !(*node)->can_insert_internal_node_entry(node_key))) {
+                    _manager.write_page(node->instance());
+                    node.reset();
+                }
+                if (!node) {
+                    node.emplace(create_bulk_load_page(load, Page::Type::INTERNAL_NODE));
+                    parents.emplace_back(child_key, (*node)->get_id());
+                }
+                (*node)->insert_internal_node_entry((*node)->get_num_internal_node_entries(), node_key, child_id);
+                std::get<0>(parents.back()) = child_key;
+            }
+            _manager.write_page(node->instance());
+            nodes = std::move(parents);
+        }
+
+        close_data_page(load);
+        return std::get<1>(nodes.front());
+    }
+
+    // Frees the pages of a failed bulk load, and the values it appended to the value log
+    void StorageEngine::abort_bulk_load(const Collection& collection, BulkLoad& load) {
+        for (Page::ID page_id : load.page_ids) {
+            PageAccessor page = _manager.get_page(page_id);
+            if (page->get_type() == Page::Type::LEAF_NODE) {
+                for (size_t i = 0; i < page->get_num_leaf_node_entries(); i++) {
+                    Page::LeafNodeEntry entry = page->get_leaf_node_entry(i);
+                    if (entry.val_data_index() == ValueLog::POINTER_INDEX) {
+                        free_value(*collection.free_space_map, entry.val_data_id(), entry.val_data_index());
+                    }
+                }
+            }
+            page->reset(Page::Type::DATA);
+            _manager.write_page(page.instance());
+            collection.free_space_map->add(page_id, page->get_remaining_space());
         }
+        load.leaf.reset();
+        load.data_page.reset();
+        load.page_ids.clear();
+        load.data_pages.clear();
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(const CollectionHandle& handle) {
+        const Collection& collection = *handle._collection;
+        return Iterator(*this, collection.root_node_id, get_leaf_page<SharedPageLock>(
+            collection.root_node_id,
+            [](PageAccessor&) {
+                return 0;
+            }));
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            Compare compare_func) {
+        return seek(handle, start_key, std::nullopt, compare_func);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            Compare compare_func) {
+        return seek(handle, start_key, end_key, compare_func);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(const CollectionHandle& handle, const Snapshot& snapshot) {
+        return Iterator(*this, *handle._collection, snapshot, std::nullopt, std::nullopt, &default_compare);
+    }
+
+    StorageEngine::Iterator StorageEngine::get_iterator(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            const Buffer& end_key,
+            const Snapshot& snapshot,
+            Compare compare_func) {
+        return Iterator(*this, *handle._collection, snapshot, start_key, end_key, compare_func);
     }
 
     StorageEngine::Collection StorageEngine::create_collection(const Buffer& name) {
+        WriteAheadLog::Operation wal_operation(_wal);
         Page::ID page_id = 1;
         while (true) {
             PageAccessor page = _manager.get_page(page_id);
@@ -157,8 +738,11 @@ namespace diamond {
                 page_lock.downgrade();
                 const Page::Collection& collection = page->get_collection(name);
                 return Collection{
+                    .name = name,
+                    .collections_page_id = page_id,
                     .root_node_id = collection.root_node_id(),
-                    .free_list_id = collection.free_list_id()
+                    .free_list_id = collection.free_list_id(),
+                    .stored_num_records = collection.num_records()
                 };
             }
 
@@ -170,6 +754,8 @@ namespace diamond {
                 page->add_collection(name, root_page->get_id(), free_list_page->get_id());
                 _manager.write_page(page.instance());
                 return Collection{
+                    .name = name,
+                    .collections_page_id = page_id,
                     .root_node_id = root_page->get_id(),
                     .free_list_id = free_list_page->get_id()
                 };
@@ -189,18 +775,53 @@ namespace diamond {
             _manager.write_page(page.instance());
 
             return Collection{
+                .name = name,
+                .collections_page_id = new_collections_page->get_id(),
                 .root_node_id = root_page->get_id(),
                 .free_list_id = free_list_page->get_id()
             };
         }
     }
 
-    StorageEngine::Collection StorageEngine::get_or_create_collection(const Buffer& name) {
+    const StorageEngine::Collection& StorageEngine::get_or_create_collection(const Buffer& name) {
         bool created;
         return get_or_create_collection(name, created);
     }
 
-    StorageEngine::Collection StorageEngine::get_or_create_collection(const Buffer& name, bool& created) {
+    /*
+        A collection's entry never changes once it is created, its root keeps its id,
+        so collections are cached by name after their first lookup. That keeps the
+        COLLECTIONS pages, and their locks, out of every other request.
+    */
+    const StorageEngine::Collection& StorageEngine::get_or_create_collection(const Buffer& name, bool& created) {
+        {
+            boost::shared_lock<boost::shared_mutex> lock(_collections_mutex);
+            auto it = _collections.find(name);
+            if (it != _collections.end()) {
+                created = false;
+                return it->second;
+            }
+        }
+
+        // Only creating the collection starts an operation, so it can be looked up while an iterator is held
+        Collection collection = load_collection(name, created);
+        // The engine it was changed by didn't store it, the records are counted again
+        uint64_t num_records = collection.stored_num_records == UNKNOWN_NUM_RECORDS
+            ? recount_records(collection.root_node_id)
+            : collection.stored_num_records;
+        boost::unique_lock<boost::shared_mutex> lock(_collections_mutex);
+        // Another thread may have cached it in the meantime, with the same entry
+        auto [it, inserted] = _collections.try_emplace(name, std::move(collection));
+        if (inserted) {
+            it->second.free_space_map = std::make_unique<FreeSpaceMap>(_manager, it->second.free_list_id);
+            it->second.num_records = std::make_unique<std::atomic<uint64_t>>(num_records);
+            it->second.num_records_changed = std::make_unique<std::once_flag>();
+            it->second.versions = std::make_unique<VersionStore>();
+        }
+        return it->second;
+    }
+
+    StorageEngine::Collection StorageEngine::load_collection(const Buffer& name, bool& created) {
         Page::ID page_id = 1;
         while (page_id != Page::INVALID_ID) {
             // CASE 1: Iterate over the collections list with a shared lock to avoid contention.
@@ -210,8 +831,11 @@ namespace diamond {
                 const Page::Collection& collection = page->get_collection(name);
                 created = false;
                 return Collection{
+                    .name = name,
+                    .collections_page_id = page_id,
                     .root_node_id = collection.root_node_id(),
-                    .free_list_id = collection.free_list_id()
+                    .free_list_id = collection.free_list_id(),
+                    .stored_num_records = collection.num_records()
                 };
             }
 
@@ -226,141 +850,1281 @@ namespace diamond {
         return create_collection(name);
     }
 
-    // NOTE: This method must be called with a lock on page.
-    Page::InternalNodeEntryListIterator StorageEngine::search_internal_node_entries(
-            PageAccessor& page,
-            const Buffer& key,
-            Compare compare_func) {
-        Page::InternalNodeEntryListIterator prev = page->internal_node_entries_end();
-        Page::InternalNodeEntryListIterator iter = page->internal_node_entries_begin();
-        Page::InternalNodeEntryListIterator end = page->internal_node_entries_end();
-        while (iter != end) {
-            const Page::InternalNodeEntry& entry = *iter;
-            PageAccessor data_page = _manager.get_page(entry.key_data_id());
-            if (data_page->get_type() != Page::Type::DATA) {
+    // Counts the entries of the leaves from the first one, the collection isn't cached yet so nothing changes them
+    uint64_t StorageEngine::recount_records(Page::ID root_node_id) {
+        Page::ID page_id = root_node_id;
+        while (true) {
+            PageAccessor page = _manager.get_page(page_id);
+            SharedPageLock page_lock(page);
+            if (page->get_type() == Page::Type::LEAF_NODE) break;
+            if (page->get_type() != Page::Type::INTERNAL_NODE) {
                 throw Exception(ErrorCode::CORRUPTED_FILE);
             }
+            page_id = page->get_internal_node_entry(0).next_node_id();
+        }
 
-            SharedPageLock data_page_lock(data_page);
-            const Page::DataEntry data_entry = data_page->get_data_entry(entry.key_data_index());
-            if (compare_func(data_entry.data(), key) >= 0) {
-                return iter;
-            }
+        uint64_t num_records = 0;
+        while (page_id != Page::INVALID_ID) {
+            PageAccessor page = _manager.get_page(page_id);
+            SharedPageLock page_lock(page);
+            num_records += page->get_num_leaf_node_entries();
+            page_id = page->get_next_leaf_node_page();
+        }
+        return num_records;
+    }
+
+    /*
+        Adds n to the number of records of the cached collection. It is called while
+        the leaf that changed is still locked, so whether a put inserted or updated a
+        key is decided under the same lock as the change itself. The collection's
+        entry is only written by store_collections.
 
-            prev = iter++;
+        Without a WAL, nothing makes the entry agree with the leaves after a crash, so
+        the first change marks its number unknown until store_collections writes it.
+        The collection's records are then counted again if it's loaded before that.
+    */
+    void StorageEngine::add_num_records(const Collection& collection, int64_t n) {
+        if (n == 0) return;
+        if (_wal == nullptr) {
+            std::call_once(*collection.num_records_changed, [this, &collection]() {
+                store_num_records(collection, UNKNOWN_NUM_RECORDS);
+            });
         }
+        *collection.num_records += n;
+    }
 
-        return prev;
+    void StorageEngine::store_num_records(const Collection& collection, uint64_t num_records) {
+        PageAccessor page = _manager.get_page(collection.collections_page_id);
+        UniquePageLock page_lock(page);
+        page->set_collection_num_records(collection.name, num_records);
+        _manager.write_page(page.instance());
     }
 
-    // NOTE: This method must be called with a lock on page.
-    Page::LeafNodeEntryListIterator StorageEngine::find_leaf_node_entry(
-            PageAccessor& page,
-            const Buffer& key,
-            Compare compare_func) {
-        Page::LeafNodeEntryListIterator iter = page->leaf_node_entries_begin();
-        Page::LeafNodeEntryListIterator end = page->leaf_node_entries_end();
-        while (iter != end) {
-            const Page::LeafNodeEntry& entry = *iter;
-            PageAccessor data_page = _manager.get_page(entry.key_data_id());
-            if (data_page->get_type() != Page::Type::DATA) {
-                throw Exception(ErrorCode::CORRUPTED_FILE);
+    /*
+        Writes what the cached collections keep track of in memory, the free space of
+        their DATA pages and the numbers of records that changed, to their pages.
+        Given a WAL, it's called before each batch is cut, once the operations in
+        progress are done, so the batch holds the free space and number of records
+        its pages add up to. Otherwise they're only written on destruction.
+    */
+    void StorageEngine::store_collections() {
+        boost::shared_lock<boost::shared_mutex> lock(_collections_mutex);
+        for (auto& [name, collection] : _collections) {
+            collection.free_space_map->store();
+            uint64_t num_records = *collection.num_records;
+            if (_wal != nullptr) {
+                if (num_records == collection.stored_num_records) continue;
+            } else {
+                // Only called on destruction, the flag is still unused if the entry wasn't marked unknown
+                bool unchanged = false;
+                std::call_once(*collection.num_records_changed, [&unchanged]() { unchanged = true; });
+                if (unchanged) continue;
             }
 
-            SharedPageLock data_page_lock(data_page);
-            const Page::DataEntry data_entry = data_page->get_data_entry(entry.key_data_index());
-            if (compare_func(data_entry.data(), key) == 0) {
-                return iter;
-            }
+            store_num_records(collection, num_records);
+            collection.stored_num_records = num_records;
+        }
+    }
+
+    /*
+        Given a WAL, waits for the batch of the WAL holding the changes to be committed,
+        so writers calling it at about the same time share one sync of the log.
+        Otherwise the database file and the value log are synced.
+    */
+    void StorageEngine::sync() {
+        if (_wal != nullptr) {
+            _wal->wait_for_commit();
+            return;
+        }
+        if (_value_log != nullptr) _value_log->sync();
+        _manager.storage().sync();
+    }
+
+    /*
+        Drops the versions no snapshot left needs, those of changes it sees already.
+        The snapshots stay locked throughout, so one taken meanwhile can't lose the
+        versions of changes made after it. The values of the dropped versions are
+        freed once nothing is locked anymore.
+    */
+    void StorageEngine::release_snapshot(uint64_t sequence) {
+        std::vector<std::tuple<const Collection*, Page::ID, size_t>> dropped;
+        {
+            boost::lock_guard<boost::mutex> lock(_snapshots_mutex);
+            _snapshots.erase(_snapshots.find(sequence));
+            _num_snapshots--;
 
-            iter++;
+            boost::shared_lock<boost::shared_mutex> collections_lock(_collections_mutex);
+            for (auto& [_, collection] : _collections) {
+                VersionStore& store = *collection.versions;
+                boost::unique_lock<boost::shared_mutex> versions_lock(store.mutex);
+                if (!store.versions) continue;
+
+                // None is needed without a snapshot
+                std::optional<uint64_t> oldest;
+                if (!_snapshots.empty()) oldest = *_snapshots.begin();
+                Versions& versions = *store.versions;
+                for (auto it = versions.begin(); it != versions.end();) {
+                    std::vector<Version>& key_versions = it->second;
+                    auto first_needed = std::find_if(
+                        key_versions.begin(),
+                        key_versions.end(),
+                        [&oldest](const Version& version) {
+                            return oldest && version.sequence > *oldest;
+                        });
+                    for (auto version = key_versions.begin(); version != first_needed; version++) {
+                        if (!version->val) continue;
+                        auto [data_id, data_index] = *version->val;
+                        dropped.emplace_back(&collection, data_id, data_index);
+                    }
+                    key_versions.erase(key_versions.begin(), first_needed);
+                    it = key_versions.empty() ? versions.erase(it) : std::next(it);
+                }
+                if (versions.empty()) store.versions.reset();
+            }
         }
+        if (dropped.empty()) return;
 
-        return iter;
+        WriteAheadLog::Operation wal_operation(_wal);
+        for (const auto& [collection, data_id, data_index] : dropped) {
+            free_value(*collection->free_space_map, data_id, data_index);
+        }
     }
 
-    PageAccessor StorageEngine::get_leaf_page(
-            Page::ID root_node_id,
+    /*
+        Numbers a change to the leaf entry of key, given the entry it replaces if there
+        is one, and keeps where the value it had is if a snapshot is held. It is called
+        under the leaf's lock before the entry is changed, so an iterator copying the
+        leaf sees either the version or the entry as it was. The value isn't read here,
+        so the leaf isn't held up by it. Returns true if the version kept the value, the
+        caller must not free it then.
+    */
+    bool StorageEngine::save_version(
+            const Collection& collection,
             const Buffer& key,
+            const Page::LeafNodeEntry* entry,
             Compare compare_func) {
-        Page::ID page_id = root_node_id;
-        while (true) {
-            PageAccessor page = _manager.get_page(page_id);
-            Page::Type type = page->get_type();
-            switch (type) {
-            case Page::Type::INTERNAL_NODE: {
-                SharedPageLock page_lock(page);
-                page_id = (*search_internal_node_entries(page, key, compare_func)).next_node_id();
-                break;
+        uint64_t sequence = ++_sequence;
+        if (_num_snapshots == 0) return false;
+
+        std::optional<std::tuple<Page::ID, size_t>> val;
+        if (entry != nullptr) val.emplace(entry->val_data_id(), entry->val_data_index());
+        VersionStore& store = *collection.versions;
+        boost::unique_lock<boost::shared_mutex> lock(store.mutex);
+        if (!store.versions) store.versions.emplace(KeyLess{compare_func});
+        (*store.versions)[key].push_back(Version{sequence, val});
+        return val.has_value();
+    }
+
+    /*
+        Turns the entries copied from a leaf, in order, into the ones the snapshot
+        numbered sequence sees between lower and upper. A key changed after the
+        snapshot was taken gets the value its first such change replaced, or is left
+        out if that change inserted it. The values are read while garbage collection of
+        the value log is held off, so it can't move one in the meantime.
+    */
+    void StorageEngine::apply_versions(
+            const Collection& collection,
+            uint64_t sequence,
+            std::vector<std::tuple<Buffer, Buffer>>& entries,
+            const std::optional<Buffer>& lower,
+            bool lower_inclusive,
+            const std::optional<Buffer>& upper,
+            bool upper_inclusive,
+            Compare compare_func) {
+        boost::shared_lock<boost::shared_mutex> value_log_gc_lock(_value_log_gc_mutex);
+        std::vector<std::tuple<Buffer, std::optional<std::tuple<Page::ID, size_t>>>> changed;
+        {
+            VersionStore& store = *collection.versions;
+            boost::shared_lock<boost::shared_mutex> lock(store.mutex);
+            if (!store.versions) return;
+            const Versions& versions = *store.versions;
+            auto begin = !lower ? versions.begin() :
+                lower_inclusive ? versions.lower_bound(*lower) : versions.upper_bound(*lower);
+            auto end = !upper ? versions.end() :
+                upper_inclusive ? versions.upper_bound(*upper) : versions.lower_bound(*upper);
+            for (auto version_it = begin; version_it != end; version_it++) {
+                for (const Version& version : version_it->second) {
+                    if (version.sequence > sequence) {
+                        changed.emplace_back(version_it->first, version.val);
+                        break;
+                    }
+                }
             }
-            case Page::Type::LEAF_NODE:
-                return page;
-            default:
-                throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+        if (changed.empty()) return;
+
+        std::vector<std::tuple<Buffer, Buffer>> merged;
+        merged.reserve(entries.size() + changed.size());
+        auto entry = entries.begin();
+        for (auto& [key, val] : changed) {
+            while (entry != entries.end() && compare_func(std::get<0>(*entry), key) < 0) {
+                merged.push_back(std::move(*entry++));
             }
+            if (entry != entries.end() && compare_func(std::get<0>(*entry), key) == 0) entry++;
+            if (val) merged.emplace_back(std::move(key), get_data(std::get<0>(*val), std::get<1>(*val)));
         }
+        std::move(entry, entries.end(), std::back_inserter(merged));
+        entries = std::move(merged);
     }
 
-    std::tuple<Page::ID, size_t> StorageEngine::insert_value_into_data_page(
-            Page::ID free_list_id,
+    // Moves a value in the value log that only a version still has to a new record, called by garbage collection
+    void StorageEngine::move_version_value(
+            const Collection& collection,
+            const Buffer& key,
+            const ValueLog::Pointer& pointer,
             const Buffer& val) {
-        Page::ID data_page_id;
-        size_t data_page_index;
-        Page::ID page_id = free_list_id;
-        while (true) {
-            PageAccessor page = _manager.get_page(page_id);
-            if (page->get_type() != Page::Type::FREE_LIST) {
-                throw Exception(ErrorCode::CORRUPTED_FILE);
-            }
+        VersionStore& store = *collection.versions;
+        boost::unique_lock<boost::shared_mutex> lock(store.mutex);
+        if (!store.versions) return;
+        auto it = store.versions->find(key);
+        if (it == store.versions->end()) return;
+        for (Version& version : it->second) {
+            if (!version.val) continue;
+            auto [data_id, data_index] = *version.val;
+            if (data_index != ValueLog::POINTER_INDEX || data_id != pointer.to_data_id()) continue;
+            ValueLog::Pointer moved = _value_log->append(collection.name, key, val);
+            version.val.emplace(moved.to_data_id(), ValueLog::POINTER_INDEX);
+            return;
+        }
+    }
 
-            UniquePageLock page_lock(page);
-            // CASE 1: Free List has entry with sufficient data space
-            if (page->reserve_free_list_entry(val, data_page_id)) {
-                _manager.write_page(page.instance());
-                page_lock.unlock(); // We've already reserved the entry and queued up a write, we can unlock
-                PageAccessor data_page = _manager.get_page(data_page_id);
-                if (data_page->get_type() != Page::Type::DATA) {
+    // Descends straight to the leaf holding start_key and starts at the first key not less than it
+    StorageEngine::Iterator StorageEngine::seek(
+            const CollectionHandle& handle,
+            const Buffer& start_key,
+            std::optional<Buffer> end_key,
+            Compare compare_func) {
+        const Collection& collection = *handle._collection;
+        std::unique_ptr<LockedPage<SharedPageLock>> leaf = get_leaf_page<SharedPageLock>(
+            collection.root_node_id,
+            start_key,
+            compare_func);
+        bool found;
+        size_t index = search_leaf_node_entries(
+            leaf->page,
+            start_key,
+            compare_func,
+            found);
+        return Iterator(
+            *this,
+            collection.root_node_id,
+            std::move(leaf),
+            index,
+            start_key,
+            std::move(end_key),
+            compare_func);
+    }
+
+    /*
+        Moves the values still in use out of the value log segment with the largest
+        share of garbage, if it has at least min_garbage_ratio of it, and removes the
+        segment. Every record of the segment has its collection and key, a record is
+        still in use if the key's leaf entry points at it. The leaf stays locked while
+        the value is appended again and the entry pointed at the copy, so an update
+        in the meantime can't be lost. Returns false if no segment was collected.
+
+        NOTE: Keys are looked up with compare_func, which has to be the one the
+        collections were written with.
+    */
+    bool StorageEngine::collect_value_log_garbage(double min_garbage_ratio, Compare compare_func) {
+        if (_value_log == nullptr) return false;
+        std::optional<uint32_t> segment_id = _value_log->pick_segment(min_garbage_ratio);
+        if (!segment_id) return false;
+
+        boost::unique_lock<boost::shared_mutex> value_log_gc_lock(_value_log_gc_mutex);
+        _value_log->scan(*segment_id, [this, &compare_func](
+                const ValueLog::Pointer& pointer,
+                const Buffer& collection_name,
+                const Buffer& key,
+                const Buffer& val) {
+            WriteAheadLog::Operation wal_operation(_wal);
+            const Collection& collection = get_or_create_collection(collection_name);
+            std::unique_ptr<LockedPage<UniquePageLock>> leaf = get_leaf_page<UniquePageLock>(
+                collection.root_node_id,
+                key,
+                compare_func);
+            bool found;
+            size_t index = search_leaf_node_entries(leaf->page, key, compare_func, found);
+            if (found) {
+                Page::LeafNodeEntry entry = leaf->page->get_leaf_node_entry(index);
+                if (entry.val_data_index() == ValueLog::POINTER_INDEX && entry.val_data_id() == pointer.to_data_id()) {
+                    ValueLog::Pointer moved = _value_log->append(collection_name, key, val);
+                    leaf->page->set_leaf_node_entry_val_data_ptr(index, moved.to_data_id(), ValueLog::POINTER_INDEX);
+                    _manager.write_page(leaf->page.instance());
+                    return;
+                }
+            }
+            // The leaf is still locked, so a change saving a version of the value can't be missed
+            move_version_value(collection, key, pointer, val);
+        });
+
+        // The leaves pointing at the moved values have to be durable before the segment is gone
+        if (_wal != nullptr) {
+            _wal->commit();
+        } else {
+            _value_log->sync();
+            _manager.flush();
+            _manager.storage().sync();
+        }
+        _value_log->remove_segment(*segment_id);
+        return true;
+    }
+
+    Buffer StorageEngine::get_data(Page::ID data_id, size_t data_index) {
+        return get_value_reader(data_id, data_index).read_all();
+    }
+
+    // Returns a reader of a value, which is either in DATA pages or in the value log
+    StorageEngine::ValueReader StorageEngine::get_value_reader(
+            Page::ID data_id,
+            size_t data_index,
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf) {
+        if (data_index != ValueLog::POINTER_INDEX) {
+            return ValueReader(_manager, data_id, data_index, std::move(leaf));
+        }
+        if (_value_log == nullptr) {
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+        return ValueReader(_manager, _value_log->read(ValueLog::Pointer::from_data_id(data_id)), std::move(leaf));
+    }
+
+    // Compares an entry's key to key, only keys that weren't inlined have to be read.
+    int StorageEngine::compare_key(const Page::Key& entry_key, const Buffer& key, const Compare& compare_func) {
+        if (entry_key.inlined()) {
+            return compare_func(entry_key.data(), key);
+        }
+        return compare_func(get_data(entry_key.data_id(), entry_key.data_index()), key);
+    }
+
+    // NOTE: This method must be called with a lock on the entry's page.
+    int StorageEngine::compare_key(const Page::KeyView& entry_key, const Buffer& key, const Compare& compare_func) {
+        if (entry_key.inlined()) {
+            return compare_func(entry_key.data(), key);
+        }
+        return compare_func(get_data(entry_key.data_id(), entry_key.data_index()), key);
+    }
+
+    /*
+        Returns a ChildSelector descending towards key, which keeps the upper bound of
+        the keys below the selected child in bound. There is no bound below the last
+        entry of the root.
+    */
+    StorageEngine::ChildSelector StorageEngine::select_child_with_bound(
+            Page::ID root_node_id,
+            const Buffer& key,
+            Compare compare_func,
+            std::optional<Buffer>& bound) {
+        return [this, root_node_id, &key, compare_func, &bound](PageAccessor& page) {
+            // A descent starts over from the root when a page changes under it
+            if (page->get_id() == root_node_id) bound.reset();
+            size_t index = search_internal_node_entries(page, key, compare_func);
+            if (index + 1 < page->get_num_internal_node_entries()) {
+                // The key is copied, the entry holding it can be freed once the page is unlocked
+                Page::KeyView entry_key = page->get_internal_node_entry_key(index);
+                if (entry_key.inlined()) {
+                    bound.emplace(entry_key.data().data(), entry_key.data().size());
+                } else {
+                    bound.emplace(get_data(entry_key.data_id(), entry_key.data_index()));
+                }
+            }
+            return index;
+        };
+    }
+
+    /*
+        Reads values sorted by their DATA page, so each page is fetched and locked once
+        for all the values starting in it. val_ptrs holds the data id, data index and
+        position in vals of each value.
+    */
+    void StorageEngine::read_values(
+            std::vector<std::tuple<Page::ID, size_t, size_t>>& val_ptrs,
+            std::vector<std::optional<Buffer>>& vals) {
+        std::sort(val_ptrs.begin(), val_ptrs.end());
+        std::vector<std::tuple<Page::ID, size_t, size_t>> overflowing;
+        size_t i = 0;
+        while (i < val_ptrs.size()) {
+            Page::ID data_id = std::get<0>(val_ptrs[i]);
+            PageAccessor page = _manager.get_page(data_id);
+            if (page->get_type() != Page::Type::DATA) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+            SharedPageLock page_lock(page);
+            for (; i < val_ptrs.size() && std::get<0>(val_ptrs[i]) == data_id; i++) {
+                auto [_, data_index, pos] = val_ptrs[i];
+                Page::DataEntry entry = page->get_data_entry(data_index);
+                if (entry.overflows()) {
+                    overflowing.push_back(val_ptrs[i]);
+                } else {
+                    vals[pos] = entry.data();
+                }
+            }
+        }
+
+        // Values continuing in other pages are read once the page is unlocked, the reader locks it again
+        for (auto [data_id, data_index, pos] : overflowing) {
+            vals[pos] = get_data(data_id, data_index);
+        }
+    }
+
+    // NOTE: This method must be called with a lock on page.
+    size_t StorageEngine::search_internal_node_entries(
+            PageAccessor& page,
+            const Buffer& key,
+            Compare compare_func) {
+        /*
+            The last entry covers every key greater than the ones before it, its own
+            key is not kept up to date as keys are added to its child. The others are
+            sorted, find the first one whose key is not less than key.
+        */
+        size_t lo = 0;
+        size_t hi = page->get_num_internal_node_entries() - 1;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (compare_key(page->get_internal_node_entry_key(mid), key, compare_func) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+
+    // NOTE: This method must be called with a lock on page. Returns the first entry
+    // whose key is not less than key, found is set if its key is equal to key.
+    size_t StorageEngine::search_leaf_node_entries(
+            PageAccessor& page,
+            const Buffer& key,
+            Compare compare_func,
+            bool& found) {
+        size_t lo = 0;
+        size_t hi = page->get_num_leaf_node_entries();
+        found = false;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            int r = compare_key(page->get_leaf_node_entry_key(mid), key, compare_func);
+            if (r < 0) {
+                lo = mid + 1;
+            } else {
+                found = r == 0;
+                if (found) return mid;
+                hi = mid;
+            }
+        }
+
+        return lo;
+    }
+
+    /*
+        Descends from the root coupling shared locks, a page is locked before its parent
+        is unlocked so it can't be split in between. Writers must not wait for the leaf
+        while holding its parent though, the leaf's version is read under the parent's
+        lock instead and validated once the leaf is locked, starting over if the leaf
+        was split in the meantime. The leaf page is returned holding a lock of type TLock.
+    */
+    template <class TLock>
+    std::unique_ptr<StorageEngine::LockedPage<TLock>> StorageEngine::get_leaf_page(
+            Page::ID root_node_id,
+            const ChildSelector& select_child) {
+        constexpr bool shared = std::is_same<TLock, SharedPageLock>::value;
+        while (true) {
+            auto page = std::make_unique<LockedPage<SharedPageLock>>(
+                _manager.get_page(root_node_id));
+            std::optional<PageAccessor> leaf_page;
+            while (!leaf_page) {
+                switch (page->page->get_type()) {
+                case Page::Type::INTERNAL_NODE: {
+                    PageAccessor child = _manager.get_page(
+                        page->page->get_internal_node_entry(select_child(page->page)).next_node_id());
+                    if (!shared && child->get_type() == Page::Type::LEAF_NODE) {
+                        leaf_page.emplace(std::move(child));
+                    } else {
+                        page = std::make_unique<LockedPage<SharedPageLock>>(std::move(child));
+                    }
+                    break;
+                }
+                case Page::Type::LEAF_NODE:
+                    if constexpr (shared) {
+                        return page;
+                    }
+                    leaf_page.emplace(page->page);
+                    break;
+                default:
                     throw Exception(ErrorCode::CORRUPTED_FILE);
                 }
-                UniquePageLock data_page_lock(data_page);
-                data_page_index = data_page->insert_data_entry(val);
+            }
+
+            uint64_t version = (*leaf_page)->version();
+            page.reset();
+            auto leaf = std::make_unique<LockedPage<TLock>>(std::move(*leaf_page));
+            if (leaf->page->version() == version) {
+                return leaf;
+            }
+        }
+    }
+
+    template <class TLock>
+    std::unique_ptr<StorageEngine::LockedPage<TLock>> StorageEngine::get_leaf_page(
+            Page::ID root_node_id,
+            const Buffer& key,
+            Compare compare_func) {
+        return get_leaf_page<TLock>(
+            root_node_id,
+            [this, &key, &compare_func](PageAccessor& page) {
+                return search_internal_node_entries(page, key, compare_func);
+            });
+    }
+
+    /* Static */
+    bool StorageEngine::can_insert_entry(const PageAccessor& page, const Buffer& key) {
+        switch (page->get_type()) {
+        case Page::Type::INTERNAL_NODE:
+            return page->can_insert_internal_node_entry();
+        case Page::Type::LEAF_NODE:
+            return page->can_insert_leaf_node_entry(key);
+        default:
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+    }
+
+    /* Static */
+    bool StorageEngine::can_erase_entry(const PageAccessor& page, size_t index, bool is_root) {
+        switch (page->get_type()) {
+        case Page::Type::INTERNAL_NODE:
+            // Merging two children erases one entry, which is at most an eighth of a page with its key
+            if (is_root) return page->get_num_internal_node_entries() > 2;
+            return page->get_size() >= 2 * Page::MIN_SIZE;
+        case Page::Type::LEAF_NODE:
+            if (is_root) return true;
+            return page->get_size() - page->get_entry_space(index) >= Page::MIN_SIZE;
+        default:
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+    }
+
+    /*
+        Splits the full nodes at the bottom of path, top down, so that the leaf at
+        the end of path has room for key. The path is kept pointing at the nodes
+        key belongs to.
+    */
+    void StorageEngine::split_path(const Collection& collection, Path& path, const Buffer& key, Compare compare_func) {
+        Path::iterator node = std::prev(path.end());
+        while (node != path.begin() && !can_insert_entry(std::prev(node)->page, key)) {
+            node--;
+        }
+
+        if (node == path.begin()) {
+            split_root(collection, path);
+            node = std::next(path.begin());
+        }
+
+        while (node != path.end()) {
+            node = std::next(split_node(collection, path, node, key, compare_func));
+        }
+    }
+
+    /*
+        The root keeps its page id so the collection entry never changes, its entries
+        are moved into a new child and the root becomes an internal node above it.
+    */
+    void StorageEngine::split_root(const Collection& collection, Path& path) {
+        PathNode& root = path.front();
+        size_t root_index = root.index;
+        Path::iterator child = path.emplace(
+            std::next(path.begin()),
+            _manager.create_page(root.page->get_type()));
+        child->lock.upgrade();
+        root.page->move_entries(child->page.instance());
+        child->index = root_index;
+
+        Page::Key last_key = (child->page->get_type() == Page::Type::LEAF_NODE)
+            ? child->page->get_leaf_node_entry(child->page->get_num_leaf_node_entries() - 1).key()
+            : child->page->get_internal_node_entry(child->page->get_num_internal_node_entries() - 1).key();
+
+        root.page->reset(Page::Type::INTERNAL_NODE);
+        root.page->insert_internal_node_entry(0, copy_node_key(collection, last_key), child->page->get_id());
+        root.index = 0;
+
+        _manager.write_page(child->page.instance());
+        _manager.write_page(root.page.instance());
+    }
+
+    // NOTE: The parent of node must have room for another entry. Returns the
+    // path node of the half that key belongs to.
+    StorageEngine::Path::iterator StorageEngine::split_node(
+            const Collection& collection,
+            Path& path,
+            Path::iterator node,
+            const Buffer& key,
+            Compare compare_func) {
+        PathNode& parent = *std::prev(node);
+        Page::Type type = node->page->get_type();
+        PageAccessor sibling = _manager.create_page(type);
+
+        if (type == Page::Type::LEAF_NODE) {
+            node->page->split_leaf_node_entries(sibling.instance());
+            set_prev_leaf_node_page(sibling->get_next_leaf_node_page(), sibling->get_id());
+        } else {
+            node->page->split_internal_node_entries(sibling.instance());
+        }
+        Page::Key separator = (type == Page::Type::LEAF_NODE)
+            ? node->page->get_leaf_node_entry(node->page->get_num_leaf_node_entries() - 1).key()
+            : node->page->get_internal_node_entry(node->page->get_num_internal_node_entries() - 1).key();
+
+        // The entry pointing at node now points at the upper half, the lower half
+        // is inserted in front of it with its last key as the separator.
+        parent.page->insert_internal_node_entry(parent.index, copy_node_key(collection, separator), node->page->get_id());
+        parent.page->set_internal_node_entry_next_node(parent.index + 1, sibling->get_id());
+
+        _manager.write_page(sibling.instance());
+        _manager.write_page(node->page.instance());
+        _manager.write_page(parent.page.instance());
+
+        if (compare_key(separator, key, compare_func) >= 0) {
+            return node;
+        }
+
+        parent.index++;
+        Path::iterator sibling_node = path.emplace(node, std::move(sibling));
+        sibling_node->lock.upgrade();
+        sibling_node->index = node->index;
+        path.erase(node);
+        return sibling_node;
+    }
+
+    void StorageEngine::insert_leaf_node_entry(
+            const Collection& collection,
+            PageAccessor& page,
+            size_t pos,
+            const Buffer& key,
+            const Buffer& val,
+            Compare compare_func) {
+        save_version(collection, key, nullptr, compare_func);
+        // Keys too large to be stored in the leaf go to a DATA page like values
+        Page::Key entry_key = create_node_key(collection, key);
+        auto [val_data_id, val_data_index] = insert_leaf_value(collection, key, val);
+        page->insert_leaf_node_entry(
+            pos,
+            entry_key,
+            val_data_id,
+            val_data_index);
+    }
+
+    void StorageEngine::update_leaf_node_entry(
+            const Collection& collection,
+            PageAccessor& page,
+            size_t pos,
+            const Buffer& key,
+            const Buffer& val,
+            Compare compare_func) {
+        Page::LeafNodeEntry entry = page->get_leaf_node_entry(pos);
+        bool val_kept = save_version(collection, key, &entry, compare_func);
+        auto [val_data_id, val_data_index] = insert_leaf_value(collection, key, val);
+        page->set_leaf_node_entry_val_data_ptr(pos, val_data_id, val_data_index);
+        if (!val_kept) free_value(*collection.free_space_map, entry.val_data_id(), entry.val_data_index());
+    }
+
+    // Inserts the value of a leaf entry, into the value log if it's large enough
+    std::tuple<Page::ID, size_t> StorageEngine::insert_leaf_value(
+            const Collection& collection,
+            const Buffer& key,
+            const Buffer& val) {
+        if (_value_log != nullptr && val.size() >= _value_log->min_value_size()) {
+            ValueLog::Pointer pointer = _value_log->append(collection.name, key, val);
+            return std::make_tuple(pointer.to_data_id(), ValueLog::POINTER_INDEX);
+        }
+        return insert_value(*collection.free_space_map, val);
+    }
+
+    /*
+        Values too large for a single DATA page are split into chunks. The last chunk
+        is small enough to share a page found through the free list, the others fill
+        pages of their own. The chunks are written back to front so every chunk can
+        point at the one following it. Returns the location of the first chunk.
+    */
+    std::tuple<Page::ID, size_t> StorageEngine::insert_value(
+            FreeSpaceMap& free_space_map,
+            const Buffer& val) {
+        if (val.size() <= Page::max_data_entry_size()) {
+            return insert_value_into_data_page(free_space_map, val);
+        }
+
+        size_t chunk_size = Page::max_data_entry_size(true);
+        size_t pos = ((val.size() - 1) / chunk_size) * chunk_size;
+        auto [data_id, data_index] = insert_value_into_data_page(
+            free_space_map,
+            Buffer(val.buffer() + pos, val.size() - pos));
+        while (pos > 0) {
+            pos -= chunk_size;
+            std::tie(data_id, data_index) = insert_value_into_data_page(
+                free_space_map,
+                Buffer(val.buffer() + pos, chunk_size),
+                data_id,
+                data_index);
+        }
+
+        return std::make_tuple(data_id, data_index);
+    }
+
+    // NOTE: An overflow_id other than INVALID_ID makes the entry continue in that overflow entry.
+    std::tuple<Page::ID, size_t> StorageEngine::insert_value_into_data_page(
+            FreeSpaceMap& free_space_map,
+            const Buffer& val,
+            Page::ID overflow_id,
+            size_t overflow_index) {
+        bool overflows = overflow_id != Page::INVALID_ID;
+        auto insert_data_entry = [&](PageAccessor& data_page) {
+            if (overflows) return data_page->insert_data_entry(val, overflow_id, overflow_index);
+            return data_page->insert_data_entry(val);
+        };
+
+        Page::ID data_page_id;
+        if (free_space_map.reserve(Page::data_entry_space_req(val, overflows), data_page_id)) {
+            // CASE 1: A data page has sufficient space, it was reserved before the page is locked
+            PageAccessor data_page = _manager.get_page(data_page_id);
+            if (data_page->get_type() != Page::Type::DATA) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+            UniquePageLock data_page_lock(data_page);
+            if (data_page->can_insert_data_entry(val, overflows)) {
+                size_t data_page_index = insert_data_entry(data_page);
                 _manager.write_page(data_page.instance());
-                break;
+                return std::make_tuple(data_page_id, data_page_index);
             }
+            // The map was stale, its entries aren't stored until a batch is cut, correct it and use a new page
+            free_space_map.add(data_page_id, data_page->get_remaining_space());
+        }
 
-            page_id = page->get_next_free_list_page();
-            if (page_id != Page::INVALID_ID) continue;
+        // CASE 2: No data page has sufficient space, create a new one
+        PageAccessor new_data_page = _manager.create_page(Page::Type::DATA);
+        UniquePageLock new_data_page_lock(new_data_page);
+        size_t data_page_index = insert_data_entry(new_data_page);
+        _manager.write_page(new_data_page.instance());
+        free_space_map.add(new_data_page->get_id(), new_data_page->get_remaining_space());
+        return std::make_tuple(new_data_page->get_id(), data_page_index);
+    }
 
-            PageAccessor new_data_page = _manager.create_page(Page::Type::DATA);
-            UniquePageLock new_data_page_lock(new_data_page);
-            data_page_id = new_data_page->get_id();
-            data_page_index = new_data_page->insert_data_entry(val);
-
-            // CASE 2: Free List did not have an entry with sufficient space, create a new data page
-            if (page->can_insert_free_list_entry()) {
-                page->insert_free_list_entry(
-                    data_page_id,
-                    new_data_page->get_remaining_space());
-                _manager.write_page(new_data_page.instance());
-                _manager.write_page(page.instance());
+    /*
+        Applies an operation of a batch to the leaf its key belongs in. Returns false,
+        leaving the leaf as it is, if the leaf would have to be split or rebalanced.
+        Erased entries are added to erased, to be freed once the leaf is unlocked.
+    */
+    bool StorageEngine::apply_to_leaf(
+            const Collection& collection,
+            PageAccessor& leaf,
+            const WriteBatch::Operation& operation,
+            Compare compare_func,
+            std::vector<ErasedEntry>& erased) {
+        bool found;
+        size_t index = search_leaf_node_entries(leaf, operation.key(), compare_func, found);
+        if (operation.is_erase()) {
+            if (!found) return true;
+            if (!can_erase_entry(leaf, index, leaf->get_id() == collection.root_node_id)) return false;
+            Page::LeafNodeEntry entry = leaf->get_leaf_node_entry(index);
+            bool val_kept = save_version(collection, operation.key(), &entry, compare_func);
+            erased.push_back(ErasedEntry{entry, val_kept});
+            leaf->erase_leaf_node_entry(index);
+        } else if (found) {
+            update_leaf_node_entry(collection, leaf, index, operation.key(), operation.val(), compare_func);
+        } else {
+            if (!leaf->can_insert_leaf_node_entry(operation.key())) return false;
+            insert_leaf_node_entry(collection, leaf, index, operation.key(), operation.val(), compare_func);
+        }
+        return true;
+    }
+
+    /*
+        Erases key from a leaf that would be underfull without it. The descent is made
+        with update locks like the one for a full leaf in put, the ancestors of a page
+        are unlocked as soon as we know the page is safe, that is it can lose an entry
+        without becoming underfull. The pages below the topmost one we still hold are
+        then rebalanced bottom up, each with a sibling, until one of them is no longer
+        underfull or entries were borrowed instead of merged.
+    */
+    std::optional<StorageEngine::ErasedEntry> StorageEngine::erase_and_rebalance(
+            const Collection& collection,
+            const Buffer& key,
+            Compare compare_func) {
+        Path path;
+        Page::ID page_id = collection.root_node_id;
+        while (true) {
+            PathNode& node = path.emplace_back(_manager.get_page(page_id));
+            Page::Type type = node.page->get_type();
+            if (type != Page::Type::LEAF_NODE && type != Page::Type::INTERNAL_NODE) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+            if (type == Page::Type::LEAF_NODE) {
+                bool found;
+                node.index = search_leaf_node_entries(node.page, key, compare_func, found);
+                if (!found) return std::nullopt;
+                if (can_erase_entry(node.page, node.index, page_id == collection.root_node_id)) {
+                    path.erase(path.begin(), std::prev(path.end()));
+                }
                 break;
             }
+            if (can_erase_entry(node.page, 0, page_id == collection.root_node_id)) {
+                path.erase(path.begin(), std::prev(path.end()));
+            }
+            node.index = search_internal_node_entries(node.page, key, compare_func);
+            page_id = node.page->get_internal_node_entry(node.index).next_node_id();
+        }
+
+        // As in put, only the topmost page is upgraded and the pages below it are locked again
+        path.erase(std::next(path.begin()), path.end());
+        path.front().lock.upgrade();
+        std::optional<PathNode> left_leaf;
+        Path::iterator node = path.begin();
+        while (node->page->get_type() == Page::Type::INTERNAL_NODE) {
+            node->index = search_internal_node_entries(node->page, key, compare_func);
+            size_t num_entries = node->page->get_num_internal_node_entries();
+            PageAccessor child = _manager.get_page(
+                node->page->get_internal_node_entry(node->index).next_node_id());
+            /*
+                A leaf with no right sibling is rebalanced with its left one. Iterators
+                lock the next leaf while holding the current one, so the left leaf has to
+                be locked first.
+            */
+            if (child->get_type() == Page::Type::LEAF_NODE && node->index > 0 && node->index + 1 == num_entries) {
+                left_leaf.emplace(_manager.get_page(
+                    node->page->get_internal_node_entry(node->index - 1).next_node_id()));
+                left_leaf->lock.upgrade();
+            }
+            node = path.emplace(path.end(), std::move(child));
+            node->lock.upgrade();
+        }
+
+        PathNode& leaf = path.back();
+        if (leaf.page->get_type() != Page::Type::LEAF_NODE) {
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+        bool found;
+        leaf.index = search_leaf_node_entries(leaf.page, key, compare_func, found);
+        if (!found) return std::nullopt;
+        Page::LeafNodeEntry entry = leaf.page->get_leaf_node_entry(leaf.index);
+        bool val_kept = save_version(collection, key, &entry, compare_func);
+        leaf.page->erase_leaf_node_entry(leaf.index);
+        _manager.write_page(leaf.page.instance());
+        add_num_records(collection, -1);
+
+        while (path.size() > 1 && path.back().page->is_underfull()) {
+            bool merged = rebalance_node(collection, *std::prev(path.end(), 2), path.back(), left_leaf);
+            left_leaf.reset();
+            path.pop_back();
+            if (!merged) break;
+        }
+        if (path.size() == 1) collapse_root(collection, path.front());
+
+        return ErasedEntry{entry, val_kept};
+    }
+
+    /*
+        Rebalances an underfull node with its right sibling, or its left one if it's the
+        last child of its parent. When the entries of both fit in one page the right
+        node is merged into the left one and its entry is erased from the parent,
+        otherwise entries are moved from the fuller node to the other one. Returns true
+        if the nodes were merged.
+    */
+    bool StorageEngine::rebalance_node(
+            const Collection& collection,
+            PathNode& parent,
+            PathNode& node,
+            std::optional<PathNode>& left_sibling) {
+        size_t num_entries = parent.page->get_num_internal_node_entries();
+        if (num_entries < 2) return false;
+
+        std::optional<PathNode> right_sibling;
+        size_t left_index;
+        PageAccessor* left;
+        PageAccessor* right;
+        if (parent.index + 1 < num_entries) {
+            right_sibling.emplace(_manager.get_page(
+                parent.page->get_internal_node_entry(parent.index + 1).next_node_id()));
+            right_sibling->lock.upgrade();
+            left_index = parent.index;
+            left = &node.page;
+            right = &right_sibling->page;
+        } else {
+            if (!left_sibling) {
+                left_sibling.emplace(_manager.get_page(
+                    parent.page->get_internal_node_entry(parent.index - 1).next_node_id()));
+                left_sibling->lock.upgrade();
+            }
+            left_index = parent.index - 1;
+            left = &left_sibling->page;
+            right = &node.page;
+        }
+
+        Page::Type type = (*left)->get_type();
+        if (type != (*right)->get_type()) {
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+
+        /*
+            The key of an internal node's last entry isn't kept up to date, once more
+            entries follow it, it has to become the separator from the parent. If it
+            doesn't fit the left node is close to full, entries can only be moved out of
+            it and the first one moved takes the separator along.
+        */
+        Page::Key separator = parent.page->get_internal_node_entry(left_index).key();
+        bool left_has_separator = true;
+        if (type == Page::Type::INTERNAL_NODE) {
+            size_t last = (*left)->get_num_internal_node_entries() - 1;
+            left_has_separator = (*left)->can_set_internal_node_entry_key(last, separator);
+            if (left_has_separator) {
+                Page::Key stale_key = (*left)->get_internal_node_entry(last).key();
+                (*left)->set_internal_node_entry_key(last, copy_node_key(collection, separator));
+                free_node_key(collection, stale_key);
+            }
+        }
+
+        size_t num_left = type == Page::Type::LEAF_NODE ?
+            (*left)->get_num_leaf_node_entries() :
+            (*left)->get_num_internal_node_entries();
+        size_t num_right = type == Page::Type::LEAF_NODE ?
+            (*right)->get_num_leaf_node_entries() :
+            (*right)->get_num_internal_node_entries();
+
+        if (left_has_separator && (*right)->get_size() - (*right)->header_size() <= (*left)->get_remaining_space()) {
+            // Merge the right node into the left one
+            for (size_t i = 0; i < num_right; i++) {
+                move_node_entry(*right, 0, *left, num_left + i, get_node_entry_key(*right, 0));
+            }
+            if (type == Page::Type::LEAF_NODE) {
+                (*left)->set_next_leaf_node_page((*right)->get_next_leaf_node_page());
+                set_prev_leaf_node_page((*right)->get_next_leaf_node_page(), (*left)->get_id());
+            }
+            parent.page->set_internal_node_entry_next_node(left_index + 1, (*left)->get_id());
+            parent.page->erase_internal_node_entry(left_index);
+            _manager.write_page(left->instance());
+            _manager.write_page(parent.page.instance());
+            free_node_page(collection, *right);
+            free_node_key(collection, separator);
+            return true;
+        }
+
+        // The new separator can be larger than the old one
+        if (!parent.page->can_insert_internal_node_entry()) return false;
+
+        bool moved = false;
+        if ((*left)->get_size() > (*right)->get_size()) {
+            while (num_left > 1) {
+                // Unless it already has it, the left node's last entry takes a copy of the separator along
+                bool takes_separator = !moved && type == Page::Type::INTERNAL_NODE && !left_has_separator;
+                Page::Key key = takes_separator ? separator : get_node_entry_key(*left, num_left - 1);
+                uint16_t space = (*left)->get_entry_space(num_left - 1);
+                if ((*right)->get_size() + space > (*left)->get_size() - space) break;
+                if (!can_insert_node_entry(*right, key)) break;
+                if (takes_separator) {
+                    Page::Key stale_key = get_node_entry_key(*left, num_left - 1);
+                    move_node_entry(*left, num_left - 1, *right, 0, copy_node_key(collection, separator));
+                    free_node_key(collection, stale_key);
+                } else {
+                    move_node_entry(*left, num_left - 1, *right, 0, key);
+                }
+                num_left--;
+                moved = true;
+            }
+        } else if (left_has_separator) {
+            while (num_right > 1) {
+                uint16_t space = (*right)->get_entry_space(0);
+                if ((*left)->get_size() + space > (*right)->get_size() - space) break;
+                Page::Key key = get_node_entry_key(*right, 0);
+                if (!can_insert_node_entry(*left, key)) break;
+                move_node_entry(*right, 0, *left, num_left, key);
+                num_left++;
+                num_right--;
+                moved = true;
+            }
+        }
+
+        if (moved) {
+            parent.page->set_internal_node_entry_key(
+                left_index,
+                copy_node_key(collection, get_node_entry_key(*left, num_left - 1)));
+            free_node_key(collection, separator);
+            _manager.write_page(parent.page.instance());
+            _manager.write_page(right->instance());
+        }
+        _manager.write_page(left->instance());
+        return false;
+    }
+
+    // The root keeps its id, once it has a single child the child's entries are moved up into it
+    void StorageEngine::collapse_root(const Collection& collection, PathNode& root) {
+        if (root.page->get_id() != collection.root_node_id) return;
+        if (root.page->get_type() != Page::Type::INTERNAL_NODE) return;
+        if (root.page->get_num_internal_node_entries() != 1) return;
+
+        Page::InternalNodeEntry entry = root.page->get_internal_node_entry(0);
+        PageAccessor child = _manager.get_page(entry.next_node_id());
+        UniquePageLock child_lock(child);
+        root.page->reset(child->get_type());
+        child->move_entries(root.page.instance());
+        _manager.write_page(root.page.instance());
+        free_node_page(collection, child);
+        free_node_key(collection, entry.key());
+    }
+
+    /*
+        Points a leaf back at a new previous leaf. Leaves are locked from left to right
+        like iterators moving forward do, so this is only called while holding the new
+        previous leaf.
+    */
+    void StorageEngine::set_prev_leaf_node_page(Page::ID page_id, Page::ID prev_id) {
+        if (page_id == Page::INVALID_ID) return;
+        PageAccessor page = _manager.get_page(page_id);
+        if (page->get_type() != Page::Type::LEAF_NODE) {
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+        UniquePageLock page_lock(page);
+        page->set_prev_leaf_node_page(prev_id);
+        _manager.write_page(page.instance());
+    }
+
+    /* Static */
+    Page::Key StorageEngine::get_node_entry_key(const PageAccessor& page, size_t i) {
+        if (page->get_type() == Page::Type::LEAF_NODE) {
+            return page->get_leaf_node_entry(i).key();
+        }
+        return page->get_internal_node_entry(i).key();
+    }
+
+    /* Static */
+    bool StorageEngine::can_insert_node_entry(const PageAccessor& page, const Page::Key& key) {
+        if (page->get_type() == Page::Type::LEAF_NODE) {
+            return page->can_insert_leaf_node_entry(key);
+        }
+        return page->can_insert_internal_node_entry(key);
+    }
+
+    /* Static */
+    void StorageEngine::move_node_entry(
+            PageAccessor& src,
+            size_t i,
+            PageAccessor& dst,
+            size_t pos,
+            const Page::Key& key) {
+        if (src->get_type() == Page::Type::LEAF_NODE) {
+            Page::LeafNodeEntry entry = src->get_leaf_node_entry(i);
+            dst->insert_leaf_node_entry(pos, key, entry.val_data_id(), entry.val_data_index());
+            src->erase_leaf_node_entry(i);
+        } else {
+            Page::InternalNodeEntry entry = src->get_internal_node_entry(i);
+            dst->insert_internal_node_entry(pos, key, entry.next_node_id());
+            src->erase_internal_node_entry(i);
+        }
+    }
+
+    /*
+        Every node entry owns its key. A key too large to inline is stored in a DATA
+        entry of its own, so a key taken from another entry is copied and every entry
+        frees its key when it's dropped.
+    */
+    Page::Key StorageEngine::create_node_key(const Collection& collection, const Buffer& key) {
+        if (Page::can_inline_key(key)) return Page::Key(key);
+        return std::make_from_tuple<Page::Key>(insert_value(*collection.free_space_map, key));
+    }
+
+    Page::Key StorageEngine::copy_node_key(const Collection& collection, const Page::Key& key) {
+        if (key.inlined()) return key;
+        return create_node_key(collection, get_data(key.data_id(), key.data_index()));
+    }
+
+    void StorageEngine::free_node_key(const Collection& collection, const Page::Key& key) {
+        if (key.inlined()) return;
+        free_value(*collection.free_space_map, key.data_id(), key.data_index());
+    }
+
+    // Turns a node that's no longer in the tree into an empty DATA page on the free list
+    void StorageEngine::free_node_page(const Collection& collection, PageAccessor& page) {
+        page->reset(Page::Type::DATA);
+        _manager.write_page(page.instance());
+        collection.free_space_map->release(page->get_id(), page->get_remaining_space());
+    }
+
+    // Internal nodes have copies of the keys they separate by, so a leaf's key can be freed with it
+    void StorageEngine::free_leaf_node_entry(const Collection& collection, const ErasedEntry& erased) {
+        free_node_key(collection, erased.entry.key());
+        if (erased.val_kept) return;
+        free_value(*collection.free_space_map, erased.entry.val_data_id(), erased.entry.val_data_index());
+    }
+
+    // Erases a value's entries, following its overflow entries, and gives their space back to the free list
+    void StorageEngine::free_value(FreeSpaceMap& free_space_map, Page::ID data_id, size_t data_index) {
+        if (data_index == ValueLog::POINTER_INDEX) {
+            // A value in the value log is only counted as garbage, its segment is collected later
+            if (_value_log == nullptr) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+            _value_log->release(ValueLog::Pointer::from_data_id(data_id));
+            return;
+        }
+
+        while (data_id != Page::INVALID_ID) {
+            PageAccessor data_page = _manager.get_page(data_id);
+            if (data_page->get_type() != Page::Type::DATA) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+
+            uint16_t space;
+            Page::ID next_id = Page::INVALID_ID;
+            size_t next_index = 0;
+            {
+                // The data page is unlocked before the free space map is, like in insert_value_into_data_page
+                UniquePageLock data_page_lock(data_page);
+                Page::DataEntry entry = data_page->get_data_entry(data_index);
+                if (entry.overflows()) {
+                    next_id = entry.overflow_id();
+                    next_index = entry.overflow_index();
+                }
+                space = data_page->erase_data_entry(data_index);
+                _manager.write_page(data_page.instance());
+            }
+            free_space_map.release(data_id, space);
 
-            // CASE 3: Free List does not have enough room for an entry, create a new one
-            PageAccessor new_free_list_page = _manager.create_page(Page::Type::FREE_LIST);
-            UniquePageLock new_free_list_page_lock(new_free_list_page);
-            new_free_list_page->insert_free_list_entry(
-                data_page_id,
-                new_data_page->get_remaining_space());
-            page->set_next_free_list_page(new_free_list_page->get_id());
+            data_id = next_id;
+            data_index = next_index;
+        }
+    }
 
-            _manager.write_page(new_data_page.instance());
-            _manager.write_page(new_free_list_page.instance());
+    // Appends a value to the DATA page being filled by a bulk load, values too large for one page are chained
+    std::tuple<Page::ID, size_t> StorageEngine::append_value(BulkLoad& load, const Buffer& val) {
+        if (val.size() <= Page::max_data_entry_size()) {
+            if (!load.data_page || !(*load.data_page)->can_insert_data_entry(val)) {
+                load.data_page.emplace(create_data_page(load));
+            }
+            size_t data_index = (*load.data_page)->insert_data_entry(val);
+            return std::make_tuple((*load.data_page)->get_id(), data_index);
+        }
+
+        size_t chunk_size = Page::max_data_entry_size(true);
+        size_t pos = ((val.size() - 1) / chunk_size) * chunk_size;
+        auto [data_id, data_index] = append_value(load, Buffer(val.buffer() + pos, val.size() - pos));
+        while (pos > 0) {
+            pos -= chunk_size;
+            PageAccessor page = create_bulk_load_page(load, Page::Type::DATA);
+            data_index = page->insert_data_entry(
+                Buffer(val.buffer() + pos, chunk_size),
+                data_id,
+                data_index);
+            data_id = page->get_id();
             _manager.write_page(page.instance());
-            break;
         }
+        return std::make_tuple(data_id, data_index);
+    }
+
+    // Creates a page for a bulk load, it's freed again if the load fails
+    PageAccessor StorageEngine::create_bulk_load_page(BulkLoad& load, Page::Type type) {
+        PageAccessor page = _manager.create_page(type);
+        load.page_ids.push_back(page->get_id());
+        return page;
+    }
+
+    // Starts a new DATA page for a bulk load, the one filled so far is written
+    PageAccessor StorageEngine::create_data_page(BulkLoad& load) {
+        close_data_page(load);
+        return create_bulk_load_page(load, Page::Type::DATA);
+    }
+
+    // The space left in a filled DATA page goes to the free list once the load is done
+    void StorageEngine::close_data_page(BulkLoad& load) {
+        if (!load.data_page) return;
+        PageAccessor data_page = std::move(*load.data_page);
+        load.data_page.reset();
+        _manager.write_page(data_page.instance());
+        load.data_pages.emplace_back(data_page->get_id(), data_page->get_remaining_space());
+    }
+
+    const Buffer& StorageEngine::CollectionHandle::name() const {
+        return _collection->name;
+    }
+
+    StorageEngine::CollectionHandle::CollectionHandle(const Collection* collection)
+        : _collection(collection) {}
+
+    void StorageEngine::ValueReader::read(void* val, size_t size) {
+        char* dst = static_cast<char*>(val);
+        while (size > 0) {
+            if (_pos == _chunk.size()) {
+                if (_next_id == Page::INVALID_ID) {
+                    throw std::out_of_range("read past the end of the value");
+                }
+                load_next_chunk();
+                continue;
+            }
+
+            size_t n = std::min(size, _chunk.size() - _pos);
+            std::memcpy(dst, _chunk.buffer() + _pos, n);
+            _pos += n;
+            dst += n;
+            size -= n;
+        }
+    }
+
+    bool StorageEngine::ValueReader::end() const {
+        return _pos == _chunk.size() && _next_id == Page::INVALID_ID;
+    }
+
+    // Returns the rest of the value.
+    Buffer StorageEngine::ValueReader::read_all() {
+        if (_pos == 0 && _next_id == Page::INVALID_ID) {
+            _pos = _chunk.size();
+            return _chunk;
+        }
+
+        std::string data(_chunk.buffer() + _pos, _chunk.size() - _pos);
+        while (_next_id != Page::INVALID_ID) {
+            load_next_chunk();
+            data.append(_chunk.buffer(), _chunk.size());
+        }
+        _pos = _chunk.size();
+        return Buffer(data.data(), data.size());
+    }
+
+    StorageEngine::ValueReader::ValueReader(
+            PageManager& manager,
+            Page::ID data_id,
+            size_t data_index,
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf)
+            : _manager(manager),
+            _leaf(std::move(leaf)),
+            _pos(0),
+            _next_id(data_id),
+            _next_index(data_index) {
+        load_next_chunk();
+    }
+
+    StorageEngine::ValueReader::ValueReader(
+            PageManager& manager,
+            Buffer val,
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf)
+            : _manager(manager),
+            _leaf(std::move(leaf)),
+            _chunk(std::move(val)),
+            _pos(0),
+            _next_id(Page::INVALID_ID),
+            _next_index(0) {}
+
+    void StorageEngine::ValueReader::load_next_chunk() {
+        PageAccessor data_page = _manager.get_page(_next_id);
+        if (data_page->get_type() != Page::Type::DATA) {
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+
+        SharedPageLock data_page_lock(data_page);
+        Page::DataEntry entry = data_page->get_data_entry(_next_index);
+        _chunk = entry.data();
+        _pos = 0;
+        _next_id = entry.overflow_id();
+        _next_index = entry.overflow_index();
+    }
+
+    StorageEngine::Snapshot::Snapshot(StorageEngine& storage_engine, uint64_t sequence)
+        : _storage_engine(storage_engine),
+        _sequence(sequence) {}
 
-        return std::make_tuple(data_page_id, data_page_index);
+    StorageEngine::Snapshot::~Snapshot() {
+        _storage_engine.release_snapshot(_sequence);
     }
 
     StorageEngine::Iterator::~Iterator() {
@@ -370,55 +2134,345 @@ namespace diamond {
     }
 
     void StorageEngine::Iterator::next() {
-        if (++_leaf_page_iterator->iter != 
-                _leaf_page_iterator->page->leaf_node_entries_end()) return;
-        if (_leaf_page_iterator->page->get_next_leaf_node_page() == Page::INVALID_ID) {
-            delete _leaf_page_iterator;
-            _leaf_page_iterator = nullptr;
+        if (_snapshot_entries) {
+            if (++_snapshot_entries->index == _snapshot_entries->entries.size()) {
+                load_next_snapshot_entries(std::get<0>(_snapshot_entries->entries.back()));
+            }
             return;
         }
-        PageAccessor next_page = _manager.get_page(
-            _leaf_page_iterator->page->get_next_leaf_node_page());
-        if (next_page->get_type() != Page::Type::LEAF_NODE) {
-            throw Exception(ErrorCode::CORRUPTED_FILE);
+        _leaf_page_iterator->index++;
+        skip_exhausted_pages();
+        stop_at_end_key();
+    }
+
+    void StorageEngine::Iterator::prev() {
+        if (_snapshot_entries) {
+            if (_snapshot_entries->index > 0) {
+                _snapshot_entries->index--;
+            } else {
+                load_prev_snapshot_entries(std::get<0>(_snapshot_entries->entries.front()));
+            }
+            return;
         }
-        SharedPageLock next_page_lock(next_page);
-        LeafPageIterator* new_leaf_page_iterator = new LeafPageIterator(std::move(next_page));
-        delete _leaf_page_iterator;
-        _leaf_page_iterator = new_leaf_page_iterator;
+        if (_leaf_page_iterator->index > 0) {
+            _leaf_page_iterator->index--;
+        } else {
+            seek_before(key());
+        }
+        stop_at_start_key();
+    }
+
+    void StorageEngine::Iterator::seek_to_last() {
+        if (_snapshot != nullptr) {
+            load_prev_snapshot_entries(std::nullopt);
+            return;
+        }
+        seek_before(_end_key);
+        stop_at_start_key();
     }
 
     Buffer StorageEngine::Iterator::key() {
-        Page::LeafNodeEntry entry = *(_leaf_page_iterator->iter);
-        PageAccessor data_page = _manager.get_page(entry.key_data_id());
-        if (data_page->get_type() != Page::Type::DATA) {
-            throw Exception(ErrorCode::CORRUPTED_FILE);
+        if (_snapshot_entries) {
+            return std::get<0>(_snapshot_entries->entries[_snapshot_entries->index]);
         }
-        SharedPageLock data_page_lock(data_page);
-        return data_page->get_data_entry(entry.key_data_index()).data();
+        Page::LeafNodeEntry entry = _leaf_page_iterator->leaf->page->get_leaf_node_entry(
+            _leaf_page_iterator->index);
+        const Page::Key& key = entry.key();
+        if (key.inlined()) {
+            return key.data();
+        }
+        return ValueReader(_manager, key.data_id(), key.data_index()).read_all();
+    }
+
+    StorageEngine::ValueReader StorageEngine::Iterator::val_reader() {
+        if (_snapshot_entries) {
+            return ValueReader(_manager, val());
+        }
+        Page::LeafNodeEntry entry = _leaf_page_iterator->leaf->page->get_leaf_node_entry(
+            _leaf_page_iterator->index);
+        return _storage_engine.get_value_reader(entry.val_data_id(), entry.val_data_index());
     }
 
     Buffer StorageEngine::Iterator::val() {
-        Page::LeafNodeEntry entry = *(_leaf_page_iterator->iter);
-        PageAccessor data_page = _manager.get_page(entry.val_data_id());
-        if (data_page->get_type() != Page::Type::DATA) {
-            throw Exception(ErrorCode::CORRUPTED_FILE);
+        if (_snapshot_entries) {
+            return std::get<1>(_snapshot_entries->entries[_snapshot_entries->index]);
         }
-        SharedPageLock data_page_lock(data_page);
-        return data_page->get_data_entry(entry.val_data_index()).data();
+        return val_reader().read_all();
     }
 
     bool StorageEngine::Iterator::end() const {
-        return _leaf_page_iterator == nullptr;
+        return _leaf_page_iterator == nullptr && !_snapshot_entries;
+    }
+
+    StorageEngine::Iterator::Iterator(
+            StorageEngine& storage_engine,
+            Page::ID root_node_id,
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf,
+            size_t index,
+            std::optional<Buffer> start_key,
+            std::optional<Buffer> end_key,
+            Compare compare_func)
+            : _storage_engine(storage_engine),
+            _manager(storage_engine._manager),
+            _leaf_page_iterator(leaf ? new LeafPageIterator(std::move(leaf), index) : nullptr),
+            _root_node_id(root_node_id),
+            _start_key(std::move(start_key)),
+            _end_key(std::move(end_key)),
+            _compare_func(compare_func),
+            _snapshot(nullptr),
+            _collection(nullptr) {
+        if (end()) return;
+        skip_exhausted_pages();
+        stop_at_end_key();
+    }
+
+    StorageEngine::Iterator::Iterator(
+            StorageEngine& storage_engine,
+            const Collection& collection,
+            const Snapshot& snapshot,
+            std::optional<Buffer> start_key,
+            std::optional<Buffer> end_key,
+            Compare compare_func)
+            : _storage_engine(storage_engine),
+            _manager(storage_engine._manager),
+            _leaf_page_iterator(nullptr),
+            _root_node_id(collection.root_node_id),
+            _start_key(std::move(start_key)),
+            _end_key(std::move(end_key)),
+            _compare_func(compare_func),
+            _snapshot(&snapshot),
+            _collection(&collection) {
+        load_next_snapshot_entries(std::nullopt);
+    }
+
+    /*
+        Copies the entries of the leaf holding the first key after the given one, or
+        the start key, under its lock. The leaf's entries up to its last key are then
+        all the keys after the given one, so the versions of the keys in between are
+        applied. Leaves with no entry left once they're applied are skipped.
+    */
+    void StorageEngine::Iterator::load_next_snapshot_entries(const std::optional<Buffer>& after) {
+        std::optional<Buffer> lower = after ? after : _start_key;
+        bool lower_inclusive = !after;
+        while (true) {
+            std::vector<std::tuple<Buffer, Buffer>> entries;
+            std::optional<Buffer> upper = _end_key;
+            bool upper_inclusive = false;
+            {
+                Iterator iter = lower
+                    ? _storage_engine.seek(CollectionHandle(_collection), *lower, _end_key, _compare_func)
+                    : _storage_engine.get_iterator(CollectionHandle(_collection));
+                if (!iter.end() && !lower_inclusive && _compare_func(iter.key(), *lower) == 0) {
+                    iter.next();
+                }
+                if (!iter.end()) {
+                    LeafPageIterator& leaf_iter = *iter._leaf_page_iterator;
+                    size_t num_entries = leaf_iter.leaf->page->get_num_leaf_node_entries();
+                    bool stopped = false;
+                    for (; leaf_iter.index < num_entries; leaf_iter.index++) {
+                        Buffer key = iter.key();
+                        if (_end_key && _compare_func(key, *_end_key) >= 0) {
+                            stopped = true;
+                            break;
+                        }
+                        entries.emplace_back(std::move(key), iter.val());
+                    }
+                    if (!stopped && leaf_iter.leaf->page->get_next_leaf_node_page() != Page::INVALID_ID) {
+                        upper = std::get<0>(entries.back());
+                        upper_inclusive = true;
+                    }
+                }
+            }
+
+            _storage_engine.apply_versions(
+                *_collection,
+                _snapshot->_sequence,
+                entries,
+                lower,
+                lower_inclusive,
+                upper,
+                upper_inclusive,
+                _compare_func);
+            if (!entries.empty()) {
+                _snapshot_entries.emplace(SnapshotEntries{std::move(entries), 0});
+                return;
+            }
+            if (!upper_inclusive) {
+                _snapshot_entries.reset();
+                return;
+            }
+            lower = std::move(upper);
+            lower_inclusive = false;
+        }
+    }
+
+    // Copies the entries of the leaf holding the last key before the given one, or the end key, like load_next_snapshot_entries.
+    void StorageEngine::Iterator::load_prev_snapshot_entries(const std::optional<Buffer>& before) {
+        std::optional<Buffer> upper = before ? before : _end_key;
+        while (true) {
+            std::vector<std::tuple<Buffer, Buffer>> entries;
+            std::optional<Buffer> lower = _start_key;
+            bool lower_inclusive = true;
+            bool bounded = false;
+            {
+                Iterator iter(
+                    _storage_engine,
+                    _root_node_id,
+                    nullptr,
+                    0,
+                    _start_key,
+                    upper,
+                    _compare_func);
+                iter.seek_to_last();
+                if (!iter.end()) {
+                    LeafPageIterator& leaf_iter = *iter._leaf_page_iterator;
+                    bool stopped = false;
+                    while (true) {
+                        Buffer key = iter.key();
+                        if (_start_key && _compare_func(key, *_start_key) < 0) {
+                            stopped = true;
+                            break;
+                        }
+                        entries.emplace_back(std::move(key), iter.val());
+                        if (leaf_iter.index == 0) break;
+                        leaf_iter.index--;
+                    }
+                    std::reverse(entries.begin(), entries.end());
+                    if (!stopped && leaf_iter.leaf->page->get_prev_leaf_node_page() != Page::INVALID_ID) {
+                        lower = std::get<0>(entries.front());
+                        bounded = true;
+                    }
+                }
+            }
+
+            _storage_engine.apply_versions(
+                *_collection,
+                _snapshot->_sequence,
+                entries,
+                lower,
+                lower_inclusive,
+                upper,
+                false,
+                _compare_func);
+            if (!entries.empty()) {
+                size_t index = entries.size() - 1;
+                _snapshot_entries.emplace(SnapshotEntries{std::move(entries), index});
+                return;
+            }
+            if (!bounded) {
+                _snapshot_entries.reset();
+                return;
+            }
+            upper = std::move(lower);
+        }
     }
 
-    StorageEngine::Iterator::Iterator(PageManager& manager, PageAccessor page) 
-        : _manager(manager),
-        _leaf_page_iterator(new LeafPageIterator(std::move(page))) {}
+    // Moves to the next leaf page until the iterator points at an entry.
+    void StorageEngine::Iterator::skip_exhausted_pages() {
+        while (_leaf_page_iterator->index ==
+                _leaf_page_iterator->leaf->page->get_num_leaf_node_entries()) {
+            Page::ID next_page_id = _leaf_page_iterator->leaf->page->get_next_leaf_node_page();
+            if (next_page_id == Page::INVALID_ID) {
+                delete _leaf_page_iterator;
+                _leaf_page_iterator = nullptr;
+                return;
+            }
+
+            auto next_page = std::make_unique<LockedPage<SharedPageLock>>(
+                _manager.get_page(next_page_id));
+            if (next_page->page->get_type() != Page::Type::LEAF_NODE) {
+                throw Exception(ErrorCode::CORRUPTED_FILE);
+            }
+            LeafPageIterator* new_leaf_page_iterator = new LeafPageIterator(std::move(next_page), 0);
+            delete _leaf_page_iterator;
+            _leaf_page_iterator = new_leaf_page_iterator;
+        }
+    }
+
+    /*
+        Moves to the last entry with a key less than key, or the last entry of all if
+        there's no key. Locking the previous leaf while holding the current one would
+        lock leaves from right to left, against the order writers lock them in, so the
+        current leaf is unlocked first. If the previous leaf no longer links to it, the
+        leaves changed in the meantime and the search starts over from the root.
+    */
+    void StorageEngine::Iterator::seek_before(const std::optional<Buffer>& key) {
+        delete _leaf_page_iterator;
+        _leaf_page_iterator = nullptr;
+
+        auto search = [&](std::unique_ptr<LockedPage<SharedPageLock>>& leaf) {
+            if (!key) return leaf->page->get_num_leaf_node_entries();
+            bool found;
+            return _storage_engine.search_leaf_node_entries(leaf->page, *key, _compare_func, found);
+        };
+
+        while (true) {
+            std::unique_ptr<LockedPage<SharedPageLock>> leaf;
+            if (key) {
+                leaf = _storage_engine.get_leaf_page<SharedPageLock>(_root_node_id, *key, _compare_func);
+            } else {
+                leaf = _storage_engine.get_leaf_page<SharedPageLock>(
+                    _root_node_id,
+                    [](PageAccessor& page) {
+                        return page->get_num_internal_node_entries() - 1;
+                    });
+            }
+
+            size_t index = search(leaf);
+            while (index == 0) {
+                Page::ID page_id = leaf->page->get_id();
+                Page::ID prev_page_id = leaf->page->get_prev_leaf_node_page();
+                leaf.reset();
+                if (prev_page_id == Page::INVALID_ID) return;
+
+                leaf = std::make_unique<LockedPage<SharedPageLock>>(_manager.get_page(prev_page_id));
+                if (leaf->page->get_type() != Page::Type::LEAF_NODE ||
+                        leaf->page->get_next_leaf_node_page() != page_id) {
+                    leaf.reset();
+                    break;
+                }
+                index = search(leaf);
+            }
+
+            if (leaf) {
+                _leaf_page_iterator = new LeafPageIterator(std::move(leaf), index - 1);
+                return;
+            }
+        }
+    }
+
+    // Moves the iterator to its end once it goes below the start key, unlocking the leaf page.
+    void StorageEngine::Iterator::stop_at_start_key() {
+        if (!_start_key || end()) return;
+        if (_compare_func(key(), *_start_key) < 0) {
+            delete _leaf_page_iterator;
+            _leaf_page_iterator = nullptr;
+        }
+    }
+
+    // Moves the iterator to its end once it reaches the end key, unlocking the leaf page.
+    void StorageEngine::Iterator::stop_at_end_key() {
+        if (!_end_key || end()) return;
+        if (_compare_func(key(), *_end_key) >= 0) {
+            delete _leaf_page_iterator;
+            _leaf_page_iterator = nullptr;
+        }
+    }
+
+    StorageEngine::Iterator::LeafPageIterator::LeafPageIterator(
+            std::unique_ptr<LockedPage<SharedPageLock>> _leaf,
+            size_t _index)
+        : leaf(std::move(_leaf)),
+        index(_index) {}
+
+    template <class TLock>
+    StorageEngine::LockedPage<TLock>::LockedPage(PageAccessor _page)
+        : page(std::move(_page)),
+        lock(page) {}
 
-    StorageEngine::Iterator::LeafPageIterator::LeafPageIterator(PageAccessor _page)
+    StorageEngine::PathNode::PathNode(PageAccessor _page)
         : page(std::move(_page)),
         lock(page),
-        iter(page->leaf_node_entries_begin()) {}
+        index(0) {}
 
 } // namespace diamond
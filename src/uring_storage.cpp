@@ -0,0 +1,465 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define DIAMOND_HAS_IO_URING
+#endif
+
+#include "diamond/uring_storage.h"
+
+namespace diamond {
+
+    struct UringStorage::Request {
+        bool write;
+        char* buffer;
+        size_t n;
+        uint64_t offset;
+        struct iovec iov;
+        std::promise<void> promise;
+    };
+
+#ifdef DIAMOND_HAS_IO_URING
+
+    // The rings shared with the kernel, the head of the submission ring and the tail of the completion ring are the kernel's
+    struct UringStorage::Ring {
+        int fd = -1;
+        unsigned entries = 0;
+
+        void* sq_ptr = MAP_FAILED;
+        size_t sq_size = 0;
+        void* cq_ptr = MAP_FAILED;
+        size_t cq_size = 0;
+        void* sqes_ptr = MAP_FAILED;
+        size_t sqes_size = 0;
+
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_mask;
+        unsigned* sq_array;
+        io_uring_sqe* sqes;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        unsigned* cq_mask;
+        io_uring_cqe* cqes;
+
+        ~Ring() {
+            if (sqes_ptr != MAP_FAILED) munmap(sqes_ptr, sqes_size);
+            if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+            if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+            if (fd != -1) close(fd);
+        }
+    };
+
+#else
+
+    struct UringStorage::Ring {};
+
+#endif
+
+    UringStorage::UringStorage(const std::string& file_name, unsigned queue_depth)
+            : _file(file_name),
+            _ring(setup(queue_depth)),
+            _size(_file.size()),
+            _num_queued(0),
+            _stop(false) {
+        if (_ring) {
+            _thread = boost::thread(std::bind(&UringStorage::bg_task, this));
+        }
+    }
+
+    UringStorage::~UringStorage() {
+        if (!_ring) return;
+#ifdef DIAMOND_HAS_IO_URING
+        // A request with no data wakes the background thread up
+        _stop = true;
+        {
+            boost::unique_lock<boost::mutex> lock(_sq_mutex);
+            if (!_error) {
+                queue(nullptr, lock);
+                submit_queued(lock);
+            }
+        }
+        _thread.join();
+#endif
+    }
+
+    std::future<void> UringStorage::read_async(char* buffer, size_t n, uint64_t offset) {
+        return enqueue(false, buffer, n, offset);
+    }
+
+    std::future<void> UringStorage::write_async(const char* buffer, size_t n, uint64_t offset) {
+        return enqueue(true, const_cast<char*>(buffer), n, offset);
+    }
+
+    void UringStorage::submit() {
+        if (!_ring) return;
+        boost::unique_lock<boost::mutex> lock(_sq_mutex);
+        if (!_error) submit_queued(lock);
+    }
+
+    bool UringStorage::uses_io_uring() const {
+        return _ring != nullptr;
+    }
+
+    /*
+        Sets up a ring with queue_depth entries, or returns none if io_uring isn't
+        available. Kernels that could drop completions when the completion ring is
+        full aren't used, so any number of requests can be in flight.
+    */
+    std::unique_ptr<UringStorage::Ring> UringStorage::setup(unsigned queue_depth) {
+#ifdef DIAMOND_HAS_IO_URING
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        auto ring = std::make_unique<Ring>();
+        ring->fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+        if (ring->fd < 0) {
+            ring->fd = -1;
+            return nullptr;
+        }
+        if (!(params.features & IORING_FEAT_NODROP)) return nullptr;
+        ring->entries = params.sq_entries;
+
+        ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            ring->sq_size = ring->cq_size = std::max(ring->sq_size, ring->cq_size);
+        }
+        ring->sq_ptr = mmap(
+            nullptr,
+            ring->sq_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ring->fd,
+            IORING_OFF_SQ_RING);
+        if (ring->sq_ptr == MAP_FAILED) return nullptr;
+        ring->cq_ptr = single_mmap ? ring->sq_ptr : mmap(
+            nullptr,
+            ring->cq_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ring->fd,
+            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) return nullptr;
+        ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        ring->sqes_ptr = mmap(
+            nullptr,
+            ring->sqes_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ring->fd,
+            IORING_OFF_SQES);
+        if (ring->sqes_ptr == MAP_FAILED) return nullptr;
+
+        char* sq = static_cast<char*>(ring->sq_ptr);
+        ring->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring->sqes = static_cast<io_uring_sqe*>(ring->sqes_ptr);
+        char* cq = static_cast<char*>(ring->cq_ptr);
+        ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return ring;
+#else
+        (void) queue_depth;
+        return nullptr;
+#endif
+    }
+
+    std::future<void> UringStorage::enqueue(bool write, char* buffer, size_t n, uint64_t offset) {
+        if (!_ring) {
+            std::promise<void> promise;
+            try {
+                if (write) {
+                    _file.write(buffer, n, offset);
+                } else {
+                    _file.read(buffer, n, offset);
+                }
+                promise.set_value();
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+            return promise.get_future();
+        }
+
+        Request* request = new Request{write, buffer, n, offset, {}, {}};
+        std::future<void> future = request->promise.get_future();
+        boost::unique_lock<boost::mutex> lock(_sq_mutex);
+        if (_error) {
+            request->promise.set_exception(_error);
+            delete request;
+            return future;
+        }
+        _in_flight.insert(request);
+        queue(request, lock);
+        return future;
+    }
+
+    // Adds the request to the submission ring, submitting the queued ones first if it's full. lock must hold _sq_mutex.
+    void UringStorage::queue(Request* request, boost::unique_lock<boost::mutex>& lock) {
+#ifdef DIAMOND_HAS_IO_URING
+        Ring& ring = *_ring;
+        while (*ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+            submit_queued(lock);
+            // The ring failed while the lock was released, the request got the error
+            if (_error) return;
+        }
+        unsigned tail = *ring.sq_tail;
+
+        unsigned index = tail & *ring.sq_mask;
+        io_uring_sqe* sqe = &ring.sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        if (request == nullptr) {
+            sqe->opcode = IORING_OP_NOP;
+        } else {
+            request->iov.iov_base = request->buffer;
+            request->iov.iov_len = request->n;
+            sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = _file.fd();
+            sqe->off = request->offset;
+            sqe->addr = reinterpret_cast<uint64_t>(&request->iov);
+            sqe->len = 1;
+        }
+        sqe->user_data = reinterpret_cast<uint64_t>(request);
+        ring.sq_array[index] = index;
+        __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        _num_queued++;
+#else
+        (void) request;
+        (void) lock;
+#endif
+    }
+
+    /*
+        NOTE: lock must hold _sq_mutex. It's released while the kernel is busy, the
+        background thread has to lock it to drain the completion ring, which the
+        kernel may be waiting for. Other threads can queue requests meanwhile, they're
+        submitted along with the rest.
+    */
+    void UringStorage::submit_queued(boost::unique_lock<boost::mutex>& lock) {
+        while (_num_queued > 0) {
+            int submitted = enter(_num_queued, 0);
+            if (submitted < 0) {
+                if (submitted == -EAGAIN || submitted == -EBUSY) {
+                    lock.unlock();
+                    boost::this_thread::yield();
+                    lock.lock();
+                    if (_error) return;
+                    continue;
+                }
+                throw std::system_error(-submitted, std::generic_category());
+            }
+            _num_queued -= submitted;
+        }
+    }
+
+    // Returns the number of requests submitted, or the negated error
+    int UringStorage::enter(unsigned to_submit, unsigned min_complete) {
+#ifdef DIAMOND_HAS_IO_URING
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (true) {
+            int result = syscall(__NR_io_uring_enter, _ring->fd, to_submit, min_complete, flags, nullptr, 0);
+            if (result >= 0) return result;
+            if (errno != EINTR) return -errno;
+        }
+#else
+        (void) to_submit;
+        (void) min_complete;
+        return -ENOSYS;
+#endif
+    }
+
+    // Fulfills the request's future. Returns false if only part of it was made, what's left has to be queued again.
+    bool UringStorage::complete(Request* request, int result) {
+        if (result == -EINTR || result == -EAGAIN) {
+            result = 0;
+        } else if (result < 0 || (result == 0 && request->write)) {
+            finish(request, std::make_exception_ptr(
+                std::system_error(result < 0 ? -result : EIO, std::generic_category())));
+            return true;
+        } else if (result == 0) {
+            // Past the end of the file
+            std::memset(request->buffer, 0, request->n);
+            request->n = 0;
+        }
+
+        request->buffer += result;
+        request->n -= result;
+        request->offset += result;
+        if (request->n == 0) {
+            if (request->write) {
+                uint64_t size = _size;
+                while (size < request->offset && !_size.compare_exchange_weak(size, request->offset)) {}
+            }
+            finish(request, nullptr);
+            return true;
+        }
+        return false;
+    }
+
+    /*
+        Queues requests that were only partly made again, as many as the submission
+        ring has room for, and tries once to submit them. It's called by the background
+        thread after draining the completion ring and never waits for the kernel, which
+        may be waiting for the thread to drain it again. Returns true if any of them
+        are left to be queued or submitted on its next round.
+    */
+    bool UringStorage::requeue(std::vector<Request*>& requests) {
+#ifdef DIAMOND_HAS_IO_URING
+        Ring& ring = *_ring;
+        boost::unique_lock<boost::mutex> lock(_sq_mutex);
+        auto it = requests.begin();
+        for (; it != requests.end(); it++) {
+            if (*ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) break;
+            queue(*it, lock);
+        }
+        requests.erase(requests.begin(), it);
+
+        if (_num_queued > 0) {
+            int submitted = enter(_num_queued, 0);
+            if (submitted >= 0) {
+                _num_queued -= submitted;
+            } else if (submitted != -EAGAIN && submitted != -EBUSY) {
+                throw std::system_error(-submitted, std::generic_category());
+            }
+        }
+        return !requests.empty() || _num_queued > 0;
+#else
+        (void) requests;
+        return false;
+#endif
+    }
+
+    // Makes the request's future ready, with the error if there's one
+    void UringStorage::finish(Request* request, std::exception_ptr error) {
+        {
+            boost::lock_guard<boost::mutex> lock(_sq_mutex);
+            _in_flight.erase(request);
+        }
+        if (error) {
+            request->promise.set_exception(error);
+        } else {
+            request->promise.set_value();
+        }
+        delete request;
+    }
+
+    // Gives the error to every request in flight and to any made after, they'd never complete
+    void UringStorage::fail(std::exception_ptr error) {
+        boost::lock_guard<boost::mutex> lock(_sq_mutex);
+        _error = error;
+        for (Request* request : _in_flight) {
+            request->promise.set_exception(error);
+            delete request;
+        }
+        _in_flight.clear();
+    }
+
+    // NOTE: An exception mustn't leave the thread, it would end the process.
+    void UringStorage::bg_task() {
+#ifdef DIAMOND_HAS_IO_URING
+        Ring& ring = *_ring;
+        // Requests only partly made, they're queued again once the completion ring is drained
+        std::vector<Request*> requeued;
+        bool pending = false;
+        try {
+            while (true) {
+                // Doesn't wait for a completion while requests are left to submit, there may be none in flight
+                if (pending) boost::this_thread::yield();
+                int result = enter(0, pending ? 0 : 1);
+                if (result < 0 && result != -EAGAIN && result != -EBUSY) {
+                    throw std::system_error(-result, std::generic_category());
+                }
+
+                unsigned head = *ring.cq_head;
+                unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+                std::vector<std::tuple<Request*, int>> completed;
+                for (; head != tail; head++) {
+                    const io_uring_cqe& cqe = ring.cqes[head & *ring.cq_mask];
+                    completed.emplace_back(reinterpret_cast<Request*>(cqe.user_data), cqe.res);
+                }
+                __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+                bool stopped = false;
+                for (auto [request, result] : completed) {
+                    if (request == nullptr) {
+                        stopped = _stop;
+                    } else if (!complete(request, result)) {
+                        requeued.push_back(request);
+                    }
+                }
+                if (stopped) return;
+                pending = requeue(requeued);
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+#endif
+    }
+
+    // A single write is waited for right away, so there's nothing to gain from the ring
+    void UringStorage::write_at(const char* buffer, size_t n, uint64_t offset) {
+        _file.write(buffer, n, offset);
+    }
+
+    void UringStorage::read_at(char* buffer, size_t n, uint64_t offset) {
+        _file.read(buffer, n, offset);
+    }
+
+    // The writes are submitted together, so they're all in flight at once
+    void UringStorage::write_batch_at(const std::vector<Write>& writes) {
+        std::vector<std::future<void>> futures;
+        futures.reserve(writes.size());
+        for (const Write& write : writes) {
+            futures.push_back(write_async(write.buffer, write.n, write.offset));
+        }
+        submit();
+        for (std::future<void>& future : futures) {
+            future.get();
+        }
+    }
+
+    uint64_t UringStorage::size_impl() {
+        return std::max<uint64_t>(_size, _file.size());
+    }
+
+    void UringStorage::sync_impl() {
+        _file.sync();
+    }
+
+    void UringStorage::truncate_impl(uint64_t size) {
+        _file.truncate(size);
+        _size = size;
+    }
+
+} // namespace diamond
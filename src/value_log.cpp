@@ -0,0 +1,249 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#include "diamond/exception.h"
+#include "diamond/file_storage.h"
+#include "diamond/value_log.h"
+
+namespace diamond {
+
+    FileValueLogSegmentFactory::FileValueLogSegmentFactory(std::string file_name_prefix)
+        : _file_name_prefix(std::move(file_name_prefix)) {}
+
+    std::unique_ptr<Storage> FileValueLogSegmentFactory::open(uint32_t segment_id) const {
+        return std::make_unique<FileStorage>(file_name(segment_id));
+    }
+
+    std::vector<uint32_t> FileValueLogSegmentFactory::list() const {
+        std::filesystem::path prefix(_file_name_prefix);
+        std::filesystem::path dir = prefix.has_parent_path() ? prefix.parent_path() : std::filesystem::path(".");
+        std::string name = prefix.filename().string() + ".";
+
+        std::vector<uint32_t> segment_ids;
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(dir)) {
+            std::string file_name = entry.path().filename().string();
+            if (file_name.size() <= name.size() || file_name.compare(0, name.size(), name) != 0) continue;
+            std::string id = file_name.substr(name.size());
+            if (id.find_first_not_of("0123456789") != std::string::npos) continue;
+            segment_ids.push_back(std::stoul(id));
+        }
+        std::sort(segment_ids.begin(), segment_ids.end());
+        return segment_ids;
+    }
+
+    void FileValueLogSegmentFactory::remove(uint32_t segment_id) const {
+        std::remove(file_name(segment_id).c_str());
+    }
+
+    std::string FileValueLogSegmentFactory::file_name(uint32_t segment_id) const {
+        return _file_name_prefix + "." + std::to_string(segment_id);
+    }
+
+    const size_t ValueLog::POINTER_INDEX = 0xFFFF;
+
+    Page::ID ValueLog::Pointer::to_data_id() const {
+        return (static_cast<Page::ID>(segment_id) << OFFSET_BITS) | offset;
+    }
+
+    /* Static */
+    ValueLog::Pointer ValueLog::Pointer::from_data_id(Page::ID data_id) {
+        return Pointer{
+            .segment_id = static_cast<uint32_t>(data_id >> OFFSET_BITS),
+            .offset = data_id & ((static_cast<uint64_t>(1) << OFFSET_BITS) - 1)
+        };
+    }
+
+    // NOTE: Segment ids start at 1, so no pointer makes a data id of INVALID_ID.
+    ValueLog::ValueLog(
+            const ValueLogSegmentFactory& segment_factory,
+            size_t min_value_size,
+            uint64_t max_segment_size)
+            : _segment_factory(segment_factory),
+            _min_value_size(min_value_size),
+            _max_segment_size(max_segment_size) {
+        if (max_segment_size >= (static_cast<uint64_t>(1) << OFFSET_BITS)) {
+            throw std::invalid_argument("value log segments must be smaller than 1 TiB");
+        }
+
+        for (uint32_t segment_id : _segment_factory.list()) {
+            if (segment_id == 0) continue;
+            _segments.emplace(segment_id, open_segment(segment_id));
+        }
+        if (_segments.empty()) {
+            _segments.emplace(1, open_segment(1));
+        }
+        _head_id = _segments.rbegin()->first;
+    }
+
+    size_t ValueLog::min_value_size() const {
+        return _min_value_size;
+    }
+
+    ValueLog::Pointer ValueLog::append(const Buffer& collection_name, const Buffer& key, const Buffer& val) {
+        uint32_t sizes[3] = {
+            static_cast<uint32_t>(collection_name.size()),
+            static_cast<uint32_t>(key.size()),
+            static_cast<uint32_t>(val.size())
+        };
+        Buffer record(RECORD_HEADER_SIZE + collection_name.size() + key.size() + val.size());
+        char* e = record.buffer();
+        std::memcpy(e, sizes, RECORD_HEADER_SIZE);
+        e += RECORD_HEADER_SIZE;
+        std::memcpy(e, collection_name.buffer(), collection_name.size());
+        e += collection_name.size();
+        std::memcpy(e, key.buffer(), key.size());
+        e += key.size();
+        std::memcpy(e, val.buffer(), val.size());
+
+        boost::lock_guard<boost::mutex> append_lock(_append_mutex);
+        Segment* head;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(_mutex);
+            head = &_segments.at(_head_id);
+        }
+        if (head->size > SEGMENT_HEADER_SIZE && head->size + record.size() > _max_segment_size) {
+            // The head is full, start a new segment. sync only syncs the head, the full one is synced now.
+            head->storage->sync();
+            Segment segment = open_segment(_head_id + 1);
+            boost::unique_lock<boost::shared_mutex> lock(_mutex);
+            _head_id++;
+            head = &_segments.emplace(_head_id, std::move(segment)).first->second;
+        }
+
+        Pointer pointer{ .segment_id = _head_id, .offset = head->size };
+        head->storage->write(record.buffer(), record.size(), head->size);
+        boost::unique_lock<boost::shared_mutex> lock(_mutex);
+        head->size += record.size();
+        return pointer;
+    }
+
+    Buffer ValueLog::read(const Pointer& pointer) {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        auto it = _segments.find(pointer.segment_id);
+        if (it == _segments.end()) {
+            throw Exception(ErrorCode::CORRUPTED_FILE);
+        }
+
+        Storage& storage = *it->second.storage;
+        uint32_t sizes[3];
+        read_header(storage, pointer.offset, sizes);
+        Buffer val(sizes[2]);
+        storage.read(val.buffer(), val.size(), pointer.offset + RECORD_HEADER_SIZE + sizes[0] + sizes[1]);
+        return val;
+    }
+
+    void ValueLog::release(const Pointer& pointer) {
+        boost::unique_lock<boost::shared_mutex> lock(_mutex);
+        auto it = _segments.find(pointer.segment_id);
+        if (it == _segments.end()) return;
+
+        Segment& segment = it->second;
+        uint32_t sizes[3];
+        read_header(*segment.storage, pointer.offset, sizes);
+        segment.garbage_size += RECORD_HEADER_SIZE + sizes[0] + sizes[1] + sizes[2];
+        // Only a hint of what's worth collecting, so it isn't synced
+        segment.storage->write(reinterpret_cast<const char*>(&segment.garbage_size), sizeof(segment.garbage_size), 0);
+    }
+
+    void ValueLog::sync() {
+        boost::lock_guard<boost::mutex> append_lock(_append_mutex);
+        Storage* head;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(_mutex);
+            head = _segments.at(_head_id).storage.get();
+        }
+        head->sync();
+    }
+
+    std::optional<uint32_t> ValueLog::pick_segment(double min_garbage_ratio) {
+        boost::shared_lock<boost::shared_mutex> lock(_mutex);
+        std::optional<uint32_t> picked;
+        double picked_ratio = 0;
+        for (const auto& [segment_id, segment] : _segments) {
+            if (segment_id == _head_id) continue;
+            uint64_t records_size = segment.size - SEGMENT_HEADER_SIZE;
+            double ratio = records_size == 0 ? 1 : static_cast<double>(segment.garbage_size) / records_size;
+            if (ratio >= min_garbage_ratio && (!picked || ratio > picked_ratio)) {
+                picked = segment_id;
+                picked_ratio = ratio;
+            }
+        }
+        return picked;
+    }
+
+    // Calls callback for every record of the segment, in the order they were appended
+    void ValueLog::scan(uint32_t segment_id, const ScanCallback& callback) {
+        Storage* storage;
+        uint64_t size;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(_mutex);
+            const Segment& segment = _segments.at(segment_id);
+            storage = segment.storage.get();
+            size = segment.size;
+        }
+
+        uint64_t offset = SEGMENT_HEADER_SIZE;
+        while (offset < size) {
+            uint32_t sizes[3];
+            read_header(*storage, offset, sizes);
+            Buffer data(sizes[0] + sizes[1] + sizes[2]);
+            storage->read(data.buffer(), data.size(), offset + RECORD_HEADER_SIZE);
+            callback(
+                Pointer{ .segment_id = segment_id, .offset = offset },
+                Buffer(data.buffer(), sizes[0]),
+                Buffer(data.buffer() + sizes[0], sizes[1]),
+                Buffer(data.buffer() + sizes[0] + sizes[1], sizes[2]));
+            offset += RECORD_HEADER_SIZE + data.size();
+        }
+    }
+
+    void ValueLog::remove_segment(uint32_t segment_id) {
+        {
+            boost::unique_lock<boost::shared_mutex> lock(_mutex);
+            if (segment_id == _head_id) {
+                throw std::logic_error("the last segment of the value log can't be removed");
+            }
+            _segments.erase(segment_id);
+        }
+        _segment_factory.remove(segment_id);
+    }
+
+    // Reads the segment's garbage size, or writes the header of a new segment
+    ValueLog::Segment ValueLog::open_segment(uint32_t segment_id) {
+        std::unique_ptr<Storage> storage = _segment_factory.open(segment_id);
+        uint64_t size = storage->size();
+        uint64_t garbage_size = 0;
+        if (size < SEGMENT_HEADER_SIZE) {
+            storage->write(reinterpret_cast<const char*>(&garbage_size), sizeof(garbage_size), 0);
+            size = SEGMENT_HEADER_SIZE;
+        } else {
+            storage->read(reinterpret_cast<char*>(&garbage_size), sizeof(garbage_size), 0);
+        }
+        return Segment{ .storage = std::move(storage), .size = size, .garbage_size = garbage_size };
+    }
+
+    void ValueLog::read_header(Storage& storage, uint64_t offset, uint32_t (&sizes)[3]) {
+        storage.read(reinterpret_cast<char*>(sizes), RECORD_HEADER_SIZE, offset);
+    }
+
+} // namespace diamond
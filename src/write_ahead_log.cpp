@@ -0,0 +1,310 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include <boost/crc.hpp>
+
+#include "diamond/write_ahead_log.h"
+
+namespace diamond {
+
+    thread_local std::vector<const WriteAheadLog*> WriteAheadLog::Operation::_held;
+
+    WriteAheadLog::Operation::Operation(WriteAheadLog* wal)
+            : _wal(wal),
+            _nested(std::find(_held.begin(), _held.end(), wal) != _held.end()) {
+        if (_wal == nullptr || _nested) return;
+        _wal->_operations_mutex.lock_shared();
+        _held.push_back(_wal);
+    }
+
+    WriteAheadLog::Operation::~Operation() {
+        if (_wal == nullptr || _nested) return;
+        _held.erase(std::find(_held.begin(), _held.end(), _wal));
+        _wal->_operations_mutex.unlock_shared();
+    }
+
+    WriteAheadLog::WriteAheadLog(Storage& log_storage, Storage& storage, uint64_t checkpoint_size)
+            : _log_storage(log_storage),
+            _storage(storage),
+            _num_cut(0),
+            _num_committed(0),
+            _size(0),
+            _checkpoint_size(checkpoint_size),
+            _log_pos(0),
+            _sequence(0),
+            _checkpoint_sequence(1),
+            _next_callback_id(0),
+            _stop(false) {
+        recover();
+        _size = _storage.size();
+        _thread = boost::thread(std::bind(&WriteAheadLog::bg_task, this));
+    }
+
+    WriteAheadLog::~WriteAheadLog() {
+        _stop = true;
+        _thread.join();
+        commit_batch();
+    }
+
+    void WriteAheadLog::commit() {
+        commit_batch();
+    }
+
+    // The writes are either in the batch being filled, to be cut next, or in one cut already
+    void WriteAheadLog::wait_for_commit() {
+        boost::unique_lock<boost::mutex> lock(_batch_mutex);
+        uint64_t batch = _batch.empty() ? _num_cut : _num_cut + 1;
+        _committed.wait(lock, [this, batch]() {
+            return _num_committed >= batch;
+        });
+    }
+
+    // Most of the file is synced while batches are still committed, only what they wrote meanwhile is synced under the lock
+    void WriteAheadLog::checkpoint() {
+        _storage.sync();
+        boost::lock_guard<boost::mutex> commit_lock(_commit_mutex);
+        checkpoint_log();
+    }
+
+    uint64_t WriteAheadLog::checkpoint_sequence() {
+        boost::lock_guard<boost::mutex> commit_lock(_commit_mutex);
+        return _checkpoint_sequence;
+    }
+
+    void WriteAheadLog::before_commit(std::function<void()> callback) {
+        boost::lock_guard<boost::mutex> commit_lock(_commit_mutex);
+        _before_commit.push_back(std::move(callback));
+    }
+
+    uint64_t WriteAheadLog::before_cut(std::function<void()> callback) {
+        boost::lock_guard<boost::mutex> commit_lock(_commit_mutex);
+        uint64_t id = _next_callback_id++;
+        _before_cut.emplace(id, std::move(callback));
+        return id;
+    }
+
+    // Once it returns, the callback isn't being called and won't be again
+    void WriteAheadLog::remove_before_cut(uint64_t id) {
+        boost::lock_guard<boost::mutex> commit_lock(_commit_mutex);
+        _before_cut.erase(id);
+    }
+
+    /*
+        Replays the records of the log into the database file, up to the first one
+        that was only partly written. Records are numbered from the checkpoint
+        sequence in the header, so the records left over from before the last
+        checkpoint are told apart from new ones.
+    */
+    void WriteAheadLog::recover() {
+        uint64_t log_size = _log_storage.size();
+        if (log_size >= HEADER_SIZE) {
+            uint64_t checkpoint_sequence;
+            uint32_t header_checksum;
+            _log_storage.read(reinterpret_cast<char*>(&checkpoint_sequence), sizeof(checkpoint_sequence), 0);
+            _log_storage.read(
+                reinterpret_cast<char*>(&header_checksum),
+                sizeof(header_checksum),
+                sizeof(checkpoint_sequence));
+            // NOTE: A torn header was being written by a checkpoint, the file was synced before it.
+            if (checksum(checkpoint_sequence) == header_checksum) {
+                _checkpoint_sequence = checkpoint_sequence;
+            }
+        }
+        _sequence = _checkpoint_sequence - 1;
+        _log_pos = HEADER_SIZE;
+
+        while (_log_pos + RECORD_HEADER_SIZE <= log_size) {
+            uint64_t sequence;
+            uint32_t writes_size;
+            uint32_t record_checksum;
+            _log_storage.read(reinterpret_cast<char*>(&sequence), sizeof(sequence), _log_pos);
+            _log_storage.read(reinterpret_cast<char*>(&writes_size), sizeof(writes_size), _log_pos + sizeof(sequence));
+            _log_storage.read(
+                reinterpret_cast<char*>(&record_checksum),
+                sizeof(record_checksum),
+                _log_pos + sizeof(sequence) + sizeof(writes_size));
+            if (sequence != _sequence + 1) break;
+            if (_log_pos + RECORD_HEADER_SIZE + writes_size > log_size) break;
+
+            Buffer writes(writes_size);
+            _log_storage.read(writes.buffer(), writes.size(), _log_pos + RECORD_HEADER_SIZE);
+            if (checksum(sequence, writes) != record_checksum) break;
+
+            const char* e = writes.buffer();
+            while (e < writes.buffer() + writes.size()) {
+                uint64_t offset;
+                uint32_t size;
+                std::memcpy(&offset, e, sizeof(offset));
+                std::memcpy(&size, e + sizeof(offset), sizeof(size));
+                e += WRITE_HEADER_SIZE;
+                _storage.write(e, size, offset);
+                e += size;
+            }
+
+            _sequence = sequence;
+            _log_pos += RECORD_HEADER_SIZE + writes_size;
+        }
+
+        // Everything in the log is in the database file now
+        checkpoint_log();
+    }
+
+    void WriteAheadLog::commit_batch() {
+        boost::unique_lock<boost::mutex> commit_lock(_commit_mutex);
+        {
+            // Waits for the operations in progress, new ones wait for the batch to be cut
+            boost::unique_lock<boost::shared_mutex> operations_lock(_operations_mutex);
+            for (const auto& [_, callback] : _before_cut) {
+                callback();
+            }
+            boost::lock_guard<boost::mutex> lock(_batch_mutex);
+            if (_batch.empty()) return;
+            _committing = std::move(_batch);
+            _batch.clear();
+            _num_cut++;
+        }
+
+        for (const std::function<void()>& callback : _before_commit) {
+            callback();
+        }
+
+        size_t writes_size = 0;
+        for (const auto& [_, data] : _committing) {
+            writes_size += WRITE_HEADER_SIZE + data.size();
+        }
+        Buffer writes(writes_size);
+        char* e = writes.buffer();
+        for (const auto& [offset, data] : _committing) {
+            uint32_t size = data.size();
+            std::memcpy(e, &offset, sizeof(offset));
+            std::memcpy(e + sizeof(offset), &size, sizeof(size));
+            e += WRITE_HEADER_SIZE;
+            std::memcpy(e, data.buffer(), data.size());
+            e += data.size();
+        }
+
+        uint64_t sequence = ++_sequence;
+        uint32_t size = writes.size();
+        uint32_t record_checksum = checksum(sequence, writes);
+        Buffer record(RECORD_HEADER_SIZE + writes.size());
+        std::memcpy(record.buffer(), &sequence, sizeof(sequence));
+        std::memcpy(record.buffer() + sizeof(sequence), &size, sizeof(size));
+        std::memcpy(record.buffer() + sizeof(sequence) + sizeof(size), &record_checksum, sizeof(record_checksum));
+        std::memcpy(record.buffer() + RECORD_HEADER_SIZE, writes.buffer(), writes.size());
+        _log_storage.write(record.buffer(), record.size(), _log_pos);
+        _log_storage.sync();
+        _log_pos += record.size();
+
+        // The batch is durable, its writes can reach the file in any order
+        std::vector<Storage::Write> file_writes;
+        file_writes.reserve(_committing.size());
+        for (const auto& [offset, data] : _committing) {
+            file_writes.push_back(Storage::Write{data.buffer(), data.size(), offset});
+        }
+        _storage.write(file_writes);
+        {
+            boost::lock_guard<boost::mutex> lock(_batch_mutex);
+            _committing.clear();
+            _num_committed++;
+        }
+        _committed.notify_all();
+
+        bool full = _log_pos >= _checkpoint_size;
+        commit_lock.unlock();
+        if (full) checkpoint();
+    }
+
+    /*
+        Syncs the database file, so every committed record is in it, then writes
+        the sequence number of the next record to the header. The records up to it
+        are never replayed again, so the log is cut back to the header and started
+        over.
+        NOTE: _commit_mutex must be held, so no batch is committed meanwhile. checkpoint
+        syncs the file before taking it, so this sync only has the writes made since.
+    */
+    void WriteAheadLog::checkpoint_log() {
+        _storage.sync();
+
+        uint64_t checkpoint_sequence = _sequence + 1;
+        uint32_t header_checksum = checksum(checkpoint_sequence);
+        char header[HEADER_SIZE];
+        std::memcpy(header, &checkpoint_sequence, sizeof(checkpoint_sequence));
+        std::memcpy(header + sizeof(checkpoint_sequence), &header_checksum, sizeof(header_checksum));
+        _log_storage.write(header, HEADER_SIZE, 0);
+        _log_storage.sync();
+        _log_storage.truncate(HEADER_SIZE);
+
+        _checkpoint_sequence = checkpoint_sequence;
+        _log_pos = HEADER_SIZE;
+    }
+
+    void WriteAheadLog::bg_task() {
+        while (!_stop) {
+            boost::this_thread::sleep_for(
+                boost::chrono::milliseconds(DELAY));
+            if (_stop) break;
+            commit_batch();
+        }
+    }
+
+    /* Static */
+    uint32_t WriteAheadLog::checksum(uint64_t sequence, const Buffer& writes) {
+        boost::crc_32_type crc;
+        crc.process_bytes(&sequence, sizeof(sequence));
+        crc.process_bytes(writes.buffer(), writes.size());
+        return crc.checksum();
+    }
+
+    /* Static */
+    uint32_t WriteAheadLog::checksum(uint64_t sequence) {
+        boost::crc_32_type crc;
+        crc.process_bytes(&sequence, sizeof(sequence));
+        return crc.checksum();
+    }
+
+    // NOTE: Writes are expected to be made a page at a time, a write replaces the one at the same offset.
+    void WriteAheadLog::write_at(const char* buffer, size_t n, uint64_t offset) {
+        boost::lock_guard<boost::mutex> lock(_batch_mutex);
+        _batch.insert_or_assign(offset, Buffer(buffer, n));
+        if (offset + n > _size) _size = offset + n;
+    }
+
+    void WriteAheadLog::read_at(char* buffer, size_t n, uint64_t offset) {
+        {
+            boost::lock_guard<boost::mutex> lock(_batch_mutex);
+            for (const Batch* batch : {&_batch, &_committing}) {
+                auto it = batch->find(offset);
+                if (it != batch->end() && it->second.size() == n) {
+                    std::memcpy(buffer, it->second.buffer(), n);
+                    return;
+                }
+            }
+        }
+        _storage.read(buffer, n, offset);
+    }
+
+    uint64_t WriteAheadLog::size_impl() {
+        return _size;
+    }
+
+    // NOTE: Writes are durable once their batch is committed, see commit.
+    void WriteAheadLog::sync_impl() {}
+
+} // namespace diamond
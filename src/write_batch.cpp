@@ -0,0 +1,78 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdexcept>
+
+#include "diamond/write_batch.h"
+
+namespace diamond {
+
+    WriteBatch::Operation::Operation(Buffer collection_name, Buffer key, std::optional<Buffer> val)
+        : _collection_name(std::move(collection_name)),
+        _key(std::move(key)),
+        _val(std::move(val)) {}
+
+    const Buffer& WriteBatch::Operation::collection_name() const {
+        return _collection_name;
+    }
+
+    const Buffer& WriteBatch::Operation::key() const {
+        return _key;
+    }
+
+    bool WriteBatch::Operation::is_erase() const {
+        return !_val;
+    }
+
+    const Buffer& WriteBatch::Operation::val() const {
+        if (!_val) throw std::logic_error("erase has no value");
+        return *_val;
+    }
+
+    void WriteBatch::put(Buffer collection_name, Buffer key, Buffer val) {
+        _operations.emplace_back(std::move(collection_name), std::move(key), std::move(val));
+    }
+
+    void WriteBatch::erase(Buffer collection_name, Buffer key) {
+        _operations.emplace_back(std::move(collection_name), std::move(key), std::nullopt);
+    }
+
+    const std::vector<WriteBatch::Operation>& WriteBatch::operations() const {
+        return _operations;
+    }
+
+    size_t WriteBatch::size() const {
+        return _operations.size();
+    }
+
+    bool WriteBatch::empty() const {
+        return _operations.empty();
+    }
+
+    void WriteBatch::clear() {
+        _operations.clear();
+    }
+
+    void WriteBatch::set_sync(bool sync) {
+        _sync = sync;
+    }
+
+    bool WriteBatch::sync() const {
+        return _sync;
+    }
+
+} // namespace diamond
@@ -29,6 +29,7 @@ namespace {
         MOCK_METHOD(void, read_impl, (char* buffer, size_t n), (override));
         MOCK_METHOD(void, seek_impl, (size_t n), (override));
         MOCK_METHOD(uint64_t, size_impl, (), (override));
+        MOCK_METHOD(void, sync_impl, (), (override));
     };
 
 } // namespace
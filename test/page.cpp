@@ -15,8 +15,11 @@
 **  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <cstdio>
+
 #include "gtest/gtest.h"
 
+#include "diamond/exception.h"
 #include "diamond/memory_storage.h"
 #include "diamond/page.h"
 
@@ -52,6 +55,53 @@ namespace {
         delete page2;
     }
 
+    TEST(page_tests, write_and_read_overflowing_data_entry) {
+        diamond::MemoryStorage storage;
+
+        diamond::Page* page1 = diamond::Page::new_page(1, diamond::Page::Type::DATA);
+        diamond::Buffer chunk(std::string(diamond::Page::max_data_entry_size(true), 'x'));
+        page1->insert_data_entry(chunk, 5, 3);
+        EXPECT_EQ(page1->get_remaining_space(), 0);
+        page1->write_to_storage(storage);
+
+        diamond::Page* page2 = diamond::Page::from_storage(1, storage);
+        ASSERT_EQ(page2->get_num_data_entries(), 1u);
+        diamond::Page::DataEntry entry = page2->get_data_entry(0);
+        EXPECT_TRUE(entry.overflows());
+        EXPECT_EQ(entry.overflow_id(), 5u);
+        EXPECT_EQ(entry.overflow_index(), 3u);
+        EXPECT_EQ(entry.data(), chunk);
+
+        delete page1;
+        delete page2;
+    }
+
+    TEST(page_tests, erase_data_entry_keeps_other_indexes) {
+        diamond::Page* page = diamond::Page::new_page(1, diamond::Page::Type::DATA);
+        uint16_t empty_space = page->get_remaining_space();
+        page->insert_data_entry(diamond::Buffer("first"));
+        page->insert_data_entry(diamond::Buffer("second"));
+        page->insert_data_entry(diamond::Buffer("third"));
+
+        page->erase_data_entry(1);
+        EXPECT_EQ(page->get_data_entry(0).data(), diamond::Buffer("first"));
+        EXPECT_EQ(page->get_data_entry(2).data(), diamond::Buffer("third"));
+
+        // The erased entry's slot is reused
+        EXPECT_EQ(page->insert_data_entry(diamond::Buffer("fourth")), 1u);
+        EXPECT_EQ(page->get_data_entry(1).data(), diamond::Buffer("fourth"));
+
+        uint16_t remaining_space = page->get_remaining_space();
+        uint16_t freed = page->erase_data_entry(2);
+        freed += page->erase_data_entry(1);
+        freed += page->erase_data_entry(0);
+        EXPECT_EQ(page->get_num_data_entries(), 0u);
+        EXPECT_EQ(page->get_remaining_space(), empty_space);
+        EXPECT_EQ(remaining_space + freed, empty_space);
+
+        delete page;
+    }
+
     TEST(page_tests, write_and_read_free_list_page) {
         using TestInput = std::tuple<diamond::Page::ID, uint16_t>;
         std::vector<TestInput> free_list_entries = {
@@ -80,7 +130,7 @@ namespace {
         ASSERT_EQ(page2->get_num_free_list_entries(), free_list_entries.size());
         for (size_t i = 0; i < page1->get_num_free_list_entries(); i++) {
             const TestInput& free_list_entry = free_list_entries.at(i);
-            const diamond::Page::FreeListEntry& entry = page2->get_free_list_entry(i);
+            diamond::Page::FreeListEntry entry = page2->get_free_list_entry(i);
 
             EXPECT_EQ(entry.data_id(), std::get<0>(free_list_entry));
             EXPECT_EQ(entry.free_space(), std::get<1>(free_list_entry));
@@ -106,9 +156,8 @@ namespace {
         for (size_t i = 0; i < internal_nodes.size(); i++) {
             const TestInput& internal_node = internal_nodes.at(i);
             page1->insert_internal_node_entry(
-                page1->internal_node_entries_end(),
-                std::get<0>(internal_node),
-                std::get<1>(internal_node),
+                page1->get_num_internal_node_entries(),
+                diamond::Page::Key(std::get<0>(internal_node), std::get<1>(internal_node)),
                 std::get<2>(internal_node));
         }
 
@@ -118,13 +167,13 @@ namespace {
 
         ASSERT_EQ(page2->get_type(), diamond::Page::Type::INTERNAL_NODE);
         ASSERT_EQ(page2->get_num_internal_node_entries(), internal_nodes.size());
-        diamond::Page::InternalNodeEntryListIterator iter = page2->internal_node_entries_begin();
-        for (size_t i = 0; i < page1->get_num_internal_node_entries(); i++, iter++) {
+        for (size_t i = 0; i < page1->get_num_internal_node_entries(); i++) {
             const TestInput& internal_node = internal_nodes.at(i);
-            const diamond::Page::InternalNodeEntry& entry = *iter;
+            diamond::Page::InternalNodeEntry entry = page2->get_internal_node_entry(i);
 
-            EXPECT_EQ(entry.key_data_id(), std::get<0>(internal_node));
-            EXPECT_EQ(entry.key_data_index(), std::get<1>(internal_node));
+            EXPECT_FALSE(entry.key().inlined());
+            EXPECT_EQ(entry.key().data_id(), std::get<0>(internal_node));
+            EXPECT_EQ(entry.key().data_index(), std::get<1>(internal_node));
             EXPECT_EQ(entry.next_node_id(), std::get<2>(internal_node));
         }
 
@@ -148,9 +197,8 @@ namespace {
         for (size_t i = 0; i < leaf_nodes.size(); i++) {
             const TestInput& leaf_node = leaf_nodes.at(i);
             page1->insert_leaf_node_entry(
-                page1->leaf_node_entries_end(),
-                std::get<0>(leaf_node),
-                std::get<1>(leaf_node),
+                page1->get_num_leaf_node_entries(),
+                diamond::Page::Key(std::get<0>(leaf_node), std::get<1>(leaf_node)),
                 std::get<2>(leaf_node),
                 std::get<3>(leaf_node));
         }
@@ -162,13 +210,13 @@ namespace {
         ASSERT_EQ(page2->get_type(), diamond::Page::Type::LEAF_NODE);
         EXPECT_EQ(page2->get_next_leaf_node_page(), diamond::Page::INVALID_ID);
         ASSERT_EQ(page2->get_num_leaf_node_entries(), leaf_nodes.size());
-        diamond::Page::LeafNodeEntryListIterator iter = page2->leaf_node_entries_begin();
-        for (size_t i = 0; i < leaf_nodes.size(); i++, iter++) {
+        for (size_t i = 0; i < leaf_nodes.size(); i++) {
             const TestInput& leaf_node = leaf_nodes.at(i);
-            const diamond::Page::LeafNodeEntry& entry = *iter;
+            diamond::Page::LeafNodeEntry entry = page2->get_leaf_node_entry(i);
 
-            EXPECT_EQ(entry.key_data_id(), std::get<0>(leaf_node));
-            EXPECT_EQ(entry.key_data_index(), std::get<1>(leaf_node));
+            EXPECT_FALSE(entry.key().inlined());
+            EXPECT_EQ(entry.key().data_id(), std::get<0>(leaf_node));
+            EXPECT_EQ(entry.key().data_index(), std::get<1>(leaf_node));
             EXPECT_EQ(entry.val_data_id(), std::get<2>(leaf_node));
             EXPECT_EQ(entry.val_data_index(), std::get<3>(leaf_node));
         }
@@ -177,4 +225,73 @@ namespace {
         delete page2;
     }
 
+    TEST(page_tests, insert_and_split_leaf_node_entries) {
+        diamond::Page* page1 = diamond::Page::new_page(1, diamond::Page::Type::LEAF_NODE);
+        diamond::Page* page2 = diamond::Page::new_page(2, diamond::Page::Type::LEAF_NODE);
+
+        auto make_key = [](size_t i) {
+            char key[32];
+            std::snprintf(key, sizeof(key), "key%06zu", i);
+            return diamond::Buffer(key);
+        };
+
+        // Entries are inserted at the front, so they end up in reverse order
+        size_t n = 0;
+        while (page1->can_insert_leaf_node_entry(make_key(n))) {
+            page1->insert_leaf_node_entry(0, diamond::Page::Key(make_key(n)), 3, n);
+            n++;
+        }
+        ASSERT_EQ(page1->get_num_leaf_node_entries(), n);
+
+        page1->split_leaf_node_entries(page2);
+
+        size_t m = page1->get_num_leaf_node_entries();
+        EXPECT_EQ(m + page2->get_num_leaf_node_entries(), n);
+        EXPECT_EQ(page1->get_next_leaf_node_page(), page2->get_id());
+        EXPECT_EQ(page2->get_prev_leaf_node_page(), page1->get_id());
+        EXPECT_EQ(page2->get_next_leaf_node_page(), diamond::Page::INVALID_ID);
+        for (size_t i = 0; i < n; i++) {
+            diamond::Page::LeafNodeEntry entry = i < m
+                ? page1->get_leaf_node_entry(i)
+                : page2->get_leaf_node_entry(i - m);
+            EXPECT_TRUE(entry.key().inlined());
+            EXPECT_EQ(entry.key().data(), make_key(n - i - 1));
+            EXPECT_EQ(entry.val_data_index(), n - i - 1);
+        }
+
+        // The space freed by the split can be reused
+        while (page1->can_insert_leaf_node_entry(make_key(n))) {
+            page1->insert_leaf_node_entry(m, diamond::Page::Key(make_key(n)), 3, n);
+            m++;
+        }
+        EXPECT_EQ(m, n);
+        EXPECT_EQ(page1->get_leaf_node_entry(0).key().data(), make_key(n - 1));
+
+        delete page1;
+        delete page2;
+    }
+
+    TEST(page_tests, read_page_of_another_format_version) {
+        diamond::MemoryStorage storage;
+
+        diamond::Page* page = diamond::Page::new_page(1, diamond::Page::Type::LEAF_NODE);
+        page->insert_leaf_node_entry(0, diamond::Page::Key(diamond::Buffer("key")), 2, 0);
+        page->write_to_storage(storage);
+        delete page;
+
+        diamond::Page* read = diamond::Page::from_storage(1, storage);
+        ASSERT_EQ(read->get_leaf_node_entry_key(0).data(), "key");
+        delete read;
+
+        // The version follows the type in the header
+        uint8_t version = diamond::Page::FORMAT_VERSION + 1;
+        storage.write(reinterpret_cast<const char*>(&version), sizeof(version), 1);
+        try {
+            diamond::Page::from_storage(1, storage);
+            FAIL() << "expected an unsupported format";
+        } catch (const diamond::Exception& e) {
+            EXPECT_EQ(e.code(), diamond::ErrorCode::UNSUPPORTED_FILE_FORMAT);
+        }
+    }
+
 } // namespace
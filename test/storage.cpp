@@ -0,0 +1,240 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "diamond/buffer.h"
+#include "diamond/memory_storage.h"
+#include "diamond/mmap_storage.h"
+#include "diamond/page.h"
+#include "diamond/posix_file_storage.h"
+#include "diamond/uring_storage.h"
+
+namespace {
+
+    class StorageTest : public ::testing::Test {
+    protected:
+        StorageTest()
+            : _file_name(
+                (std::filesystem::temp_directory_path() / "diamond_storage_test").string()) {
+            std::remove(_file_name.c_str());
+        }
+
+        ~StorageTest() {
+            std::remove(_file_name.c_str());
+        }
+
+        static std::string make_page(int i) {
+            return std::string(diamond::Page::SIZE, 'a' + i % 26);
+        }
+
+        std::string _file_name;
+    };
+
+    TEST_F(StorageTest, mmap_storage_reads_file_while_it_grows) {
+        const int n = 4;
+        diamond::PosixFileStorage file(_file_name);
+        for (int i = 0; i < n; i++) {
+            file.write(make_page(i).data(), diamond::Page::SIZE, i * diamond::Page::SIZE);
+        }
+
+        diamond::MmapStorage mmap_storage(_file_name);
+        EXPECT_EQ(mmap_storage.size(), file.size());
+        EXPECT_THROW(mmap_storage.write("a", 1, 0), std::logic_error);
+
+        auto read_pages = [&](int num_pages) {
+            for (int i = 0; i < num_pages; i++) {
+                std::string page(diamond::Page::SIZE, '\0');
+                mmap_storage.read(page.data(), page.size(), i * diamond::Page::SIZE);
+                ASSERT_EQ(page, make_page(i)) << i;
+            }
+        };
+        read_pages(n);
+
+        // The extents already mapped see the pages written since
+        for (int i = n; i < 2 * n; i++) {
+            file.write(make_page(i).data(), diamond::Page::SIZE, i * diamond::Page::SIZE);
+        }
+        EXPECT_EQ(mmap_storage.size(), file.size());
+        read_pages(2 * n);
+
+        char buffer[4] = {'a', 'a', 'a', 'a'};
+        mmap_storage.read(buffer, sizeof(buffer), mmap_storage.size() - 2);
+        EXPECT_EQ(buffer[0], make_page(2 * n - 1)[0]);
+        EXPECT_EQ(buffer[2], 0);
+        EXPECT_EQ(buffer[3], 0);
+    }
+
+    TEST_F(StorageTest, posix_file_storage_concurrent_reads_and_writes) {
+        const int num_threads = 8;
+        const int n = 100;
+        {
+            diamond::PosixFileStorage storage(_file_name);
+            std::vector<std::thread> threads;
+            for (int t = 0; t < num_threads; t++) {
+                threads.emplace_back([&storage, num_threads, n, t]() {
+                    for (int i = 0; i < n; i++) {
+                        int k = i * num_threads + t;
+                        std::string page = make_page(k);
+                        storage.write(page.data(), page.size(), k * diamond::Page::SIZE);
+                        std::string read(diamond::Page::SIZE, '\0');
+                        storage.read(read.data(), read.size(), k * diamond::Page::SIZE);
+                        ASSERT_EQ(read, page) << k;
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+            storage.sync();
+        }
+
+        diamond::PosixFileStorage storage(_file_name);
+        EXPECT_EQ(storage.size(), num_threads * n * diamond::Page::SIZE);
+        for (int k = 0; k < num_threads * n; k++) {
+            std::string read(diamond::Page::SIZE, '\0');
+            storage.read(read.data(), read.size(), k * diamond::Page::SIZE);
+            ASSERT_EQ(read, make_page(k)) << k;
+        }
+    }
+
+    TEST_F(StorageTest, uring_storage_async_reads_and_writes) {
+        diamond::UringStorage storage(_file_name, 8);
+        // More writes than the queue is deep, all in flight at once
+        std::vector<std::string> pages;
+        std::vector<std::future<void>> futures;
+        for (int i = 0; i < 32; i++) {
+            pages.push_back(make_page(i));
+        }
+        for (int i = 0; i < 32; i++) {
+            futures.push_back(storage.write_async(pages[i].data(), pages[i].size(), i * diamond::Page::SIZE));
+        }
+        storage.submit();
+        for (std::future<void>& future : futures) {
+            future.get();
+        }
+        EXPECT_EQ(storage.size(), 32 * diamond::Page::SIZE);
+
+        std::vector<std::string> read(32, std::string(diamond::Page::SIZE, '\0'));
+        futures.clear();
+        for (int i = 31; i >= 0; i--) {
+            futures.push_back(storage.read_async(read[i].data(), read[i].size(), i * diamond::Page::SIZE));
+        }
+        storage.submit();
+        for (std::future<void>& future : futures) {
+            future.get();
+        }
+        EXPECT_EQ(read, pages);
+    }
+
+    TEST_F(StorageTest, uring_storage_batches_from_many_threads) {
+        const int num_threads = 4;
+        const int n = 64;
+        // Far more completions than the ring holds, so the kernel keeps the ones that overflow it
+        diamond::UringStorage storage(_file_name, 2);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([&storage, num_threads, n, t]() {
+                std::vector<std::string> pages;
+                std::vector<diamond::Storage::Write> writes;
+                for (int i = 0; i < n; i++) {
+                    pages.push_back(make_page(t));
+                }
+                for (int i = 0; i < n; i++) {
+                    writes.push_back(diamond::Storage::Write{
+                        pages[i].data(),
+                        pages[i].size(),
+                        static_cast<uint64_t>(i * num_threads + t) * diamond::Page::SIZE});
+                }
+                for (int r = 0; r < 10; r++) {
+                    storage.write(writes);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        EXPECT_EQ(storage.size(), num_threads * n * diamond::Page::SIZE);
+        for (int k = 0; k < num_threads * n; k++) {
+            std::string read(diamond::Page::SIZE, '\0');
+            storage.read(read.data(), read.size(), k * diamond::Page::SIZE);
+            ASSERT_EQ(read, make_page(k % num_threads)) << k;
+        }
+    }
+
+    TEST_F(StorageTest, direct_file_storage_reads_and_writes_unaligned) {
+        const int n = 4;
+        diamond::PosixFileStorage storage(_file_name, true);
+        for (int i = 0; i < n; i++) {
+            // Copies of pages, like the ones the background writer and the log keep, are aligned
+            diamond::Buffer page(make_page(i).data(), diamond::Page::SIZE);
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(page.buffer()) % diamond::PosixFileStorage::DIRECT_ALIGNMENT, 0u);
+            page.write_to_storage(storage, i * diamond::Page::SIZE);
+        }
+        uint64_t size = storage.size();
+        EXPECT_EQ(size, n * diamond::Page::SIZE);
+
+        // Unaligned reads and writes keep the rest of the blocks they touch
+        std::string page = make_page(n - 1);
+        std::string data = "unaligned";
+        storage.write(data.data(), data.size(), size - diamond::Page::SIZE + 100);
+        page.replace(100, data.size(), data);
+        std::string read(diamond::Page::SIZE + 1, 'x');
+        storage.read(read.data() + 1, diamond::Page::SIZE, size - diamond::Page::SIZE);
+        EXPECT_EQ(read.substr(1), page);
+        EXPECT_EQ(storage.size(), size);
+
+        // Reads past the blocks of a write see what was there
+        std::string before(diamond::Page::SIZE, '\0');
+        storage.read(before.data(), before.size(), size - 2 * diamond::Page::SIZE);
+        EXPECT_EQ(before, make_page(n - 2));
+    }
+
+    TEST_F(StorageTest, memory_storage_grows_in_chunks) {
+        diamond::MemoryStorage storage;
+        EXPECT_EQ(storage.size(), 0u);
+
+        // A write across the end of the first chunk
+        std::string page = make_page(0);
+        uint64_t offset = diamond::MemoryStorage::CHUNK_SIZE - page.size() / 2;
+        storage.write(page.data(), page.size(), offset);
+        EXPECT_EQ(storage.size(), offset + page.size());
+        std::string read(page.size(), '\0');
+        storage.read(read.data(), read.size(), offset);
+        EXPECT_EQ(read, page);
+
+        // Bytes that were never written are read as zeros
+        storage.read(read.data(), read.size(), 0);
+        EXPECT_EQ(read, std::string(page.size(), '\0'));
+
+        storage.truncate(offset + 1);
+        EXPECT_EQ(storage.size(), offset + 1);
+        storage.read(read.data(), read.size(), offset);
+        EXPECT_EQ(read[0], page[0]);
+        EXPECT_EQ(read.substr(1), std::string(page.size() - 1, '\0'));
+    }
+
+} // namespace
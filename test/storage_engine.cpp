@@ -0,0 +1,1506 @@
+/*  Diamond - Embedded NoSQL Database
+**  Copyright (C) 2020  Zach Perkitny
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <future>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "diamond/bg_page_writer.h"
+#include "diamond/exception.h"
+#include "diamond/file_storage.h"
+#include "diamond/lru_eviction_policy.h"
+#include "diamond/memory_storage.h"
+#include "diamond/mmap_storage.h"
+#include "diamond/partitioned_page_manager.h"
+#include "diamond/posix_file_storage.h"
+#include "diamond/storage_engine.h"
+#include "diamond/sync_page_writer.h"
+#include "diamond/uring_storage.h"
+#include "diamond/value_log.h"
+#include "diamond/write_ahead_log.h"
+#include "diamond/write_batch.h"
+
+namespace {
+
+    class StorageEngineTest : public ::testing::Test {
+    protected:
+        StorageEngineTest()
+            : _file_name(
+                (std::filesystem::temp_directory_path() / "diamond_storage_engine_test").string()) {
+            std::remove(_file_name.c_str());
+            _storage = std::make_unique<diamond::FileStorage>(_file_name);
+            _page_writer_factory = std::make_unique<diamond::SyncPageWriterFactory>(*_storage);
+            _manager = std::make_unique<diamond::PartitionedPageManager>(
+                *_storage,
+                *_page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                16);
+            _engine = std::make_unique<diamond::StorageEngine>(*_manager);
+        }
+
+        ~StorageEngineTest() {
+            _engine.reset();
+            _manager.reset();
+            _page_writer_factory.reset();
+            _storage.reset();
+            std::remove(_file_name.c_str());
+        }
+
+        static std::string make_key(int i) {
+            char key[16];
+            std::snprintf(key, sizeof(key), "key%08d", i);
+            return key;
+        }
+
+        std::string _file_name;
+        std::unique_ptr<diamond::FileStorage> _storage;
+        std::unique_ptr<diamond::SyncPageWriterFactory> _page_writer_factory;
+        diamond::LRUEvictionPolicyFactory _eviction_policy_factory;
+        std::unique_ptr<diamond::PartitionedPageManager> _manager;
+        std::unique_ptr<diamond::StorageEngine> _engine;
+    };
+
+    TEST_F(StorageEngineTest, put_grows_tree_past_one_leaf) {
+        const int n = 5000;
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+        diamond::Buffer collection("collection");
+        for (int i : order) {
+            _engine->put(collection, make_key(i), "val" + std::to_string(i));
+        }
+
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(n));
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), "val" + std::to_string(i));
+        }
+        EXPECT_FALSE(_engine->exists(collection, make_key(n)));
+
+        int i = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        for (; !iter.end(); iter.next(), i++) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+        }
+        EXPECT_EQ(i, n);
+    }
+
+    TEST_F(StorageEngineTest, put_updates_existing_key) {
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < 1000; i++) {
+            _engine->put(collection, make_key(i), "old");
+        }
+        for (int i = 0; i < 1000; i++) {
+            _engine->put(collection, make_key(i), "new");
+        }
+
+        EXPECT_EQ(_engine->count(collection), 1000u);
+        for (int i = 0; i < 1000; i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), "new");
+        }
+    }
+
+    TEST_F(StorageEngineTest, get_finds_keys_inserted_in_descending_order) {
+        const int n = 3000;
+        diamond::Buffer collection("collection");
+        for (int i = n - 1; i >= 0; i--) {
+            _engine->put(collection, make_key(i * 2), std::to_string(i));
+        }
+
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i * 2)).to_str(), std::to_string(i));
+            ASSERT_FALSE(_engine->exists(collection, make_key(i * 2 + 1)));
+        }
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(n));
+    }
+
+    TEST_F(StorageEngineTest, put_mixes_inline_and_large_keys) {
+        const int n = 500;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            // Every third key is too large to be stored in the leaf itself
+            std::string key = make_key(i);
+            if (i % 3 == 0) key.append(diamond::Page::MAX_INLINE_KEY_SIZE, 'x');
+            _engine->put(collection, key, std::to_string(i));
+        }
+
+        int i = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        for (; !iter.end(); iter.next(), i++) {
+            std::string key = make_key(i);
+            if (i % 3 == 0) key.append(diamond::Page::MAX_INLINE_KEY_SIZE, 'x');
+            ASSERT_EQ(iter.key().to_str(), key);
+            ASSERT_EQ(_engine->get(collection, key).to_str(), std::to_string(i));
+        }
+        EXPECT_EQ(i, n);
+    }
+
+    TEST_F(StorageEngineTest, put_and_read_values_larger_than_a_page) {
+        diamond::Buffer collection("collection");
+        std::mt19937 gen(7);
+        std::vector<std::string> values;
+        for (size_t size = 20 * 1024; size <= 200 * 1024; size += 45 * 1024) {
+            std::string value(size, '\0');
+            for (char& c : value) c = static_cast<char>(gen());
+            _engine->put(collection, make_key(values.size()), value);
+            values.push_back(std::move(value));
+        }
+
+        for (size_t i = 0; i < values.size(); i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), values[i]);
+
+            // Read in pieces that don't line up with the chunks stored in each page
+            diamond::StorageEngine::ValueReader reader = _engine->get_reader(collection, make_key(i));
+            std::string value;
+            char piece[1000];
+            while (value.size() + sizeof(piece) <= values[i].size()) {
+                reader.read(piece, sizeof(piece));
+                value.append(piece, sizeof(piece));
+            }
+            value.append(reader.read_all().to_str());
+            EXPECT_TRUE(reader.end());
+            ASSERT_EQ(value, values[i]);
+        }
+    }
+
+    TEST_F(StorageEngineTest, concurrent_puts_into_one_collection) {
+        const int num_threads = 8;
+        const int n = 2000;
+        diamond::Buffer collection("collection");
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([this, &collection, t]() {
+                for (int i = 0; i < n; i++) {
+                    int k = i * num_threads + t;
+                    _engine->put(collection, make_key(k), std::to_string(k));
+                    // Readers descend concurrently with the writers splitting pages
+                    ASSERT_TRUE(_engine->exists(collection, make_key(k)));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(num_threads * n));
+        int i = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        for (; !iter.end(); iter.next(), i++) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+            ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+        }
+        EXPECT_EQ(i, num_threads * n);
+    }
+
+    TEST_F(StorageEngineTest, iterator_on_empty_collection_is_at_end) {
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator("empty");
+        EXPECT_TRUE(iter.end());
+    }
+
+    TEST_F(StorageEngineTest, iterator_seeks_to_start_key) {
+        const int n = 5000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i * 2), std::to_string(i * 2));
+        }
+
+        // Start keys that are present, missing, and past every key
+        for (int start : {0, 1, 2001, 4000, 9998, 9999}) {
+            int i = start + start % 2;
+            diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection, make_key(start));
+            for (; !iter.end(); iter.next(), i += 2) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+            }
+            EXPECT_EQ(i, 2 * n);
+        }
+    }
+
+    TEST_F(StorageEngineTest, iterator_stops_before_end_key) {
+        const int n = 5000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i * 2), std::to_string(i * 2));
+        }
+
+        std::vector<std::pair<int, int>> ranges = {{0, 10}, {1, 9}, {3000, 3001}, {3000, 3002}, {5001, 7777}, {9990, 20000}};
+        for (auto [start, end] : ranges) {
+            int i = start + start % 2;
+            diamond::StorageEngine::Iterator iter = _engine->get_iterator(
+                collection,
+                make_key(start),
+                make_key(end));
+            for (; !iter.end(); iter.next(), i += 2) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+            }
+            EXPECT_EQ(i, std::min(end + end % 2, 2 * n));
+        }
+
+        EXPECT_TRUE(_engine->get_iterator(collection, make_key(10), make_key(10)).end());
+        EXPECT_TRUE(_engine->get_iterator(collection, make_key(20), make_key(10)).end());
+    }
+
+    TEST_F(StorageEngineTest, iterator_moves_backward_across_leaves) {
+        const int n = 5000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i * 2), std::to_string(i * 2));
+        }
+
+        int i = 2 * (n - 1);
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        iter.seek_to_last();
+        for (; !iter.end(); iter.prev(), i -= 2) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+            ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+        }
+        EXPECT_EQ(i, -2);
+
+        // Turn around after crossing leaves, then move below the start key
+        diamond::StorageEngine::Iterator iter2 = _engine->get_iterator(collection, make_key(3001));
+        for (int j = 0; j < 1000; j++) iter2.next();
+        EXPECT_EQ(iter2.key().to_str(), make_key(5002));
+        for (int j = 0; j < 1000; j++) iter2.prev();
+        EXPECT_EQ(iter2.key().to_str(), make_key(3002));
+        iter2.prev();
+        EXPECT_TRUE(iter2.end());
+    }
+
+    TEST_F(StorageEngineTest, iterator_moves_backward_within_bounds) {
+        const int n = 5000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i * 2), std::to_string(i * 2));
+        }
+
+        std::vector<std::pair<int, int>> ranges = {{0, 10}, {1, 9}, {3000, 3001}, {3000, 3002}, {5001, 7777}, {9990, 20000}};
+        for (auto [start, end] : ranges) {
+            int i = std::min(end + end % 2, 2 * n) - 2;
+            diamond::StorageEngine::Iterator iter = _engine->get_iterator(
+                collection,
+                make_key(start),
+                make_key(end));
+            iter.seek_to_last();
+            for (; !iter.end(); iter.prev(), i -= 2) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+            }
+            EXPECT_EQ(i, start + start % 2 - 2);
+        }
+
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator("empty");
+        iter.seek_to_last();
+        EXPECT_TRUE(iter.end());
+    }
+
+    TEST_F(StorageEngineTest, reverse_iteration_during_concurrent_writes) {
+        const int n = 4000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i * 2), std::to_string(i * 2));
+        }
+
+        // Writers split and merge leaves under the readers, the even keys stay put
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([this, &collection, t]() {
+                for (int i = t; i < n; i += 4) {
+                    _engine->put(collection, make_key(i * 2 + 1), std::string(100, 'x'));
+                }
+                for (int i = t; i < n; i += 4) {
+                    ASSERT_TRUE(_engine->erase(collection, make_key(i * 2 + 1)));
+                }
+            });
+        }
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([this, &collection]() {
+                for (int r = 0; r < 5; r++) {
+                    int i = 2 * n;
+                    diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+                    iter.seek_to_last();
+                    for (; !iter.end(); iter.prev()) {
+                        int k = std::stoi(iter.key().to_str().substr(3));
+                        ASSERT_LT(k, i);
+                        if (k % 2 == 0) {
+                            ASSERT_EQ(k, i - 2);
+                            i = k;
+                        }
+                    }
+                    ASSERT_EQ(i, 0);
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    TEST_F(StorageEngineTest, snapshot_iterator_sees_point_in_time_view) {
+        diamond::Buffer collection("collection");
+        const int n = 3000;
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), "a" + std::to_string(i));
+        }
+
+        diamond::StorageEngine::Snapshot snapshot = _engine->get_snapshot();
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection, snapshot);
+        diamond::StorageEngine::Iterator reverse_iter = _engine->get_iterator(
+            collection,
+            make_key(100),
+            make_key(2900),
+            snapshot);
+        reverse_iter.seek_to_last();
+
+        // No leaf stays locked, so the changes can be made on this thread between moves
+        int i = 0;
+        int j = 2899;
+        while (!iter.end()) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+            ASSERT_EQ(iter.val().to_str(), "a" + std::to_string(i));
+            _engine->put(collection, make_key(i), "b");
+            _engine->put(collection, make_key(i) + "x", "b");
+            if (i + 1 < n && (i + 1) % 3 == 0) {
+                _engine->erase(collection, make_key(i + 1));
+            }
+            iter.next();
+            i++;
+
+            if (!reverse_iter.end()) {
+                ASSERT_EQ(reverse_iter.key().to_str(), make_key(j));
+                ASSERT_EQ(reverse_iter.val().to_str(), "a" + std::to_string(j));
+                _engine->erase(collection, make_key(j - 1));
+                reverse_iter.prev();
+                j--;
+            }
+        }
+        EXPECT_EQ(i, n);
+        EXPECT_TRUE(reverse_iter.end());
+        EXPECT_EQ(j, 99);
+
+        // A new snapshot sees the changes
+        diamond::StorageEngine::Snapshot new_snapshot = _engine->get_snapshot();
+        int num_keys = 0;
+        for (diamond::StorageEngine::Iterator new_iter = _engine->get_iterator(collection, new_snapshot);
+                !new_iter.end();
+                new_iter.next()) {
+            EXPECT_EQ(new_iter.val().to_str(), "b");
+            num_keys++;
+        }
+        EXPECT_EQ(static_cast<uint64_t>(num_keys), _engine->count(collection));
+    }
+
+    TEST_F(StorageEngineTest, snapshot_keeps_replaced_values_until_released) {
+        diamond::Buffer collection("collection");
+        const int n = 500;
+        auto make_val = [](int i, char c) {
+            // Some values are split across overflow entries
+            return std::string(i % 100 == 0 ? 3 * diamond::Page::SIZE : 200, c);
+        };
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), make_val(i, 'a'));
+        }
+
+        uint64_t size;
+        {
+            diamond::StorageEngine::Snapshot snapshot = _engine->get_snapshot();
+            for (int i = 0; i < n; i++) {
+                if (i % 3 == 0) {
+                    ASSERT_TRUE(_engine->erase(collection, make_key(i)));
+                } else {
+                    _engine->put(collection, make_key(i), make_val(i, 'b'));
+                }
+            }
+
+            // The replaced values are still where they were
+            int i = 0;
+            for (diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection, snapshot);
+                    !iter.end();
+                    iter.next(), i++) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), make_val(i, 'a'));
+            }
+            EXPECT_EQ(i, n);
+            size = _storage->size();
+        }
+
+        // Releasing the snapshot freed them, the updates take their space
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), make_val(i, 'c'));
+        }
+        EXPECT_LT(_storage->size(), size + size / 10);
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), make_val(i, 'c'));
+        }
+    }
+
+    TEST_F(StorageEngineTest, erase_shrinks_tree_back_to_one_leaf) {
+        const int n = 5000;
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+        diamond::Buffer collection("collection");
+        for (int i : order) {
+            _engine->put(collection, make_key(i), "val" + std::to_string(i));
+        }
+
+        // Erase every key but the multiples of 10
+        std::shuffle(order.begin(), order.end(), std::mt19937(43));
+        for (int i : order) {
+            if (i % 10 != 0) {
+                ASSERT_TRUE(_engine->erase(collection, make_key(i)));
+            }
+        }
+
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(n / 10));
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->exists(collection, make_key(i)), i % 10 == 0);
+        }
+        int i = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        for (; !iter.end(); iter.next(), i += 10) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+            ASSERT_EQ(iter.val().to_str(), "val" + std::to_string(i));
+        }
+        EXPECT_EQ(i, n);
+
+        for (int i = 0; i < n; i += 10) {
+            ASSERT_TRUE(_engine->erase(collection, make_key(i)));
+        }
+        EXPECT_EQ(_engine->count(collection), 0u);
+        EXPECT_TRUE(_engine->get_iterator(collection).end());
+
+        for (int i : order) {
+            _engine->put(collection, make_key(i), std::to_string(i));
+        }
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), std::to_string(i));
+        }
+    }
+
+    TEST_F(StorageEngineTest, erase_large_keys) {
+        const int n = 5000;
+        diamond::Buffer collection("collection");
+        auto make_large_key = [](int i) {
+            return make_key(i) + std::string(diamond::Page::MAX_INLINE_KEY_SIZE, 'x');
+        };
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+        for (int i : order) {
+            _engine->put(collection, make_large_key(i), std::to_string(i));
+        }
+        // Erased keys can still separate the nodes of the remaining ones
+        for (int i = 0; i < n; i += 10) {
+            ASSERT_TRUE(_engine->erase(collection, make_large_key(i)));
+        }
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::to_string(i));
+        }
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->exists(collection, make_large_key(i)), i % 10 != 0);
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), std::to_string(i));
+        }
+    }
+
+    TEST_F(StorageEngineTest, erase_missing_key_returns_false) {
+        diamond::Buffer collection("collection");
+        EXPECT_FALSE(_engine->erase(collection, make_key(0)));
+        _engine->put(collection, make_key(0), "val");
+        EXPECT_FALSE(_engine->erase(collection, make_key(1)));
+        EXPECT_TRUE(_engine->erase(collection, make_key(0)));
+        EXPECT_FALSE(_engine->erase(collection, make_key(0)));
+        EXPECT_THROW(_engine->get(collection, make_key(0)), diamond::Exception);
+    }
+
+    TEST_F(StorageEngineTest, erase_and_update_reuse_freed_space) {
+        diamond::Buffer collection("collection");
+        const int n = 2000;
+        std::string large_key_suffix(diamond::Page::MAX_INLINE_KEY_SIZE, 'x');
+        auto fill = [&](char c) {
+            for (int i = 0; i < n; i++) {
+                std::string key = make_key(i);
+                if (i % 4 == 0) key += large_key_suffix;
+                // Some values are split across overflow entries
+                size_t size = i % 100 == 0 ? 3 * diamond::Page::SIZE : 200;
+                _engine->put(collection, key, std::string(size, c));
+            }
+        };
+
+        fill('a');
+        uint64_t size = _storage->size();
+        fill('b');
+        // Updates need room for the new values before the old ones are freed
+        uint64_t updated_size = _storage->size();
+        EXPECT_LT(updated_size, size + size / 4);
+        for (int i = 0; i < n; i++) {
+            std::string key = make_key(i);
+            if (i % 4 == 0) key += large_key_suffix;
+            ASSERT_EQ(_engine->get(collection, key).to_str()[0], 'b');
+            ASSERT_TRUE(_engine->erase(collection, key));
+        }
+        fill('c');
+        // Only the nodes of the new tree take new pages, freed nodes and keys are reused
+        EXPECT_LT(_storage->size(), updated_size + size / 10);
+    }
+
+    TEST_F(StorageEngineTest, freed_space_is_reused_after_reopen) {
+        diamond::Buffer collection("collection");
+        const int n = 3000;
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::string(300, 'a'));
+        }
+        for (int i = 0; i < n; i += 2) {
+            ASSERT_TRUE(_engine->erase(collection, make_key(i)));
+        }
+        uint64_t size = _storage->size();
+
+        // The free space map is loaded back from the FREE_LIST pages
+        _engine.reset();
+        _manager = std::make_unique<diamond::PartitionedPageManager>(
+            *_storage,
+            *_page_writer_factory,
+            _eviction_policy_factory,
+            8,
+            16);
+        _engine = std::make_unique<diamond::StorageEngine>(*_manager);
+        for (int i = 0; i < n; i += 2) {
+            _engine->put(collection, make_key(i), std::string(300, 'b'));
+        }
+        EXPECT_LT(_storage->size(), size + size / 10);
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->get(collection, make_key(i)).to_str()[0], i % 2 == 0 ? 'b' : 'a');
+        }
+    }
+
+    TEST_F(StorageEngineTest, stale_free_space_after_a_crash_falls_back_to_a_new_page) {
+        std::string crashed_file_name = _file_name + "_crashed";
+        diamond::Buffer collection("collection");
+        const int n = 200;
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::string(100, 'a'));
+        }
+        // The process dies here, the space taken in the data pages since they were added was never stored
+        _storage->sync();
+        std::filesystem::copy_file(_file_name, crashed_file_name, std::filesystem::copy_options::overwrite_existing);
+
+        {
+            diamond::FileStorage storage(crashed_file_name);
+            diamond::SyncPageWriterFactory page_writer_factory(storage);
+            diamond::PartitionedPageManager manager(storage, page_writer_factory, _eviction_policy_factory, 8, 16);
+            diamond::StorageEngine engine(manager);
+            for (int i = n; i < 2 * n; i++) {
+                engine.put(collection, make_key(i), std::string(100, 'b'));
+            }
+            for (int i = 0; i < 2 * n; i++) {
+                ASSERT_EQ(engine.get(collection, make_key(i)).to_str(), std::string(100, i < n ? 'a' : 'b')) << i;
+            }
+        }
+        std::remove(crashed_file_name.c_str());
+    }
+
+    TEST_F(StorageEngineTest, write_batch_applies_puts_and_erases_across_collections) {
+        const int n = 5000;
+        for (int i = 0; i < n; i += 2) {
+            _engine->put("first", make_key(i), "old");
+        }
+
+        diamond::WriteBatch batch;
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+        for (int i : order) {
+            // Updates and inserts into the first collection, erases every fourth key
+            batch.put("first", make_key(i), std::to_string(i));
+            if (i % 4 == 0) batch.erase("first", make_key(i));
+            batch.put("second", make_key(i), std::to_string(-i));
+        }
+        // Later operations on a key win
+        batch.put("second", make_key(0), "last");
+        batch.erase("first", make_key(n + 1));
+        _engine->write(batch);
+
+        EXPECT_EQ(_engine->count("first"), static_cast<uint64_t>(n - n / 4));
+        EXPECT_EQ(_engine->count("second"), static_cast<uint64_t>(n));
+        for (int i = 0; i < n; i++) {
+            if (i % 4 == 0) {
+                ASSERT_FALSE(_engine->exists("first", make_key(i)));
+            } else {
+                ASSERT_EQ(_engine->get("first", make_key(i)).to_str(), std::to_string(i));
+            }
+            ASSERT_EQ(_engine->get("second", make_key(i)).to_str(), i == 0 ? "last" : std::to_string(-i));
+        }
+
+        // Erasing most keys in one batch merges leaves like single erases do
+        diamond::WriteBatch erase_batch;
+        for (int i = 0; i < n; i++) {
+            if (i % 100 != 0) erase_batch.erase("second", make_key(i));
+        }
+        _engine->write(erase_batch);
+        int i = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator("second");
+        for (; !iter.end(); iter.next(), i += 100) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+        }
+        EXPECT_EQ(i, n);
+    }
+
+    TEST_F(StorageEngineTest, bulk_load_builds_tree_from_sorted_pairs) {
+        const int n = 20000;
+        std::vector<std::pair<std::string, std::string>> pairs;
+        for (int i = 0; i < n; i++) {
+            std::string key = make_key(i);
+            // Some keys and values don't fit in the leaf or a single DATA page
+            if (i % 1000 == 0) key.append(diamond::Page::MAX_INLINE_KEY_SIZE, 'x');
+            std::string val = i % 5000 == 0 ? std::string(3 * diamond::Page::SIZE, 'v') : std::to_string(i);
+            pairs.emplace_back(std::move(key), std::move(val));
+        }
+
+        diamond::Buffer collection("collection");
+        _engine->bulk_load(collection, pairs.begin(), pairs.end());
+
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(n));
+        for (const auto& [key, val] : pairs) {
+            ASSERT_EQ(_engine->get(collection, key).to_str(), val);
+        }
+        int i = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        for (; !iter.end(); iter.next(), i++) {
+            ASSERT_EQ(iter.key().to_str(), pairs[i].first);
+        }
+        EXPECT_EQ(i, n);
+        iter.seek_to_last();
+        for (; !iter.end(); iter.prev()) {
+            ASSERT_EQ(iter.key().to_str(), pairs[--i].first);
+        }
+        EXPECT_EQ(i, 0);
+
+        // The loaded tree takes puts and erases like any other
+        for (int i = 0; i < n; i += 2) {
+            ASSERT_TRUE(_engine->erase(collection, pairs[i].first));
+            _engine->put(collection, make_key(n + i), "new");
+        }
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(n));
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(_engine->exists(collection, pairs[i].first), i % 2 == 1);
+        }
+    }
+
+    TEST_F(StorageEngineTest, bulk_load_fill_factor_leaves_room_in_pages) {
+        const int n = 20000;
+        auto load = [&](const diamond::Buffer& collection, double fill_factor) {
+            int i = 0;
+            uint64_t size = _storage->size();
+            _engine->bulk_load(
+                collection,
+                [&i](diamond::Buffer& key, diamond::Buffer& val) {
+                    if (i == n) return false;
+                    key = make_key(i++);
+                    val = "val";
+                    return true;
+                },
+                fill_factor);
+            return _storage->size() - size;
+        };
+
+        uint64_t full_size = load("full", 1.0);
+        uint64_t half_size = load("half", 0.5);
+        EXPECT_GT(half_size, full_size);
+        EXPECT_EQ(_engine->count("full"), static_cast<uint64_t>(n));
+        EXPECT_EQ(_engine->count("half"), static_cast<uint64_t>(n));
+    }
+
+    TEST_F(StorageEngineTest, bulk_load_rejects_invalid_input) {
+        std::vector<std::pair<std::string, std::string>> unsorted = {{"b", "1"}, {"a", "2"}};
+        std::vector<std::pair<std::string, std::string>> duplicates = {{"a", "1"}, {"a", "2"}};
+        EXPECT_THROW(_engine->bulk_load("unsorted", unsorted.begin(), unsorted.end()), std::invalid_argument);
+        EXPECT_THROW(_engine->bulk_load("duplicates", duplicates.begin(), duplicates.end()), std::invalid_argument);
+        EXPECT_THROW(_engine->bulk_load("fill", duplicates.begin(), duplicates.begin(), 0.0), std::invalid_argument);
+
+        _engine->put("not_empty", "a", "1");
+        std::vector<std::pair<std::string, std::string>> pairs = {{"b", "2"}};
+        EXPECT_THROW(_engine->bulk_load("not_empty", pairs.begin(), pairs.end()), std::logic_error);
+
+        // Nothing is loaded when there is nothing to load
+        _engine->bulk_load("empty", pairs.begin(), pairs.begin());
+        EXPECT_TRUE(_engine->get_iterator("empty").end());
+    }
+
+    TEST_F(StorageEngineTest, failed_bulk_load_frees_its_pages) {
+        diamond::Buffer collection("collection");
+        const int n = 5000;
+        auto source = [&](int fail_at) {
+            return [&, fail_at, i = 0](diamond::Buffer& key, diamond::Buffer& val) mutable {
+                if (i == fail_at) throw std::runtime_error("source failed");
+                if (i == n) return false;
+                std::string k = make_key(i);
+                if (i % 4 == 0) k.append(diamond::Page::MAX_INLINE_KEY_SIZE, 'x');
+                key = k;
+                val = std::string(300, 'a' + i++ % 26);
+                return true;
+            };
+        };
+
+        _engine->put("other", "key", "val");
+        uint64_t size = _storage->size();
+        EXPECT_THROW(_engine->bulk_load(collection, source(n - 1)), std::runtime_error);
+        uint64_t failed_size = _storage->size();
+        EXPECT_EQ(_engine->count(collection), 0u);
+        EXPECT_TRUE(_engine->get_iterator(collection).end());
+
+        // The pages of the failed load are on the free list, the values put next fill them
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::string(300, 'b'));
+        }
+        EXPECT_LT(_storage->size(), failed_size + (failed_size - size) / 4);
+
+        // A load can still be made once the collection is empty again
+        for (int i = 0; i < n; i++) {
+            ASSERT_TRUE(_engine->erase(collection, make_key(i)));
+        }
+        _engine->bulk_load(collection, source(-1));
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(n));
+        EXPECT_EQ(_engine->get(collection, make_key(1)).to_str(), std::string(300, 'b'));
+    }
+
+    TEST_F(StorageEngineTest, multi_get_returns_values_in_key_order) {
+        const int n = 2000;
+        diamond::Buffer collection("collection");
+        std::string large_val(diamond::Page::SIZE * 2, 'v');
+        for (int i = 0; i < n; i++) {
+            // Keys that are multiples of 3 are missing, every hundredth value overflows its page
+            if (i % 3 == 0) continue;
+            _engine->put(collection, make_key(i), i % 100 == 1 ? large_val : std::to_string(i));
+        }
+
+        std::vector<diamond::Buffer> keys;
+        for (int i = n + 10; i >= 0; i -= 7) keys.push_back(make_key(i));
+        keys.push_back(make_key(1));
+        keys.push_back(make_key(1));
+
+        std::vector<std::optional<diamond::Buffer>> vals = _engine->multi_get(collection, keys);
+        ASSERT_EQ(keys.size(), vals.size());
+        for (size_t j = 0; j < keys.size(); j++) {
+            int i = std::stoi(keys[j].to_str().substr(3));
+            if (i % 3 == 0 || i >= n) {
+                EXPECT_FALSE(vals[j]) << i;
+            } else {
+                ASSERT_TRUE(vals[j]) << i;
+                EXPECT_EQ(i % 100 == 1 ? large_val : std::to_string(i), vals[j]->to_str());
+            }
+        }
+
+        EXPECT_TRUE(_engine->multi_get(collection, {}).empty());
+    }
+
+    TEST_F(StorageEngineTest, count_is_kept_in_collection_entry) {
+        const int n = 3000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::to_string(i));
+        }
+        // Updates leave the count alone, only erases of existing keys lower it
+        for (int i = 0; i < n; i += 2) {
+            _engine->put(collection, make_key(i), "new");
+        }
+        for (int i = 0; i < n + 100; i += 3) {
+            _engine->erase(collection, make_key(i));
+        }
+        const uint64_t expected = n - (n + 2) / 3;
+        EXPECT_EQ(_engine->count(collection), expected);
+        EXPECT_EQ(_engine->count("empty"), 0u);
+
+        // The count is read back from the COLLECTIONS page once the engine is reopened
+        _engine.reset();
+        _manager = std::make_unique<diamond::PartitionedPageManager>(
+            *_storage,
+            *_page_writer_factory,
+            _eviction_policy_factory,
+            8,
+            16);
+        _engine = std::make_unique<diamond::StorageEngine>(*_manager);
+        EXPECT_EQ(_engine->count(collection), expected);
+    }
+
+    TEST_F(StorageEngineTest, count_is_recounted_after_a_crash) {
+        std::string crashed_file_name = _file_name + "_crashed";
+        const int n = 3000;
+        diamond::Buffer collection("collection");
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::to_string(i));
+        }
+        // The process dies here, the count was never stored
+        _storage->sync();
+        std::filesystem::copy_file(_file_name, crashed_file_name, std::filesystem::copy_options::overwrite_existing);
+
+        for (int reopen = 0; reopen < 2; reopen++) {
+            diamond::FileStorage storage(crashed_file_name);
+            diamond::SyncPageWriterFactory page_writer_factory(storage);
+            diamond::PartitionedPageManager manager(storage, page_writer_factory, _eviction_policy_factory, 8, 16);
+            diamond::StorageEngine engine(manager);
+            EXPECT_EQ(engine.count(collection), static_cast<uint64_t>(n + reopen));
+            // Stored once the engine is destroyed
+            engine.put(collection, "new", "val");
+        }
+        std::remove(crashed_file_name.c_str());
+    }
+
+    TEST_F(StorageEngineTest, collection_handle_reaches_same_collection_as_name) {
+        diamond::StorageEngine::CollectionHandle handle = _engine->get_collection("collection");
+        EXPECT_EQ(handle.name(), diamond::Buffer("collection"));
+        for (int i = 0; i < 1000; i++) {
+            _engine->put(handle, make_key(i), std::to_string(i));
+        }
+        EXPECT_TRUE(_engine->erase(handle, make_key(0)));
+
+        EXPECT_EQ(_engine->count("collection"), 999u);
+        EXPECT_EQ(_engine->get("collection", make_key(500)).to_str(), "500");
+        EXPECT_TRUE(_engine->exists(handle, make_key(999)));
+        EXPECT_FALSE(_engine->exists(handle, make_key(0)));
+        EXPECT_EQ(_engine->get_iterator(handle).key().to_str(), make_key(1));
+    }
+
+    TEST_F(StorageEngineTest, concurrent_lookups_create_each_collection_once) {
+        const int num_threads = 8;
+        const int num_collections = 300;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([this, t]() {
+                // Every thread starts at a different collection
+                for (int i = 0; i < num_collections; i++) {
+                    int c = (i + t * num_collections / num_threads) % num_collections;
+                    _engine->put("collection" + std::to_string(c), make_key(t), std::to_string(c));
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        for (int c = 0; c < num_collections; c++) {
+            std::string collection = "collection" + std::to_string(c);
+            ASSERT_EQ(_engine->count(collection), static_cast<uint64_t>(num_threads)) << collection;
+            EXPECT_EQ(_engine->get(collection, make_key(0)).to_str(), std::to_string(c));
+        }
+    }
+
+    TEST_F(StorageEngineTest, value_log_keeps_large_values_and_collects_garbage) {
+        diamond::FileValueLogSegmentFactory segment_factory(
+            (std::filesystem::temp_directory_path() / "diamond_value_log_test").string());
+        for (uint32_t segment_id : segment_factory.list()) {
+            segment_factory.remove(segment_id);
+        }
+
+        {
+            // Small segments, so updates leave whole segments of garbage behind
+            diamond::ValueLog value_log(segment_factory, 100, 8 * 1024);
+            _engine = std::make_unique<diamond::StorageEngine>(*_manager, &value_log);
+
+            const int n = 200;
+            diamond::Buffer collection("collection");
+            auto make_val = [](int i, char c) {
+                return std::string(500 + i, c);
+            };
+            for (int i = 0; i < n; i++) {
+                _engine->put(collection, make_key(i), make_val(i, 'a'));
+            }
+            _engine->put(collection, "small", "val");
+            size_t num_segments = segment_factory.list().size();
+            EXPECT_GT(num_segments, 1u);
+
+            // Nothing is garbage yet
+            EXPECT_FALSE(_engine->collect_value_log_garbage(0.5));
+
+            for (int i = 0; i < n; i += 2) {
+                _engine->put(collection, make_key(i), make_val(i, 'b'));
+            }
+            for (int i = 1; i < n; i += 4) {
+                ASSERT_TRUE(_engine->erase(collection, make_key(i)));
+            }
+            int num_collected = 0;
+            while (_engine->collect_value_log_garbage(0.5)) num_collected++;
+            EXPECT_GT(num_collected, 0);
+
+            auto expected_val = [&make_val](int i) -> std::optional<std::string> {
+                if (i % 2 == 0) return make_val(i, 'b');
+                if (i % 4 == 1) return std::nullopt;
+                return make_val(i, 'a');
+            };
+            for (int i = 0; i < n; i++) {
+                std::optional<std::string> expected = expected_val(i);
+                ASSERT_EQ(_engine->exists(collection, make_key(i)), expected.has_value()) << i;
+                if (expected) {
+                    ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), *expected) << i;
+                }
+            }
+            EXPECT_EQ(_engine->get(collection, "small").to_str(), "val");
+
+            std::vector<diamond::Buffer> keys = {make_key(2), make_key(3), make_key(5)};
+            std::vector<std::optional<diamond::Buffer>> vals = _engine->multi_get(collection, keys);
+            EXPECT_EQ(vals[0]->to_str(), make_val(2, 'b'));
+            EXPECT_EQ(vals[1]->to_str(), make_val(3, 'a'));
+            EXPECT_FALSE(vals[2]);
+
+            int i = 0;
+            for (diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection, make_key(0), make_key(n));
+                    !iter.end();
+                    iter.next()) {
+                while (!expected_val(i)) i++;
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), *expected_val(i)) << i;
+                i++;
+            }
+            EXPECT_EQ(i, n);
+
+            // Everything still in use was moved to the end of the log
+            EXPECT_FALSE(_engine->collect_value_log_garbage(0.5));
+            _engine.reset();
+        }
+
+        for (uint32_t segment_id : segment_factory.list()) {
+            segment_factory.remove(segment_id);
+        }
+    }
+
+    TEST_F(StorageEngineTest, value_log_garbage_is_collected_after_reopen) {
+        diamond::FileValueLogSegmentFactory segment_factory(
+            (std::filesystem::temp_directory_path() / "diamond_value_log_test").string());
+        for (uint32_t segment_id : segment_factory.list()) {
+            segment_factory.remove(segment_id);
+        }
+
+        const int n = 100;
+        diamond::Buffer collection("collection");
+        {
+            diamond::ValueLog value_log(segment_factory, 100, 8 * 1024);
+            _engine = std::make_unique<diamond::StorageEngine>(*_manager, &value_log);
+            for (int i = 0; i < n; i++) {
+                _engine->put(collection, make_key(i), std::string(500, 'a'));
+            }
+            for (int i = 0; i < n; i++) {
+                _engine->put(collection, make_key(i), std::string(500, 'b'));
+            }
+            _engine.reset();
+        }
+
+        {
+            // The garbage was counted before the log was opened again
+            diamond::ValueLog value_log(segment_factory, 100, 8 * 1024);
+            _engine = std::make_unique<diamond::StorageEngine>(*_manager, &value_log);
+            EXPECT_TRUE(_engine->collect_value_log_garbage(0.5));
+            for (int i = 0; i < n; i++) {
+                ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), std::string(500, 'b')) << i;
+            }
+            _engine.reset();
+        }
+
+        for (uint32_t segment_id : segment_factory.list()) {
+            segment_factory.remove(segment_id);
+        }
+    }
+
+    TEST_F(StorageEngineTest, value_log_garbage_collection_moves_values_of_snapshots) {
+        diamond::FileValueLogSegmentFactory segment_factory(
+            (std::filesystem::temp_directory_path() / "diamond_value_log_test").string());
+        for (uint32_t segment_id : segment_factory.list()) {
+            segment_factory.remove(segment_id);
+        }
+
+        const int n = 100;
+        diamond::Buffer collection("collection");
+        {
+            diamond::ValueLog value_log(segment_factory, 100, 8 * 1024);
+            _engine = std::make_unique<diamond::StorageEngine>(*_manager, &value_log);
+            for (int i = 0; i < n; i++) {
+                _engine->put(collection, make_key(i), std::string(500, 'a'));
+            }
+            for (int i = 0; i < n; i += 2) {
+                _engine->put(collection, make_key(i), std::string(500, 'b'));
+            }
+
+            // The odd values are only kept by the snapshot's versions while their segments are collected
+            {
+                diamond::StorageEngine::Snapshot snapshot = _engine->get_snapshot();
+                for (int i = 1; i < n; i += 2) {
+                    _engine->put(collection, make_key(i), std::string(500, 'c'));
+                }
+                int num_collected = 0;
+                while (_engine->collect_value_log_garbage(0.4)) num_collected++;
+                EXPECT_GT(num_collected, 0);
+
+                int i = 0;
+                for (diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection, snapshot);
+                        !iter.end();
+                        iter.next(), i++) {
+                    ASSERT_EQ(iter.val().to_str(), std::string(500, i % 2 == 0 ? 'b' : 'a')) << i;
+                }
+                EXPECT_EQ(i, n);
+            }
+
+            // Releasing the snapshot made the moved values garbage
+            EXPECT_TRUE(_engine->collect_value_log_garbage(0.4));
+            for (int i = 0; i < n; i++) {
+                ASSERT_EQ(_engine->get(collection, make_key(i)).to_str(), std::string(500, i % 2 == 0 ? 'b' : 'c'));
+            }
+            _engine.reset();
+        }
+
+        for (uint32_t segment_id : segment_factory.list()) {
+            segment_factory.remove(segment_id);
+        }
+    }
+
+    TEST_F(StorageEngineTest, write_ahead_log_recovers_lost_page_writes) {
+        std::filesystem::path dir = std::filesystem::temp_directory_path();
+        std::string log_file_name = (dir / "diamond_write_ahead_log_test").string();
+        std::string db_file_name = (dir / "diamond_write_ahead_log_test_db").string();
+        std::remove(log_file_name.c_str());
+        std::remove(db_file_name.c_str());
+
+        const int n = 2000;
+        diamond::Buffer collection("collection");
+        auto open = [&](auto test) {
+            diamond::FileStorage log_storage(log_file_name);
+            diamond::FileStorage storage(db_file_name);
+            diamond::WriteAheadLog wal(log_storage, storage);
+            diamond::SyncPageWriterFactory page_writer_factory(wal);
+            diamond::PartitionedPageManager manager(
+                wal,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                16);
+            diamond::StorageEngine engine(manager, nullptr, &wal);
+            test(engine, wal);
+        };
+
+        open([&](diamond::StorageEngine& engine, diamond::WriteAheadLog& wal) {
+            for (int i = 0; i < n; i++) {
+                engine.put(collection, make_key(i), std::to_string(i));
+            }
+            wal.commit();
+            for (int i = 0; i < n; i += 2) {
+                ASSERT_TRUE(engine.erase(collection, make_key(i)));
+            }
+        });
+
+        // Every page write is lost, the log alone brings the tree back
+        std::remove(db_file_name.c_str());
+        open([&](diamond::StorageEngine& engine, diamond::WriteAheadLog&) {
+            ASSERT_EQ(engine.count(collection), static_cast<uint64_t>(n / 2));
+            for (int i = 0; i < n; i++) {
+                ASSERT_EQ(engine.exists(collection, make_key(i)), i % 2 == 1) << i;
+            }
+            diamond::StorageEngine::Iterator iter = engine.get_iterator(collection);
+            for (int i = 1; i < n; i += 2, iter.next()) {
+                ASSERT_FALSE(iter.end());
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+            }
+            EXPECT_TRUE(iter.end());
+            engine.put(collection, make_key(0), "0");
+        });
+
+        // The log was started over, the file is consistent on its own
+        open([&](diamond::StorageEngine& engine, diamond::WriteAheadLog&) {
+            EXPECT_EQ(engine.count(collection), static_cast<uint64_t>(n / 2 + 1));
+            EXPECT_EQ(engine.get(collection, make_key(0)).to_str(), "0");
+        });
+
+        std::remove(log_file_name.c_str());
+        std::remove(db_file_name.c_str());
+    }
+
+    TEST_F(StorageEngineTest, write_ahead_log_checkpoints_bound_its_size) {
+        std::string log_file_name = (std::filesystem::temp_directory_path() / "diamond_write_ahead_log_test").string();
+        std::remove(log_file_name.c_str());
+
+        _engine.reset();
+        _manager.reset();
+        const uint64_t checkpoint_size = 64 * 1024;
+        const int n = 5000;
+        diamond::Buffer collection("collection");
+        auto open = [&](auto test) {
+            diamond::FileStorage log_storage(log_file_name);
+            diamond::WriteAheadLog wal(log_storage, *_storage, checkpoint_size);
+            diamond::SyncPageWriterFactory page_writer_factory(wal);
+            diamond::PartitionedPageManager manager(
+                wal,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                16);
+            diamond::StorageEngine engine(manager, nullptr, &wal);
+            test(engine, wal, log_storage);
+        };
+
+        open([&](diamond::StorageEngine& engine, diamond::WriteAheadLog& wal, diamond::FileStorage& log_storage) {
+            uint64_t checkpoint_sequence = wal.checkpoint_sequence();
+            for (int i = 0; i < n; i++) {
+                engine.put(collection, make_key(i), std::to_string(i));
+                if (i % 100 == 0) wal.commit();
+            }
+            wal.commit();
+            EXPECT_GT(wal.checkpoint_sequence(), checkpoint_sequence);
+            // A batch is at most every page of the file
+            EXPECT_LE(log_storage.size(), checkpoint_size + 2 * _storage->size());
+            // The log is cut back to its header
+            wal.checkpoint();
+            EXPECT_LT(log_storage.size(), static_cast<uint64_t>(diamond::Page::SIZE));
+        });
+
+        open([&](diamond::StorageEngine& engine, diamond::WriteAheadLog&, diamond::FileStorage&) {
+            ASSERT_EQ(engine.count(collection), static_cast<uint64_t>(n));
+            for (int i = 0; i < n; i++) {
+                ASSERT_EQ(engine.get(collection, make_key(i)).to_str(), std::to_string(i)) << i;
+            }
+        });
+
+        {
+            // Pages written in the background could miss their batch, so they're refused
+            diamond::FileStorage log_storage(log_file_name);
+            diamond::WriteAheadLog wal(log_storage, *_storage, checkpoint_size);
+            diamond::BgPageWriterQueue queue(wal);
+            diamond::BgPageWriterFactory page_writer_factory(queue);
+            diamond::PartitionedPageManager manager(wal, page_writer_factory, _eviction_policy_factory, 8, 16);
+            EXPECT_THROW(diamond::StorageEngine(manager, nullptr, &wal), std::invalid_argument);
+        }
+
+        std::remove(log_file_name.c_str());
+    }
+
+    TEST_F(StorageEngineTest, write_ahead_log_operations_are_kept_per_log) {
+        diamond::MemoryStorage log_storage, storage, other_log_storage, other_storage;
+        diamond::WriteAheadLog wal(log_storage, storage);
+        diamond::WriteAheadLog other_wal(other_log_storage, other_storage);
+
+        std::future<void> commit;
+        {
+            diamond::WriteAheadLog::Operation operation(&wal);
+            // Being in an operation of one log doesn't make this one part of it
+            diamond::WriteAheadLog::Operation other_operation(&other_wal);
+            commit = std::async(std::launch::async, [&other_wal]() {
+                other_wal.commit();
+            });
+            EXPECT_EQ(commit.wait_for(std::chrono::milliseconds(50)), std::future_status::timeout);
+        }
+        commit.get();
+    }
+
+    TEST_F(StorageEngineTest, synced_writes_survive_a_crash) {
+        std::filesystem::path dir = std::filesystem::temp_directory_path();
+        std::string log_file_name = (dir / "diamond_write_ahead_log_test").string();
+        std::string crashed_log_file_name = (dir / "diamond_write_ahead_log_test_crashed").string();
+        std::string db_file_name = (dir / "diamond_write_ahead_log_test_db").string();
+        std::remove(log_file_name.c_str());
+        std::remove(db_file_name.c_str());
+
+        const int n = 1000;
+        diamond::Buffer collection("collection");
+        auto open = [&](const std::string& log_name, auto test) {
+            diamond::FileStorage log_storage(log_name);
+            diamond::FileStorage storage(db_file_name);
+            diamond::WriteAheadLog wal(log_storage, storage);
+            diamond::SyncPageWriterFactory page_writer_factory(wal);
+            diamond::PartitionedPageManager manager(
+                wal,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                16);
+            diamond::StorageEngine engine(manager, nullptr, &wal);
+            test(engine);
+        };
+
+        open(log_file_name, [&](diamond::StorageEngine& engine) {
+            diamond::WriteBatch batch;
+            for (int i = 0; i < n; i++) {
+                batch.put(collection, make_key(i), std::to_string(i));
+            }
+            batch.set_sync(true);
+            engine.write(batch);
+            engine.put(collection, make_key(n), std::to_string(n));
+            engine.sync();
+            // The process dies here, only what reached the log is left
+            std::filesystem::copy_file(
+                log_file_name,
+                crashed_log_file_name,
+                std::filesystem::copy_options::overwrite_existing);
+        });
+
+        std::remove(db_file_name.c_str());
+        open(crashed_log_file_name, [&](diamond::StorageEngine& engine) {
+            ASSERT_EQ(engine.count(collection), static_cast<uint64_t>(n + 1));
+            for (int i = 0; i <= n; i++) {
+                ASSERT_EQ(engine.get(collection, make_key(i)).to_str(), std::to_string(i)) << i;
+            }
+        });
+
+        std::remove(log_file_name.c_str());
+        std::remove(crashed_log_file_name.c_str());
+        std::remove(db_file_name.c_str());
+    }
+
+    TEST_F(StorageEngineTest, mmap_storage_reads_database_while_it_grows) {
+        diamond::Buffer collection("collection");
+        const int n = 2000;
+        for (int i = 0; i < n; i++) {
+            _engine->put(collection, make_key(i), std::to_string(i));
+        }
+        _storage->sync();
+
+        diamond::MmapStorage mmap_storage(_file_name);
+        auto count_keys = [&]() {
+            diamond::SyncPageWriterFactory page_writer_factory(mmap_storage);
+            diamond::PartitionedPageManager manager(
+                mmap_storage,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                16);
+            diamond::StorageEngine engine(manager);
+            int i = 0;
+            for (diamond::StorageEngine::Iterator iter = engine.get_iterator(collection); !iter.end(); iter.next(), i++) {
+                EXPECT_EQ(iter.key().to_str(), make_key(i));
+                EXPECT_EQ(iter.val().to_str(), std::to_string(i));
+            }
+            return i;
+        };
+        EXPECT_EQ(count_keys(), n);
+
+        // The extents already mapped see the pages written since
+        for (int i = n; i < 2 * n; i++) {
+            _engine->put(collection, make_key(i), std::to_string(i));
+        }
+        _storage->sync();
+        EXPECT_EQ(count_keys(), 2 * n);
+    }
+
+    TEST_F(StorageEngineTest, posix_file_storage_concurrent_puts_and_reopen) {
+        _engine.reset();
+        _manager.reset();
+        std::remove(_file_name.c_str());
+
+        const int num_threads = 8;
+        const int n = 1000;
+        diamond::Buffer collection("collection");
+        auto open = [&](auto test) {
+            diamond::PosixFileStorage storage(_file_name);
+            diamond::SyncPageWriterFactory page_writer_factory(storage);
+            // Few pages per partition, so misses read the file from every thread
+            diamond::PartitionedPageManager manager(
+                storage,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                4);
+            diamond::StorageEngine engine(manager);
+            test(engine);
+        };
+
+        open([&](diamond::StorageEngine& engine) {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < num_threads; t++) {
+                threads.emplace_back([&engine, &collection, num_threads, n, t]() {
+                    for (int i = 0; i < n; i++) {
+                        int k = i * num_threads + t;
+                        engine.put(collection, make_key(k), std::to_string(k));
+                        ASSERT_EQ(engine.get(collection, make_key(k)).to_str(), std::to_string(k));
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        });
+
+        open([&](diamond::StorageEngine& engine) {
+            EXPECT_EQ(engine.count(collection), static_cast<uint64_t>(num_threads * n));
+            int i = 0;
+            for (diamond::StorageEngine::Iterator iter = engine.get_iterator(collection); !iter.end(); iter.next(), i++) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+            }
+            EXPECT_EQ(i, num_threads * n);
+        });
+    }
+
+    TEST_F(StorageEngineTest, uring_storage_takes_background_page_writes) {
+        _engine.reset();
+        _manager.reset();
+        std::remove(_file_name.c_str());
+
+        const int n = 200;
+        diamond::Buffer collection("collection");
+        auto open = [&](auto test) {
+            diamond::UringStorage storage(_file_name);
+            diamond::BgPageWriterQueue queue(storage);
+            diamond::BgPageWriterFactory page_writer_factory(queue);
+            diamond::PartitionedPageManager manager(
+                storage,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                4);
+            diamond::StorageEngine engine(manager);
+            test(engine);
+        };
+
+        open([&](diamond::StorageEngine& engine) {
+            for (int i = 0; i < n; i++) {
+                engine.put(collection, make_key(i), std::to_string(i));
+            }
+        });
+
+        open([&](diamond::StorageEngine& engine) {
+            int i = 0;
+            for (diamond::StorageEngine::Iterator iter = engine.get_iterator(collection); !iter.end(); iter.next(), i++) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+            }
+            EXPECT_EQ(i, n);
+        });
+    }
+
+    TEST_F(StorageEngineTest, direct_file_storage_runs_the_engine) {
+        _engine.reset();
+        _manager.reset();
+        std::remove(_file_name.c_str());
+
+        const int n = 2000;
+        diamond::Buffer collection("collection");
+        auto open = [&](auto test) {
+            diamond::PosixFileStorage storage(_file_name, true);
+            diamond::SyncPageWriterFactory page_writer_factory(storage);
+            diamond::PartitionedPageManager manager(
+                storage,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                4);
+            diamond::StorageEngine engine(manager);
+            test(engine);
+        };
+
+        open([&](diamond::StorageEngine& engine) {
+            for (int i = 0; i < n; i++) {
+                engine.put(collection, make_key(i), std::to_string(i));
+            }
+        });
+
+        open([&](diamond::StorageEngine& engine) {
+            int i = 0;
+            for (diamond::StorageEngine::Iterator iter = engine.get_iterator(collection); !iter.end(); iter.next(), i++) {
+                ASSERT_EQ(iter.key().to_str(), make_key(i));
+                ASSERT_EQ(iter.val().to_str(), std::to_string(i));
+            }
+            EXPECT_EQ(i, n);
+        });
+    }
+
+    TEST_F(StorageEngineTest, memory_storage_runs_the_engine) {
+        const int num_threads = 8;
+        const int n = 1000;
+        diamond::Buffer collection("collection");
+        // Values large enough to fill more than one chunk
+        auto value = [](int k) { return std::to_string(k) + std::string(1000, 'x'); };
+        diamond::MemoryStorage storage;
+        {
+            diamond::SyncPageWriterFactory page_writer_factory(storage);
+            // Few pages per partition, so pages are evicted and read back from every thread, but enough for every thread's pinned ones
+            diamond::PartitionedPageManager manager(
+                storage,
+                page_writer_factory,
+                _eviction_policy_factory,
+                8,
+                16);
+            diamond::StorageEngine engine(manager);
+
+            std::vector<std::thread> threads;
+            for (int t = 0; t < num_threads; t++) {
+                threads.emplace_back([&engine, &collection, &value, num_threads, n, t]() {
+                    for (int i = 0; i < n; i++) {
+                        int k = i * num_threads + t;
+                        engine.put(collection, make_key(k), value(k));
+                        ASSERT_EQ(engine.get(collection, make_key(k)).to_str(), value(k));
+                    }
+                });
+            }
+            for (std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+        // More than one chunk, and only whole pages were written
+        EXPECT_TRUE(storage.size() > diamond::MemoryStorage::CHUNK_SIZE);
+        EXPECT_EQ(storage.size() % diamond::Page::SIZE, 0u);
+
+        diamond::SyncPageWriterFactory page_writer_factory(storage);
+        diamond::PartitionedPageManager manager(storage, page_writer_factory, _eviction_policy_factory);
+        diamond::StorageEngine engine(manager);
+        int i = 0;
+        for (diamond::StorageEngine::Iterator iter = engine.get_iterator(collection); !iter.end(); iter.next(), i++) {
+            ASSERT_EQ(iter.key().to_str(), make_key(i));
+            ASSERT_EQ(iter.val().to_str(), value(i));
+        }
+        EXPECT_EQ(i, num_threads * n);
+    }
+
+    TEST_F(StorageEngineTest, concurrent_erases_and_puts) {
+        const int num_threads = 8;
+        const int n = 1000;
+        diamond::Buffer collection("collection");
+        for (int k = 0; k < num_threads * n; k++) {
+            _engine->put(collection, make_key(k), std::to_string(k));
+        }
+
+        // Half of the threads erase their keys while the others put new ones
+        std::vector<std::thread> threads;
+        for (int t = 0; t < num_threads; t++) {
+            threads.emplace_back([this, &collection, t]() {
+                for (int i = 0; i < n; i++) {
+                    int k = i * num_threads + t;
+                    if (t % 2 == 0) {
+                        ASSERT_TRUE(_engine->erase(collection, make_key(k)));
+                        ASSERT_FALSE(_engine->exists(collection, make_key(k)));
+                    } else {
+                        _engine->put(collection, make_key(num_threads * n + k), std::to_string(k));
+                        ASSERT_TRUE(_engine->exists(collection, make_key(k)));
+                    }
+                }
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        EXPECT_EQ(_engine->count(collection), static_cast<uint64_t>(num_threads * n));
+        int count = 0;
+        diamond::StorageEngine::Iterator iter = _engine->get_iterator(collection);
+        for (; !iter.end(); iter.next(), count++) {
+            int k = std::stoi(iter.key().to_str().substr(3));
+            ASSERT_TRUE(k >= num_threads * n || k % num_threads % 2 == 1);
+        }
+        EXPECT_EQ(count, num_threads * n);
+    }
+
+} // namespace